@@ -1,17 +1,26 @@
 #include "assemble.hpp"
 
 #include "file.hpp"
+#include "image.hpp"
 #include "instructions.hpp"
-#include "static_hashtable.hpp"
+#include "lexer.hpp"
+#include "optimize.hpp"
+#include "perf.hpp"
+#include "sourcemap.hpp"
+#include "static_assemble.hpp"
+
+#include <sys/inotify.h>
+#include <unistd.h>
 
 namespace {
 
-bool hasErrors = false;
-void reportError(std::string error)
-{
-    LOGE("{}\n", error);
-    hasErrors = true;
-}
+// the compile time assembler shares the lexer, keep both in step
+static_assert(assembleProgram<"x, load x\nfadd 1023\nhartid\n0x10\n">()
+    == std::array<Marie16::Word, 4> { 0x1000, 0xF7FF, 0xF000, 0x10 });
+// errors are reported at compile time too, on the line they are on
+static_assert(assembleStatic<Marie16, 16>("load x\nbogus &\nx, 0x1\n").error->line == 2);
+// an undefined label fails in the binary pass, on the line that names it
+static_assert(assembleStatic<Marie16, 32>("load x\nadd y\nhalt\nx, 0x1\n").error->line == 2);
 
 enum struct DataType {
     Identifier,
@@ -19,410 +28,565 @@ enum struct DataType {
     Word,
 };
 
-constexpr Word maxAddressSize()
+// line 0 marks words the optimizer appended, they have no place in the source
+struct SourcePosition {
+    u32 line {};
+    u32 column {};
+};
+
+SourcePosition positionOf(const Lexer& lex, std::size_t textLocation)
 {
-    Word value = 2;
-    for (int i = 0; i < 11; i++)
-        value *= 2;
-    return value;
+    const auto [line, column] = lex.getPosition(textLocation);
+    return { static_cast<u32>(line), static_cast<u32>(column) };
 }
 
+template <typename WordType>
 struct InstructionData {
     Instruction instr;
     DataType dataType;
-    std::size_t textLocation;
+    SourcePosition position;
     union {
         std::string_view identifier;
-        Word literal;
+        WordType literal;
     };
 };
 
-enum struct Token {
-    Label,
-    DecNumber,
-    HexNumber,
-
-    Jns,
-    Load,
-    Store,
-    Add,
-    Subt,
-    Input,
-    Output,
-    Halt,
-    Skipcond,
-    Jump,
-    Clear,
-    AddI,
-    JumpI,
-    LoadI,
-    StoreI,
-
-    Comma,
-    Unknown,
-
-    Eof,
-};
-
-const char* tokenToString(Token tok)
+// lexes the next token and formats the error the lexer found in it
+std::pair<Token, std::size_t> nextToken(Lexer& lex, std::vector<std::string>& errors)
 {
-    switch (tok) {
-    case Token::Label:
-        return "Token::Label";
-    case Token::DecNumber:
-        return "Token::DecNumber";
-    case Token::HexNumber:
-        return "Token::HexNumber";
-    case Token::Jns:
-        return "Token::Jns";
-    case Token::Load:
-        return "Token::Load";
-    case Token::Store:
-        return "Token::Store";
-    case Token::Add:
-        return "Token::Add";
-    case Token::Subt:
-        return "Token::Subt";
-    case Token::Input:
-        return "Token::Input";
-    case Token::Output:
-        return "Token::Output";
-    case Token::Halt:
-        return "Token::Halt";
-    case Token::Skipcond:
-        return "Token::Skipcond";
-    case Token::Jump:
-        return "Token::Jump";
-    case Token::Clear:
-        return "Token::Clear";
-    case Token::AddI:
-        return "Token::AddI";
-    case Token::JumpI:
-        return "Token::JumpI";
-    case Token::LoadI:
-        return "Token::LoadI";
-    case Token::StoreI:
-        return "Token::StoreI";
-    case Token::Comma:
-        return "Token::Comma";
-    case Token::Unknown:
-        return "Token::Unknown";
-    case Token::Eof:
-        return "Token::Eof";
-    default:
-        return "Unknown Token";
+    auto token = lex.nextToken();
+    if (auto error = lex.takeError()) {
+        auto errorInfo = lex.getLine(error->textLocation);
+        switch (error->kind) {
+        case LexError::Kind::MissingHexDigits:
+            errors.push_back(fmt::format("on line {}\n{}\nexpected a number after 0x instead got {}",
+                errorInfo.first,
+                errorInfo.second,
+                error->character));
+            break;
+        case LexError::Kind::UnexpectedCharacter:
+            errors.push_back(fmt::format("[lexer error] on line {}\n{}\nunexpected character: [{}], [{}]",
+                errorInfo.first,
+                errorInfo.second,
+                error->character,
+                int(error->character)));
+            break;
+        }
     }
+    return token;
 }
 
-bool tokenIsInstruction(Token tok)
-{
-    return (static_cast<int>(tok) >= static_cast<int>(Token::Jns) && static_cast<int>(tok) <= static_cast<int>(Token::StoreI));
-}
-
-Instruction tokenToInstruction(Token tok)
-{
-    if (!tokenIsInstruction(tok)) {
-        reportError(fmt::format("token {} is not an instruction", tokenToString(tok)));
+// What one worker parsed out of a run of whole lines. Labels hold indices into
+// the chunk's instructions until the chunks are merged, errors are reported in
+// chunk order once every worker is done.
+template <typename WordType>
+struct ParsedChunk {
+    explicit ParsedChunk(std::string_view chunkText)
+        : text(chunkText)
+    {
     }
 
-    constexpr int offset = static_cast<int>(Token::Jns) - static_cast<int>(Instruction::Jns);
-
-    return static_cast<Instruction>(static_cast<int>(tok) - offset);
-}
-
-bool tokenHasZeroOperands(Token tok)
-{
-    return (static_cast<int>(tok) >= static_cast<int>(Token::Input) && static_cast<int>(tok) <= static_cast<int>(Token::Halt)) || tok == Token::Clear;
-}
-
-struct Lexer {
-    explicit Lexer(const std::string_view text);
-
-    std::pair<Token, std::size_t> nextToken();
-
-    std::string_view getPrevString();
-    std::pair<std::size_t, std::string_view> getLine(std::size_t textLocation);
-
-private:
-    std::string_view mText;
-    std::size_t mTextLocation {};
-    std::size_t mLineNumber = 1;
-    // map of which index a new line is contained
-    // text location, line number
-    std::map<std::size_t, std::size_t> mNewLines;
-
-    std::string_view mPrevString;
-    static constexpr std::size_t PrevStringLowerBufferSize = 15;
-    std::array<char, PrevStringLowerBufferSize> mPrevStringLower;
-
-    char nextChar();
-    char peekChar();
-    void consumeChar();
-
-    static constexpr bool isNum(const char c);
-    static constexpr bool isAlpha(const char c);
-    static constexpr bool isAlphaNum(const char c);
-    static constexpr bool isWhiteSpace(const char c);
-
-    // void consumeUntilNewline();
-};
-
-constexpr std::size_t string_view_hash(std::string_view str)
-{
-    std::size_t hash = 0;
-    for (auto c : str) {
-        hash = static_cast<std::size_t>(c) + (hash << 6) + (hash << 16) - hash;
+    // starts over on new text, keeping the capacity of the vectors
+    void reset(std::string_view chunkText)
+    {
+        text = chunkText;
+        instructions.clear();
+        labels.clear();
+        errors.clear();
+        dangling = false;
     }
-    return hash;
-}
 
-static constinit static_hashtable<std::string_view, Token, 30, string_view_hash> keywords({
-    { "jns", Token::Jns },
-    { "load", Token::Load },
-    { "store", Token::Store },
-    { "add", Token::Add },
-    { "subt", Token::Subt },
-    { "input", Token::Input },
-    { "output", Token::Output },
-    { "halt", Token::Halt },
-    { "skipcond", Token::Skipcond },
-    { "jump", Token::Jump },
-    { "clear", Token::Clear },
-    { "addi", Token::AddI },
-    { "jumpi", Token::JumpI },
-    { "loadi", Token::LoadI },
-    { "storei", Token::StoreI },
-});
+    struct Label {
+        std::string_view name;
+        WordType index;
+        u32 line;
+    };
 
-Lexer::Lexer(std::string_view text)
-    : mText(text)
-{
-    // insert the first line into the map
-    mNewLines.insert(std::pair(0, 1));
-}
+    std::string_view text;
+    std::vector<InstructionData<WordType>> instructions;
+    std::vector<Label> labels;
+    std::vector<std::string> errors;
+    // the chunk ended inside a statement, e.g. between an instruction and its operand
+    bool dangling = false;
+};
 
-std::pair<Token, std::size_t> Lexer::nextToken()
+// about one chunk per core, cut after a newline, sources below a MiB per chunk are not worth the threads.
+// Reuses the chunks already in the vector.
+template <typename WordType>
+void splitChunks(std::string_view text, std::vector<ParsedChunk<WordType>>& chunks)
 {
-    char c;
-start:
-    c = nextChar();
+    constexpr std::size_t MinChunkBytes = std::size_t { 1 } << 20;
+    const std::size_t count = std::clamp<std::size_t>(text.size() / MinChunkBytes, 1, std::max(1U, std::thread::hardware_concurrency()));
 
-    while (isWhiteSpace(c)) {
-        c = nextChar();
+    std::size_t used = 0;
+    const auto add = [&](std::string_view chunkText) {
+        if (used < chunks.size()) {
+            chunks[used].reset(chunkText);
+        } else {
+            chunks.emplace_back(chunkText);
+        }
+        used++;
+    };
+    std::size_t start = 0;
+    for (std::size_t i = 1; i <= count && start < text.size(); i++) {
+        std::size_t end = text.size();
+        if (i < count) {
+            end = text.find('\n', std::max(start, text.size() / count * i));
+            end = end == std::string_view::npos ? text.size() : end + 1;
+        }
+        add(text.substr(start, end - start));
+        start = end;
     }
-
-    if (c == '\0') {
-        return { Token::Eof, mTextLocation };
+    if (used == 0) {
+        add(text);
     }
+    chunks.erase(chunks.begin() + static_cast<std::ptrdiff_t>(used), chunks.end());
+}
 
-    if (c == ';') {
-        c = nextChar();
-        while (c != '\n' && c != '\0') {
-            c = nextChar();
+// Copies of the names labels are defined and used by, so they outlive the
+// buffer a streamed source was lexed from. Each name is stored once.
+struct NameInterner {
+    std::string_view intern(std::string_view name)
+    {
+        if (auto found = mNames.find(name); found != mNames.end()) {
+            return *found;
+        }
+        if (mBlocks.empty() || mUsed + name.size() > mBlockSize) {
+            mBlockSize = std::max(BlockBytes, name.size());
+            mBlocks.push_back(std::make_unique<char[]>(mBlockSize));
+            mUsed = 0;
         }
-        // need to check for whitespace again and don't want recursion
-        goto start;
+        char* copy = mBlocks.back().get() + mUsed;
+        std::copy(name.begin(), name.end(), copy);
+        mUsed += name.size();
+        return *mNames.emplace(copy, name.size()).first;
     }
 
-    std::size_t startLocation = mTextLocation - 1;
-    if (isAlpha(c)) {
-        c = peekChar();
-        while (isAlphaNum(c)) {
-            consumeChar();
-            c = peekChar();
-        }
-        // fmt::print("{} is not alpha\n", c);
+    void clear()
+    {
+        mBlocks.clear();
+        mUsed = 0;
+        mNames.clear();
+    }
 
-        mPrevString = std::string_view(mText.data() + startLocation, mTextLocation - startLocation);
-        // fmt::print("prev string [{}]\n", prevString);
+private:
+    static constexpr std::size_t BlockBytes = std::size_t { 64 } << 10;
 
-        std::size_t lowerLen = std::min(mPrevString.length(), PrevStringLowerBufferSize);
-        for (std::size_t i = 0; i < lowerLen; i++) {
-            mPrevStringLower[i] = static_cast<char>(std::tolower(mPrevString[i]));
-        }
+    std::vector<std::unique_ptr<char[]>> mBlocks;
+    std::size_t mBlockSize {};
+    std::size_t mUsed {};
+    std::unordered_set<std::string_view> mNames;
+};
 
-        auto result = keywords.get(std::string_view { mPrevStringLower.data(), lowerLen });
-        // result will be 0 (aka Token::Label) if not found
-        return { result, startLocation };
+// Reads a stream on its own thread, so whatever writes into a pipe keeps
+// going while the assembler parses what already arrived. At most QueuedBlocks
+// blocks wait to be parsed, the reader blocks until one is taken.
+struct StreamReader {
+    explicit StreamReader(std::FILE* input)
+        : mThread([this, input](std::stop_token stop) { read(stop, input); })
+    {
     }
 
-    if (isNum(c)) {
-        bool isHex = false;
-        if (c == '0') {
-            const char newC = peekChar();
-            if (static_cast<char>(std::tolower(newC)) == 'x') {
-                consumeChar();
-                c = nextChar();
-                isHex = true;
+    // the next block, false once the stream is exhausted
+    bool next(std::string& block)
+    {
+        std::unique_lock lock(mMutex);
+        mChanged.wait(lock, [this] { return !mBlocks.empty() || mDone; });
+        if (mBlocks.empty()) {
+            if (mFailed) {
+                throw std::runtime_error(fmt::format("cannot read input: {}", mError != 0 ? std::strerror(mError) : "read error"));
             }
+            return false;
         }
-        startLocation = mTextLocation - 1;
-
-        if (!isNum(c)) {
-            // this has to be hex, correct me if I'm wrong
-            auto errorInfo = getLine(mTextLocation - 1);
-            reportError(fmt::format("on line {}\n{}\nexpected a number after 0x instead got {}",
-                errorInfo.first,
-                errorInfo.second,
-                c));
-            mPrevString = "0";
-            return { Token::HexNumber, startLocation };
-        }
-
-        c = peekChar();
-        while (isNum(c)) {
-            consumeChar();
-            c = peekChar();
-        }
-
-        mPrevString = std::string_view { mText.data() + startLocation, mText.data() + mTextLocation };
+        block = std::move(mBlocks.front());
+        mBlocks.pop_front();
+        mChanged.notify_all();
+        return true;
+    }
 
-        if (isHex) {
-            return { Token::HexNumber, startLocation };
-        } else {
-            return { Token::DecNumber, startLocation };
+private:
+    static constexpr std::size_t BlockBytes = std::size_t { 1 } << 20;
+    static constexpr std::size_t QueuedBlocks = 4;
+
+    std::mutex mMutex;
+    std::condition_variable_any mChanged;
+    std::deque<std::string> mBlocks;
+    bool mDone = false;
+    bool mFailed = false;
+    int mError = 0; // errno of the failed read, 0 when it was not set
+    // last, so it is joined before the queue goes away
+    std::jthread mThread;
+
+    void read(std::stop_token stop, std::FILE* input)
+    {
+        bool failed = false;
+        int error = 0;
+        while (!stop.stop_requested() && !failed) {
+            std::string block(BlockBytes, '\0');
+            errno = 0;
+            const std::size_t bytes = std::fread(block.data(), 1, block.size(), input);
+            // errno only describes this read until the next library call
+            if (bytes < block.size() && std::ferror(input)) {
+                failed = true;
+                error = errno;
+            }
+            block.resize(bytes);
+            if (block.empty()) {
+                break;
+            }
+            std::unique_lock lock(mMutex);
+            if (!mChanged.wait(lock, stop, [this] { return mBlocks.size() < QueuedBlocks; })) {
+                break;
+            }
+            mBlocks.push_back(std::move(block));
+            mChanged.notify_all();
         }
+        std::lock_guard lock(mMutex);
+        mFailed = failed;
+        mError = error;
+        mDone = true;
+        mChanged.notify_all();
     }
+};
 
-    if (c == ',') {
-        return { Token::Comma, startLocation };
-    }
-    if (c == ':') {
-        return { Token::Comma, startLocation };
+// "-" reads stdin, it and other pipes are streamed, regular files are read
+// whole so large ones can be parsed in parallel
+bool isStreamed(const char* input)
+{
+    if (std::strcmp(input, "-") == 0) {
+        return true;
     }
-
-    auto errorInfo = getLine(mTextLocation);
-    reportError(fmt::format("[lexer error] on line {}\n{}\nunexpected character: [{}], [{}]",
-        errorInfo.first,
-        errorInfo.second,
-        c,
-        int(c)));
-
-    return { Token::Unknown, startLocation };
+    std::error_code error;
+    return std::filesystem::exists(input, error) && !std::filesystem::is_regular_file(input, error);
 }
 
-std::string_view Lexer::getPrevString()
-{
-    return mPrevString;
-}
+template <typename Traits>
+struct Assembler {
+    using Word = typename Traits::Word;
+
+    explicit Assembler(bool runOptimizer = false);
+
+    // assembles the file input, "-" reads stdin. Throws once the source had
+    // errors, which errors() lists. May be called again for another input,
+    // the buffers keep their capacity.
+    [[nodiscard]] const std::vector<Word>& assemble(const char* input);
+    [[nodiscard]] const std::vector<std::string>& errors() const { return reported; }
+    // labels sorted by address and which words hold instructions, valid after assemble
+    [[nodiscard]] std::vector<ImageSymbol> symbols() const;
+    [[nodiscard]] std::vector<bool> codeWords() const;
+    // line and column of every word with a place in the source
+    [[nodiscard]] std::vector<SourceLine> sourceLines() const;
+
+    // The lines update reparsed, numbered in the new source
+    struct Reparsed {
+        std::size_t firstLine;
+        std::size_t lines;
+    };
 
-std::pair<size_t, std::string_view> Lexer::getLine(std::size_t textLocation)
-{
-    auto itr = mNewLines.upper_bound(textLocation);
-    std::size_t start {};
-    std::size_t lineNum {};
-    itr--;
+    // Watch mode: assembles a regular file and keeps its parse resident, the
+    // instructions, labels with the lines that define them and the start of
+    // every line. Never throws for errors in the source, residentErrors lists
+    // them and image is only valid without any.
+    void assembleResident(const char* input);
+    // rereads the file, reparses only the lines that changed and moves and
+    // repatches what follows them, nullopt when the source did not change
+    [[nodiscard]] std::optional<Reparsed> update(const char* input);
+    [[nodiscard]] std::vector<std::string> residentErrors();
+    [[nodiscard]] const std::vector<Word>& image() const { return binaryInstructions; }
 
-    start = itr->first;
-    lineNum = itr->second;
+private:
+    // the whole source when it was read from a file, names point into it
+    std::vector<char> source;
+    Lexer lex;
+    // names of a streamed source, whose text is gone once parsed
+    NameInterner names;
+    std::unordered_map<std::string_view, Word> labels;
+    std::vector<InstructionData<Word>> instructions;
+    std::vector<Word> binaryInstructions;
+    std::vector<ParsedChunk<Word>> chunks;
+    std::vector<std::string> reported;
+    bool optimize;
+
+    // parse errors of a line range, an edit anywhere in it reparses all of it
+    struct RangeErrors {
+        u32 endLine;
+        std::vector<std::string> errors;
+    };
 
-    while (textLocation < mText.size() && mText[textLocation] != '\n' && mText[textLocation] != '\0') {
-        textLocation++;
-    }
+    // watch mode state, names are interned so a new source can replace the old
+    bool resident = false;
+    // the next version of the source, swapped with source so neither buffer is allocated again
+    std::vector<char> edited;
+    std::vector<std::size_t> lineStarts;
+    std::unordered_map<std::string_view, u32> labelLines;
+    std::map<u32, RangeErrors> rangeErrors;
+    // label references that do not resolve or do not reach their label
+    std::size_t unresolved = 0;
+    // the last definition of a label wins, which only a full parse keeps track of
+    bool duplicateLabels = false;
+
+    // where lineText left off, binaryPass asks for lines in source order
+    struct LineCursor {
+        std::size_t line = 1;
+        std::size_t start {};
+    } lineCursor;
 
-    if (textLocation < start) {
-        throw std::runtime_error("[lexer error] trying to construct a string_view with a start position after the end position, report this bug please.");
-    }
+    void parsePass();
+    // parses the stream as it arrives, holding only the lines not parsed yet, returns the bytes read
+    std::size_t streamPass(std::FILE* input);
+    // parses one chunk, firstLine numbers its lines, only the last chunk may end inside a statement
+    static void parseChunk(ParsedChunk<Word>& chunk, std::size_t firstLine, bool last);
+    void mergeChunk(ParsedChunk<Word>& chunk);
+    void internNames(ParsedChunk<Word>& chunk);
+    void reportError(std::string error);
+    void binaryPass();
+    void optimizePass();
+    // the text of line, empty for a streamed source
+    std::string_view lineText(std::size_t line);
+
+    // encodes instr into word, false when its label is missing or out of its reach
+    bool patch(const InstructionData<Word>& instr, Word& word) const;
+    [[nodiscard]] static bool reaches(const InstructionData<Word>& instr, std::optional<Word> address);
+    // the index of the first instruction on line or after it
+    [[nodiscard]] std::size_t firstInstructionFrom(std::size_t line) const;
+    void indexLines();
+    // parses all of source into the resident state
+    void parseResident();
+};
 
-    return {
-        lineNum,
-        std::string_view { mText.data() + start, mText.data() + textLocation }
-    };
+template <typename Traits>
+Assembler<Traits>::Assembler(bool runOptimizer)
+    : lex({})
+    , optimize(runOptimizer)
+{
 }
 
-char Lexer::nextChar()
+template <typename Traits>
+[[nodiscard]] auto Assembler<Traits>::assemble(const char* input) -> const std::vector<Word>&
 {
-    if (mTextLocation >= mText.size()) {
-        return '\0';
+    source.clear();
+    lex = Lexer({});
+    names.clear();
+    labels.clear();
+    instructions.clear();
+    binaryInstructions.clear();
+    reported.clear();
+    lineCursor = {};
+
+    std::size_t sourceBytes = 0;
+    if (isStreamed(input)) {
+        const bool standardInput = std::strcmp(input, "-") == 0;
+        std::FILE* stream = standardInput ? stdin : std::fopen(input, "rb");
+        if (stream == nullptr) {
+            throw std::runtime_error(fmt::format("cannot open {}: {}", input, std::strerror(errno)));
+        }
+        Perf::Phase phase("Assembler::streamPass");
+        try {
+            sourceBytes = streamPass(stream);
+        } catch (...) {
+            if (!standardInput) {
+                std::fclose(stream);
+            }
+            throw;
+        }
+        if (!standardInput) {
+            std::fclose(stream);
+        }
+        phase.setWork(sourceBytes, "source byte");
+        phase.setBytes(sourceBytes);
+    } else {
+        fileToVector(input, source);
+        lex = Lexer(std::string_view { source.data(), source.size() });
+        sourceBytes = source.size();
+        Perf::Phase phase("Assembler::parsePass");
+        phase.setWork(sourceBytes, "source byte");
+        phase.setBytes(sourceBytes);
+        parsePass();
     }
-    char c = *(mText.data() + mTextLocation++);
-
-    if (c == '\n') {
-        mLineNumber += 1;
-        mNewLines.insert(std::pair(mTextLocation, mLineNumber));
+    {
+        Perf::Phase phase("Assembler::binaryPass");
+        phase.setWork(sourceBytes, "source byte");
+        phase.setBytes(instructions.size() * sizeof(Word));
+        binaryPass();
+    }
+    if (optimize) {
+        optimizePass();
     }
 
-    return c;
+    return binaryInstructions;
 }
 
-char Lexer::peekChar()
+template <typename Traits>
+std::vector<ImageSymbol> Assembler<Traits>::symbols() const
 {
-    if (mTextLocation >= mText.size()) {
-        return '\0';
+    std::vector<ImageSymbol> result;
+    result.reserve(labels.size());
+    for (const auto& [name, address] : labels) {
+        result.push_back({ .name = std::string(name), .address = address });
     }
-    return *(mText.data() + mTextLocation);
+    std::sort(result.begin(), result.end(), [](const ImageSymbol& a, const ImageSymbol& b) {
+        return a.address != b.address ? a.address < b.address : a.name < b.name;
+    });
+    return result;
 }
 
-void Lexer::consumeChar()
+template <typename Traits>
+std::vector<bool> Assembler<Traits>::codeWords() const
 {
-    (void)nextChar();
-}
-
-constexpr bool Lexer::isNum(const char c)
-{
-    return c >= '0' && c <= '9';
+    std::vector<bool> isCode;
+    isCode.reserve(instructions.size());
+    for (const auto& instr : instructions) {
+        isCode.push_back(instr.dataType != DataType::Word);
+    }
+    return isCode;
 }
 
-constexpr bool Lexer::isAlpha(const char c)
+template <typename Traits>
+std::vector<SourceLine> Assembler<Traits>::sourceLines() const
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    std::vector<SourceLine> lines;
+    lines.reserve(instructions.size());
+    for (std::size_t address = 0; address < instructions.size(); address++) {
+        const SourcePosition& position = instructions[address].position;
+        if (position.line != 0) {
+            lines.push_back({ .address = static_cast<u32>(address), .line = position.line, .column = position.column });
+        }
+    }
+    return lines;
 }
 
-constexpr bool Lexer::isAlphaNum(const char c)
+template <typename Traits>
+void Assembler<Traits>::parsePass()
 {
-    return isNum(c) || isAlpha(c);
-}
+    splitChunks(lex.text(), chunks);
+
+    if (chunks.size() == 1) {
+        parseChunk(chunks.front(), 1, true);
+    } else {
+        // every worker counts the lines of its chunk, then numbers its own after the ones before
+        std::vector<std::size_t> newlines(chunks.size());
+        std::latch counted(static_cast<std::ptrdiff_t>(chunks.size()));
+        {
+            std::vector<std::jthread> workers;
+            for (std::size_t i = 0; i < chunks.size(); i++) {
+                workers.emplace_back([&, i] {
+                    newlines[i] = static_cast<std::size_t>(std::count(chunks[i].text.begin(), chunks[i].text.end(), '\n'));
+                    counted.arrive_and_wait();
+                    const std::size_t firstLine = std::accumulate(newlines.begin(), newlines.begin() + static_cast<std::ptrdiff_t>(i), std::size_t { 1 });
+                    parseChunk(chunks[i], firstLine, i + 1 == chunks.size());
+                });
+            }
+        }
 
-constexpr bool Lexer::isWhiteSpace(const char c)
-{
-    return c == '\n' || c == '\r' || c == '\t' || c == ' ';
-}
+        if (std::any_of(chunks.begin(), chunks.end(), [](const ParsedChunk<Word>& chunk) { return chunk.dangling; })) {
+            // a statement continues over a chunk boundary, only a single pass reads it as written
+            LOGD("a statement spans two chunks, parsing the source in one piece");
+            chunks.erase(chunks.begin() + 1, chunks.end());
+            chunks.front().reset(lex.text());
+            parseChunk(chunks.front(), 1, true);
+        }
+        LOGD("parsed the source in {} chunks", chunks.size());
+    }
 
-// void Lexer::consumeUntilNewline()
-// {
-//     char c = nextChar();
-//     while (true) {
-//         if (c == '\n' || c == '\0') {
-//             break;
-//         }
-//         c = nextChar();
-//     }
-// }
+    std::size_t total = 0;
+    for (const auto& chunk : chunks) {
+        total += chunk.instructions.size();
+    }
+    instructions.reserve(total);
 
-struct Assembler {
-    explicit Assembler(const std::string_view inputText);
+    for (auto& chunk : chunks) {
+        mergeChunk(chunk);
+    }
+}
 
-    [[nodiscard]] std::vector<Word> assemble();
+template <typename Traits>
+std::size_t Assembler<Traits>::streamPass(std::FILE* input)
+{
+    StreamReader reader(input);
+    std::string buffer;
+    std::string block;
+    std::size_t firstLine = 1;
+    std::size_t bytes = 0;
+    bool end = false;
+    while (!end) {
+        end = !reader.next(block);
+        bytes += block.size();
+        buffer += block;
+        block.clear();
+
+        // parse up to the last newline, the rest of the line waits for the next block
+        std::size_t cut = buffer.size();
+        if (!end) {
+            const std::size_t newline = buffer.rfind('\n');
+            if (newline == std::string::npos) {
+                continue;
+            }
+            cut = newline + 1;
+        }
 
-private:
-    Lexer lex;
-    std::unordered_map<std::string_view, Word> labels;
-    std::deque<InstructionData> instructions;
-    std::vector<Word> binaryInstructions;
+        if (chunks.empty()) {
+            chunks.emplace_back(std::string_view {});
+        }
+        ParsedChunk<Word>& chunk = chunks.front();
+        chunk.reset(std::string_view(buffer).substr(0, cut));
+        parseChunk(chunk, firstLine, end);
+        if (chunk.dangling) {
+            // a statement continues on the next line, parse it again once that arrived
+            continue;
+        }
+        internNames(chunk);
+        mergeChunk(chunk);
 
-    void parsePass();
-    void binaryPass();
-};
+        firstLine += static_cast<std::size_t>(std::count(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(cut), '\n'));
+        buffer.erase(0, cut);
+    }
+    return bytes;
+}
 
-Assembler::Assembler(const std::string_view inputText)
-    : lex(inputText)
+template <typename Traits>
+void Assembler<Traits>::mergeChunk(ParsedChunk<Word>& chunk)
 {
+    for (std::string& error : chunk.errors) {
+        reportError(std::move(error));
+    }
+    const std::size_t base = instructions.size();
+    for (const auto& [name, index, line] : chunk.labels) {
+        if (resident) {
+            duplicateLabels |= labels.contains(name);
+            labelLines[name] = line;
+        }
+        labels[name] = static_cast<Word>(base + index);
+    }
+    instructions.insert(instructions.end(), chunk.instructions.begin(), chunk.instructions.end());
 }
 
-[[nodiscard]] std::vector<Word> Assembler::assemble()
+template <typename Traits>
+void Assembler<Traits>::internNames(ParsedChunk<Word>& chunk)
 {
-    parsePass();
-    binaryPass();
+    for (auto& instr : chunk.instructions) {
+        if (instr.dataType == DataType::Identifier) {
+            instr.identifier = names.intern(instr.identifier);
+        }
+    }
+    for (auto& label : chunk.labels) {
+        label.name = names.intern(label.name);
+    }
+}
 
-    return binaryInstructions;
+template <typename Traits>
+void Assembler<Traits>::reportError(std::string error)
+{
+    reported.push_back(std::move(error));
 }
 
-void Assembler::parsePass()
+template <typename Traits>
+void Assembler<Traits>::parseChunk(ParsedChunk<Word>& chunk, std::size_t firstLine, bool last)
 {
+    Lexer lex(chunk.text, firstLine);
     std::pair<Token, std::size_t> token = { Token::Unknown, 0 };
     Word pos = 0;
     while (true) {
-        token = lex.nextToken();
+        token = nextToken(lex, chunk.errors);
         if (token.first == Token::Eof) {
             break;
         }
@@ -430,38 +594,50 @@ void Assembler::parsePass()
         if (token.first == Token::Label) {
             auto errorString = lex.getPrevString();
             auto errorLocation = token.second;
-            token = lex.nextToken();
+            token = nextToken(lex, chunk.errors);
 
+            if (token.first == Token::Eof && !last) {
+                chunk.dangling = true;
+                return;
+            }
             if (token.first == Token::Comma) {
-                labels[lex.getPrevString()] = pos;
+                chunk.labels.push_back({ .name = lex.getPrevString(), .index = pos, .line = positionOf(lex, errorLocation).line });
             } else {
                 auto errorInfo = lex.getLine(errorLocation);
-                reportError(fmt::format("on line {}:\n{}\nlabel {} missing comma",
+                chunk.errors.push_back(fmt::format("on line {}:\n{}\nlabel {} missing comma",
                     errorInfo.first,
                     errorInfo.second,
                     errorString));
             }
-            token = lex.nextToken();
+            token = nextToken(lex, chunk.errors);
+            if (token.first == Token::Eof && !last) {
+                // a label on the last line names the first word of the next chunk, which is at pos
+                break;
+            }
         }
 
         if (tokenIsInstruction(token.first)) {
             if (tokenHasZeroOperands(token.first)) {
-                instructions.push_back(InstructionData {
+                chunk.instructions.push_back(InstructionData<Word> {
                     .instr = tokenToInstruction(token.first),
                     .dataType = DataType::Literal,
-                    .textLocation = token.second,
+                    .position = positionOf(lex, token.second),
                     .literal = 0 });
                 pos++;
             } else {
                 // get literal or label
-                auto operands = lex.nextToken();
+                auto operands = nextToken(lex, chunk.errors);
+                if (operands.first == Token::Eof && !last) {
+                    chunk.dangling = true;
+                    return;
+                }
 
                 // assert its either a literal or label
                 if (operands.first == Token::Label) {
-                    instructions.push_back(InstructionData {
+                    chunk.instructions.push_back(InstructionData<Word> {
                         .instr = tokenToInstruction(token.first),
                         .dataType = DataType::Identifier,
-                        .textLocation = operands.second,
+                        .position = positionOf(lex, token.second),
                         .identifier = lex.getPrevString() });
                     pos++;
                 } else if (operands.first == Token::HexNumber || operands.first == Token::DecNumber) {
@@ -472,24 +648,26 @@ void Assembler::parsePass()
                     } else {
                         (void)std::from_chars(prevString.data(), prevString.data() + prevString.length(), value, 10);
                     }
-                    if (value >= maxAddressSize()) {
+                    const unsigned operandBits = Traits::operandBits(tokenToInstruction(token.first));
+                    if (value >= std::size_t { 1 } << operandBits) {
                         auto errorInfo = lex.getLine(operands.second);
-                        reportError(fmt::format("on line {}:\n{}\noperand {} outside of max word range (2^12)",
+                        chunk.errors.push_back(fmt::format("on line {}:\n{}\noperand {} outside of max word range (2^{})",
                             errorInfo.first,
                             errorInfo.second,
-                            prevString));
+                            prevString,
+                            operandBits));
                         value = 0;
                     }
-                    instructions.push_back({
+                    chunk.instructions.push_back(InstructionData<Word> {
                         .instr = tokenToInstruction(token.first),
                         .dataType = DataType::Literal,
-                        .textLocation = token.second,
+                        .position = positionOf(lex, token.second),
                         .literal = value,
                     });
                     pos++;
                 } else {
                     auto errorInfo = lex.getLine(operands.second);
-                    reportError(fmt::format("on line {}:\n{}\ninvalid operand {}",
+                    chunk.errors.push_back(fmt::format("on line {}:\n{}\ninvalid operand {}",
                         errorInfo.first,
                         errorInfo.second,
                         lex.getPrevString()));
@@ -503,16 +681,16 @@ void Assembler::parsePass()
             } else {
                 (void)std::from_chars(prevString.data(), prevString.data() + prevString.length(), value, 10);
             }
-            instructions.push_back(InstructionData {
+            chunk.instructions.push_back(InstructionData<Word> {
                 .instr = Instruction::Unknown,
                 .dataType = DataType::Word,
-                .textLocation = token.second,
+                .position = positionOf(lex, token.second),
                 .literal = value,
             });
             pos++;
         } else {
             auto errorInfo = lex.getLine(token.second);
-            reportError(fmt::format("on line {}:\n{}\nunexpected token \"{}\"",
+            chunk.errors.push_back(fmt::format("on line {}:\n{}\nunexpected token \"{}\"",
                 errorInfo.first,
                 errorInfo.second,
                 tokenToString(token.first)));
@@ -520,7 +698,8 @@ void Assembler::parsePass()
     }
 }
 
-void Assembler::binaryPass()
+template <typename Traits>
+void Assembler<Traits>::binaryPass()
 {
     binaryInstructions.reserve(instructions.size());
 
@@ -531,25 +710,29 @@ void Assembler::binaryPass()
             break;
         }
         case DataType::Identifier: {
-            constexpr Word shift = 12U;
-            Word instruction = static_cast<Word>(static_cast<Word>(instr.instr) << shift);
+            Word instruction = Traits::encode(instr.instr, 0);
             if (labels.contains(instr.identifier)) {
-                instruction |= (labels[instr.identifier] & 0x0fff);
+                const Word address = labels[instr.identifier];
+                if (address >= std::size_t { 1 } << Traits::operandBits(instr.instr)) {
+                    reportError(fmt::format("error on line: {}\n{}\nlabel \"{}\" at {:x} is out of reach of {}",
+                        instr.position.line,
+                        lineText(instr.position.line),
+                        instr.identifier,
+                        address,
+                        InstructionToString(instr.instr)));
+                }
+                instruction = Traits::encode(instr.instr, address);
             } else {
-                auto errorInfo = lex.getLine(instr.textLocation);
                 reportError(fmt::format("error on line: {}\n{}\nlabel \"{}\" does not exist",
-                    errorInfo.first,
-                    errorInfo.second,
+                    instr.position.line,
+                    lineText(instr.position.line),
                     instr.identifier));
             }
             binaryInstructions.push_back(instruction);
             break;
         }
         case DataType::Literal: {
-            constexpr Word shift = 12U;
-            Word instruction = static_cast<Word>(static_cast<Word>(instr.instr) << shift);
-            instruction |= (instr.literal & 0x0fff);
-            binaryInstructions.push_back(instruction);
+            binaryInstructions.push_back(Traits::encode(instr.instr, instr.literal));
             break;
         }
         default:
@@ -557,62 +740,677 @@ void Assembler::binaryPass()
         }
     }
 
-    if (hasErrors) {
+    if (!reported.empty()) {
         throw std::runtime_error("parser has errors, cannot output a program");
     }
 }
 
-} // anonymous namespace
+template <typename Traits>
+std::string_view Assembler<Traits>::lineText(std::size_t line)
+{
+    const std::string_view text = lex.text();
+    if (line < lineCursor.line) {
+        lineCursor = {};
+    }
+    while (lineCursor.line < line && lineCursor.start < text.size()) {
+        const std::size_t newline = text.find('\n', lineCursor.start);
+        lineCursor.start = newline == std::string_view::npos ? text.size() : newline + 1;
+        lineCursor.line++;
+    }
+    const std::size_t end = std::min(text.find('\n', lineCursor.start), text.size());
+    return text.substr(lineCursor.start, end - lineCursor.start);
+}
 
-int assemble(const char* input, const char* output)
+template <typename Traits>
+void Assembler<Traits>::optimizePass()
 {
-    try {
-        std::vector<char> fileContents = fileToVector<char>(input);
-        Assembler assembler({ fileContents.data(), fileContents.size() });
-        std::vector<Word> values = assembler.assemble();
+    if constexpr (!std::is_same_v<Traits, Marie16>) {
+        LOGW("the optimizer only supports 16 bit images, leaving the program as written");
+    } else {
+        std::vector<bool> isCode = codeWords();
+
+        const std::size_t originalSize = binaryInstructions.size();
+        OptimizeResult result = optimizeProgram(binaryInstructions, isCode);
+
+        // keep labels and the parsed instructions in step with the new layout
+        for (auto& label : labels) {
+            if (label.second < originalSize) {
+                label.second = result.relocation[label.second];
+            } else {
+                label.second = static_cast<Word>(label.second - originalSize + binaryInstructions.size() - result.appended);
+            }
+        }
+
+        std::vector<InstructionData<Word>> kept;
+        for (std::size_t i = 0; i < originalSize; i++) {
+            if (!result.removed[i]) {
+                kept.push_back(instructions[i]);
+            }
+        }
+        for (std::size_t i = binaryInstructions.size() - result.appended; i < binaryInstructions.size(); i++) {
+            kept.push_back(InstructionData<Word> {
+                .instr = Instruction::Unknown,
+                .dataType = DataType::Word,
+                .position = {},
+                .literal = binaryInstructions[i] });
+        }
+        instructions = std::move(kept);
+    }
+}
+
+template <typename Traits>
+bool Assembler<Traits>::reaches(const InstructionData<Word>& instr, std::optional<Word> address)
+{
+    return address && *address < std::size_t { 1 } << Traits::operandBits(instr.instr);
+}
+
+template <typename Traits>
+bool Assembler<Traits>::patch(const InstructionData<Word>& instr, Word& word) const
+{
+    if (instr.dataType != DataType::Identifier) {
+        word = instr.dataType == DataType::Word ? instr.literal : Traits::encode(instr.instr, instr.literal);
+        return true;
+    }
+    const auto label = labels.find(instr.identifier);
+    const std::optional<Word> address = label == labels.end() ? std::nullopt : std::optional<Word>(label->second);
+    word = Traits::encode(instr.instr, address.value_or(0));
+    return reaches(instr, address);
+}
+
+template <typename Traits>
+std::size_t Assembler<Traits>::firstInstructionFrom(std::size_t line) const
+{
+    return static_cast<std::size_t>(std::partition_point(instructions.begin(), instructions.end(), [line](const InstructionData<Word>& instr) {
+        return instr.position.line < line;
+    }) - instructions.begin());
+}
+
+template <typename Traits>
+void Assembler<Traits>::indexLines()
+{
+    lineStarts.clear();
+    lineStarts.push_back(0);
+    for (std::size_t i = 0; i < source.size(); i++) {
+        if (source[i] == '\n') {
+            lineStarts.push_back(i + 1);
+        }
+    }
+}
+
+template <typename Traits>
+void Assembler<Traits>::assembleResident(const char* input)
+{
+    if (isStreamed(input)) {
+        throw std::runtime_error(fmt::format("{} is not a regular file", input));
+    }
+    resident = true;
+    optimize = false;
+    fileToVector(input, source);
+    parseResident();
+}
+
+template <typename Traits>
+void Assembler<Traits>::parseResident()
+{
+    lex = Lexer(std::string_view { source.data(), source.size() });
+    names.clear();
+    labels.clear();
+    labelLines.clear();
+    instructions.clear();
+    binaryInstructions.clear();
+    reported.clear();
+    rangeErrors.clear();
+    unresolved = 0;
+    duplicateLabels = false;
+    lineCursor = {};
+
+    Perf::Phase phase("Assembler::parseResident");
+    phase.setWork(source.size(), "source byte");
+    parsePass();
+    for (auto& instr : instructions) {
+        if (instr.dataType == DataType::Identifier) {
+            instr.identifier = names.intern(instr.identifier);
+        }
+    }
+    // the keys point into the source too
+    std::unordered_map<std::string_view, Word> internedLabels;
+    std::unordered_map<std::string_view, u32> internedLines;
+    for (const auto& [name, address] : labels) {
+        const std::string_view interned = names.intern(name);
+        internedLabels.emplace(interned, address);
+        internedLines.emplace(interned, labelLines[name]);
+    }
+    labels = std::move(internedLabels);
+    labelLines = std::move(internedLines);
+    indexLines();
+
+    if (!reported.empty()) {
+        rangeErrors[1] = { .endLine = static_cast<u32>(lineStarts.size() + 1), .errors = std::move(reported) };
+        reported.clear();
+    }
+    binaryInstructions.resize(instructions.size());
+    for (std::size_t i = 0; i < instructions.size(); i++) {
+        if (!patch(instructions[i], binaryInstructions[i])) {
+            unresolved++;
+        }
+    }
+}
+
+template <typename Traits>
+auto Assembler<Traits>::update(const char* input) -> std::optional<Reparsed>
+{
+    std::vector<char>& text = edited;
+    fileToVector(input, text);
+    if (text == source) {
+        return std::nullopt;
+    }
+    if (duplicateLabels) {
+        source.swap(text);
+        parseResident();
+        return Reparsed { .firstLine = 1, .lines = lineStarts.size() };
+    }
+
+    Perf::Phase phase("Assembler::update");
+    const std::string_view before(source.data(), source.size());
+    const std::string_view after(text.data(), text.size());
+    const std::size_t lineCount = lineStarts.size();
+
+    // the edit lies between the longest common prefix and suffix, compared a block at a time with memcmp first
+    constexpr std::size_t Block = 4096;
+    const std::size_t common = std::min(before.size(), after.size());
+    std::size_t prefix = 0;
+    while (prefix + Block <= common && std::memcmp(before.data() + prefix, after.data() + prefix, Block) == 0) {
+        prefix += Block;
+    }
+    while (prefix < common && before[prefix] == after[prefix]) {
+        prefix++;
+    }
+    std::size_t suffix = 0;
+    while (suffix + Block <= common - prefix && std::memcmp(before.data() + before.size() - suffix - Block, after.data() + after.size() - suffix - Block, Block) == 0) {
+        suffix += Block;
+    }
+    while (suffix < common - prefix && before[before.size() - suffix - 1] == after[after.size() - suffix - 1]) {
+        suffix++;
+    }
+
+    // the edited lines [first, last), indices into lineStarts of the old source
+    std::size_t first = static_cast<std::size_t>(std::upper_bound(lineStarts.begin(), lineStarts.end(), prefix) - lineStarts.begin()) - 1;
+    std::size_t last = static_cast<std::size_t>(std::lower_bound(lineStarts.begin(), lineStarts.end(), before.size() - suffix) - lineStarts.begin());
+    const auto byteOf = [&](std::size_t line) { return line < lineCount ? lineStarts[line] : before.size(); };
+    const std::ptrdiff_t byteDelta = static_cast<std::ptrdiff_t>(after.size()) - static_cast<std::ptrdiff_t>(before.size());
+
+    ParsedChunk<Word>& chunk = chunks.empty() ? chunks.emplace_back(std::string_view {}) : chunks.front();
+    std::size_t oldFirst = 0;
+    std::size_t oldLast = 0;
+    std::size_t newEnd = 0;
+    while (true) {
+        // widen the range to whole statements: a statement may continue over
+        // lines, so start at the last instruction before the edit and end
+        // right before the next one, and take in every error range it touches
+        for (bool widened = true; widened;) {
+            widened = false;
+            oldFirst = firstInstructionFrom(first + 1);
+            if (oldFirst > 0 && (oldFirst == instructions.size() || instructions[oldFirst].position.line != first + 1)) {
+                oldFirst--;
+                first = instructions[oldFirst].position.line - 1;
+            }
+            oldLast = firstInstructionFrom(last + 1);
+            last = std::max(last, oldLast < instructions.size() ? std::size_t { instructions[oldLast].position.line } - 1 : lineCount);
+            for (auto range = rangeErrors.begin(); range != rangeErrors.end();) {
+                if (range->first <= last && range->second.endLine > first + 1) {
+                    first = std::min<std::size_t>(first, range->first - 1);
+                    last = std::max<std::size_t>(last, range->second.endLine - 1);
+                    range = rangeErrors.erase(range);
+                    widened = true;
+                } else {
+                    ++range;
+                }
+            }
+        }
+
+        // the new text of the range must end on a line of its own too
+        newEnd = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(byteOf(last)) + byteDelta);
+        if (newEnd < after.size() && newEnd > byteOf(first) && after[newEnd - 1] != '\n') {
+            last++;
+            continue;
+        }
+        chunk.reset(after.substr(byteOf(first), newEnd - byteOf(first)));
+        parseChunk(chunk, first + 1, newEnd == after.size());
+        if (chunk.dangling) {
+            last++;
+            continue;
+        }
+        break;
+    }
+    // a label defined again outside of the range, or twice in it
+    std::unordered_set<std::string_view> defined;
+    for (const auto& label : chunk.labels) {
+        const auto existing = labelLines.find(label.name);
+        const bool outside = existing != labelLines.end() && (existing->second <= first || existing->second > last);
+        if (outside || !defined.insert(label.name).second) {
+            source.swap(text);
+            parseResident();
+            return Reparsed { .firstLine = 1, .lines = lineStarts.size() };
+        }
+    }
+    internNames(chunk);
+
+    std::vector<std::size_t> newStarts;
+    for (std::size_t at = byteOf(first); at < newEnd; at++) {
+        if (at == 0 || after[at - 1] == '\n') {
+            newStarts.push_back(at);
+        }
+    }
+    if (last == lineCount && newEnd == after.size() && (newEnd == 0 || after[newEnd - 1] == '\n')) {
+        newStarts.push_back(newEnd);
+    }
+    const std::ptrdiff_t lineDelta = static_cast<std::ptrdiff_t>(newStarts.size()) - static_cast<std::ptrdiff_t>(last - first);
+    const std::size_t base = oldFirst;
+    const std::size_t newCount = chunk.instructions.size();
+    const std::ptrdiff_t wordDelta = static_cast<std::ptrdiff_t>(newCount) - static_cast<std::ptrdiff_t>(oldLast - oldFirst);
+    const auto shiftLine = [lineDelta](auto line) { return static_cast<decltype(line)>(static_cast<std::ptrdiff_t>(line) + lineDelta); };
+
+    for (std::size_t i = oldFirst; i < oldLast; i++) {
+        Word word {};
+        if (!patch(instructions[i], word)) {
+            unresolved--;
+        }
+    }
+
+    // labels defined in the range go, the ones after it move with their words,
+    // moved keeps the old address of every label that changed
+    std::unordered_map<std::string_view, std::optional<Word>> moved;
+    for (auto label = labels.begin(); label != labels.end();) {
+        u32& line = labelLines[label->first];
+        if (line <= first) {
+            ++label;
+        } else if (line <= last) {
+            moved.emplace(label->first, label->second);
+            labelLines.erase(label->first);
+            label = labels.erase(label);
+        } else {
+            line = shiftLine(line);
+            if (wordDelta != 0) {
+                moved.emplace(label->first, label->second);
+                label->second = static_cast<Word>(static_cast<std::ptrdiff_t>(label->second) + wordDelta);
+            }
+            ++label;
+        }
+    }
+    for (const auto& [name, index, line] : chunk.labels) {
+        const auto existing = labels.find(name);
+        moved.try_emplace(name, existing == labels.end() ? std::nullopt : std::optional<Word>(existing->second));
+        labels[name] = static_cast<Word>(base + index);
+        labelLines[name] = line;
+    }
+    std::erase_if(moved, [&](const auto& entry) {
+        const auto label = labels.find(entry.first);
+        return label != labels.end() && entry.second == label->second;
+    });
+
+    // splice the range into the instructions and the image, then move what follows
+    if (wordDelta == 0) {
+        std::copy(chunk.instructions.begin(), chunk.instructions.end(), instructions.begin() + static_cast<std::ptrdiff_t>(base));
+    } else {
+        instructions.erase(instructions.begin() + static_cast<std::ptrdiff_t>(oldFirst), instructions.begin() + static_cast<std::ptrdiff_t>(oldLast));
+        instructions.insert(instructions.begin() + static_cast<std::ptrdiff_t>(base), chunk.instructions.begin(), chunk.instructions.end());
+        binaryInstructions.erase(binaryInstructions.begin() + static_cast<std::ptrdiff_t>(oldFirst), binaryInstructions.begin() + static_cast<std::ptrdiff_t>(oldLast));
+        binaryInstructions.insert(binaryInstructions.begin() + static_cast<std::ptrdiff_t>(base), newCount, Word {});
+    }
+    for (std::size_t i = base; i < base + newCount; i++) {
+        if (!patch(instructions[i], binaryInstructions[i])) {
+            unresolved++;
+        }
+    }
+    if (lineDelta != 0) {
+        for (std::size_t i = base + newCount; i < instructions.size(); i++) {
+            instructions[i].position.line = shiftLine(instructions[i].position.line);
+        }
+    }
+
+    // only references to labels that moved need a new operand
+    const auto repatch = [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            const InstructionData<Word>& instr = instructions[i];
+            if (instr.dataType != DataType::Identifier) {
+                continue;
+            }
+            const auto previous = moved.find(instr.identifier);
+            if (previous == moved.end()) {
+                continue;
+            }
+            const bool reached = reaches(instr, previous->second);
+            if (patch(instr, binaryInstructions[i]) != reached) {
+                unresolved = reached ? unresolved + 1 : unresolved - 1;
+            }
+        }
+    };
+    if (!moved.empty()) {
+        repatch(0, base);
+        repatch(base + newCount, instructions.size());
+    }
+
+    std::map<u32, RangeErrors> shifted;
+    for (auto& [line, range] : rangeErrors) {
+        if (line > last) {
+            range.endLine = shiftLine(range.endLine);
+            shifted.emplace(shiftLine(line), std::move(range));
+        } else {
+            shifted.emplace(line, std::move(range));
+        }
+    }
+    rangeErrors = std::move(shifted);
+    if (!chunk.errors.empty()) {
+        rangeErrors[static_cast<u32>(first + 1)] = { .endLine = static_cast<u32>(first + 1 + newStarts.size()), .errors = std::move(chunk.errors) };
+    }
+
+    if (byteDelta != 0) {
+        for (auto start = lineStarts.begin() + static_cast<std::ptrdiff_t>(last); start != lineStarts.end(); ++start) {
+            *start = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(*start) + byteDelta);
+        }
+    }
+    if (lineDelta == 0) {
+        std::copy(newStarts.begin(), newStarts.end(), lineStarts.begin() + static_cast<std::ptrdiff_t>(first));
+    } else {
+        lineStarts.erase(lineStarts.begin() + static_cast<std::ptrdiff_t>(first), lineStarts.begin() + static_cast<std::ptrdiff_t>(last));
+        lineStarts.insert(lineStarts.begin() + static_cast<std::ptrdiff_t>(first), newStarts.begin(), newStarts.end());
+    }
+
+    source.swap(text);
+    lex = Lexer(std::string_view { source.data(), source.size() });
+    lineCursor = {};
+    phase.setWork(newEnd - byteOf(first), "source byte");
+    return Reparsed { .firstLine = first + 1, .lines = newStarts.size() };
+}
+
+template <typename Traits>
+std::vector<std::string> Assembler<Traits>::residentErrors()
+{
+    std::vector<std::string> errors;
+    for (const auto& [line, range] : rangeErrors) {
+        errors.insert(errors.end(), range.errors.begin(), range.errors.end());
+    }
+    if (unresolved == 0) {
+        return errors;
+    }
+    for (const auto& instr : instructions) {
+        if (instr.dataType != DataType::Identifier) {
+            continue;
+        }
+        const auto label = labels.find(instr.identifier);
+        if (label == labels.end()) {
+            errors.push_back(fmt::format("error on line: {}\n{}\nlabel \"{}\" does not exist",
+                instr.position.line,
+                lineText(instr.position.line),
+                instr.identifier));
+        } else if (!reaches(instr, label->second)) {
+            errors.push_back(fmt::format("error on line: {}\n{}\nlabel \"{}\" at {:x} is out of reach of {}",
+                instr.position.line,
+                lineText(instr.position.line),
+                instr.identifier,
+                label->second,
+                InstructionToString(instr.instr)));
+        }
+    }
+    return errors;
+}
+
+template <typename Traits>
+void writeImage(const char* input, const char* output, const Assembler<Traits>& assembler, std::vector<typename Traits::Word> values, const AssembleOptions& options)
+{
+    if (options.sourceMap) {
+        const std::string mapFile = sourceMapPath(output);
+        writeSourceMap(mapFile.c_str(), std::strcmp(input, "-") == 0 ? "<stdin>" : input, static_cast<u32>(values.size()), imageChecksum(std::span<const typename Traits::Word>(values)), assembler.sourceLines(), assembler.symbols());
+    }
 
+    if (!options.rawImage) {
+        writeContainerImage<typename Traits::Word>(output, values, assembler.codeWords(), assembler.symbols());
+        return;
+    }
+
+    {
+        Perf::Phase phase("endian swap");
+        phase.setBytes(values.size() * sizeof(typename Traits::Word));
+        // convert to big endian
         for (auto& value : values) {
-            value = std::rotr(value, 8);
+            value = swapBytes(value);
             LOGT("value: {:x}", value);
         }
+    }
+
+    dataToFile(output, std::span(values));
+}
+
+void logErrors(const std::vector<std::string>& errors, const std::runtime_error& error)
+{
+    for (const std::string& message : errors) {
+        LOGE("{}\n", message);
+    }
+    LOGE("{}\n", error.what());
+}
+
+struct CorpusFile {
+    std::filesystem::path source;
+    // relative to the output directory
+    std::filesystem::path image;
+};
+
+// the .asm files under a directory, or the files a manifest lists one per line
+std::vector<CorpusFile> corpusFiles(const char* input)
+{
+    namespace fs = std::filesystem;
+    std::vector<CorpusFile> files;
+    const auto add = [&](const fs::path& root, const fs::path& source) {
+        // sources outside of the root land directly in the output directory
+        fs::path relative = source.lexically_relative(root);
+        if (relative.empty() || *relative.begin() == "..") {
+            relative = source.filename();
+        }
+        files.push_back({ .source = source, .image = relative.replace_extension(".bin") });
+    };
+
+    if (fs::is_directory(input)) {
+        for (const auto& entry : fs::recursive_directory_iterator(input)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".asm") {
+                add(input, entry.path());
+            }
+        }
+        // directory order is unspecified, sorted the report lists files the same way every time
+        std::sort(files.begin(), files.end(), [](const CorpusFile& a, const CorpusFile& b) { return a.source < b.source; });
+        return files;
+    }
+
+    std::ifstream manifest(input);
+    if (!manifest) {
+        throw std::runtime_error(fmt::format("cannot open {}: {}", input, std::strerror(errno)));
+    }
+    // relative entries are relative to the manifest
+    fs::path root = fs::path(input).parent_path();
+    if (root.empty()) {
+        root = ".";
+    }
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        fs::path source(line);
+        add(root, source.is_relative() ? root / source : source);
+    }
+    return files;
+}
+
+// writes the image of a resident assembler, or reports why it cannot
+template <typename Traits>
+void writeResident(const char* input, const char* output, Assembler<Traits>& assembler, const AssembleOptions& options)
+{
+    const std::vector<std::string> errors = assembler.residentErrors();
+    if (!errors.empty()) {
+        for (const std::string& message : errors) {
+            LOGE("{}\n", message);
+        }
+        LOGE("not writing {} until the errors are fixed\n", output);
+        return;
+    }
+    writeImage(input, output, assembler, assembler.image(), options);
+}
+
+} // anonymous namespace
 
-        dataToFile(output, std::span(values));
+template <typename Traits>
+int assemble(const char* input, const char* output, const AssembleOptions& options)
+{
+    Assembler<Traits> assembler(options.optimize);
+    try {
+        writeImage(input, output, assembler, assembler.assemble(input), options);
 
         return 0;
     } catch (const std::runtime_error& error) {
-        LOGE("{}\n", error.what());
+        logErrors(assembler.errors(), error);
         return 1;
     }
 }
 
-int assembleToVec(const char* input, const char* outputFile, std::vector<Word>& output)
+template <typename Traits>
+int assembleToVec(const char* input, const char* outputFile, std::vector<typename Traits::Word>& output, const AssembleOptions& options)
 {
+    Assembler<Traits> assembler(options.optimize);
     try {
-        std::vector<char> fileContents = fileToVector<char>(input);
-        Assembler assembler({ fileContents.data(), fileContents.size() });
-        std::vector<Word> values = assembler.assemble();
+        output = assembler.assemble(input);
 
         if (outputFile != nullptr) {
+            writeImage(input, outputFile, assembler, output, options);
+        }
+        return 0;
+    } catch (const std::runtime_error& error) {
+        logErrors(assembler.errors(), error);
+        return 1;
+    }
+}
 
-            // convert to big endian
-            for (auto& value : values) {
-                value = std::rotr(value, 8);
+template <typename Traits>
+int assembleAll(const char* input, const char* outputDirectory, std::size_t threads, const AssembleOptions& options)
+{
+    try {
+        const std::vector<CorpusFile> files = corpusFiles(input);
+        std::filesystem::create_directories(outputDirectory);
+
+        // the errors of each failed file, reported in file order once all are done
+        std::vector<std::vector<std::string>> failures(files.size());
+        std::atomic<std::size_t> next { 0 };
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> workers;
+            const std::size_t count = std::clamp<std::size_t>(threads, 1, std::max<std::size_t>(files.size(), 1));
+            for (std::size_t worker = 0; worker < count; worker++) {
+                workers.emplace_back([&] {
+                    // one assembler per thread, its buffers grow to the largest file and stay
+                    Assembler<Traits> assembler(options.optimize);
+                    for (std::size_t i = next++; i < files.size(); i = next++) {
+                        const std::string source = files[i].source.string();
+                        const std::filesystem::path image = std::filesystem::path(outputDirectory) / files[i].image;
+                        try {
+                            std::error_code error;
+                            std::filesystem::create_directories(image.parent_path(), error);
+                            writeImage(source.c_str(), image.string().c_str(), assembler, assembler.assemble(source.c_str()), options);
+                        } catch (const std::runtime_error& error) {
+                            failures[i] = assembler.errors();
+                            failures[i].emplace_back(error.what());
+                        }
+                    }
+                });
             }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-            dataToFile(outputFile, std::span(values));
+        std::size_t failed = 0;
+        for (std::size_t i = 0; i < files.size(); i++) {
+            if (failures[i].empty()) {
+                continue;
+            }
+            failed++;
+            for (const std::string& message : failures[i]) {
+                LOGE("{}: {}\n", files[i].source.string(), message);
+            }
+        }
+        fmt::print("assembled {} of {} files in {:.2f}s, {} failed\n", files.size() - failed, files.size(), seconds, failed);
+        return failed == 0 ? 0 : 1;
+    } catch (const std::runtime_error& error) {
+        LOGE("{}\n", error.what());
+        return 1;
+    }
+}
 
-            // convert to little endian
-            for (auto& value : values) {
-                value = std::rotr(value, 8);
+template <typename Traits>
+int watchAssemble(const char* input, const char* output, const AssembleOptions& options)
+{
+    try {
+        if (options.optimize) {
+            LOGW("watch does not run the optimizer, the images are written as assembled");
+        }
+        Assembler<Traits> assembler;
+        assembler.assembleResident(input);
+        writeResident(input, output, assembler, options);
+
+        // editors often save by renaming a new file over the old one, so watch the directory
+        const std::filesystem::path path(input);
+        const std::string name = path.filename().string();
+        const std::string directory = path.has_parent_path() ? path.parent_path().string() : ".";
+        const int watcher = inotify_init1(IN_CLOEXEC);
+        if (watcher == -1 || inotify_add_watch(watcher, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+            throw std::runtime_error(fmt::format("cannot watch {}: {}", directory, std::strerror(errno)));
+        }
+        fmt::print("watching {}, writing {}\n", input, output);
+        std::fflush(stdout);
+
+        alignas(inotify_event) std::array<char, 4096> events {};
+        while (true) {
+            const ssize_t length = read(watcher, events.data(), events.size());
+            if (length <= 0) {
+                if (length == -1 && errno == EINTR) {
+                    continue;
+                }
+                close(watcher);
+                throw std::runtime_error(fmt::format("cannot read events of {}: {}", directory, std::strerror(errno)));
+            }
+            bool changed = false;
+            for (ssize_t at = 0; at < length;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(events.data() + at);
+                changed |= event->len != 0 && name == event->name;
+                at += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            }
+            if (!changed || !std::filesystem::exists(input)) {
+                continue;
             }
 
-            output = std::move(values);
-        } else {
-            output = std::move(values);
+            const auto start = std::chrono::steady_clock::now();
+            const auto reparsed = assembler.update(input);
+            if (!reparsed) {
+                continue;
+            }
+            writeResident(input, output, assembler, options);
+            fmt::print("reparsed lines {}-{} of {}, {} words in {:.2f} ms\n",
+                reparsed->firstLine,
+                reparsed->firstLine + reparsed->lines,
+                input,
+                assembler.image().size(),
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            std::fflush(stdout);
         }
-        return 0;
     } catch (const std::runtime_error& error) {
         LOGE("{}\n", error.what());
         return 1;
     }
 }
+
+template int assemble<Marie16>(const char* input, const char* output, const AssembleOptions& options);
+template int assemble<Marie32>(const char* input, const char* output, const AssembleOptions& options);
+template int assembleToVec<Marie16>(const char* input, const char* outputFile, std::vector<Marie16::Word>& output, const AssembleOptions& options);
+template int assembleToVec<Marie32>(const char* input, const char* outputFile, std::vector<Marie32::Word>& output, const AssembleOptions& options);
+template int assembleAll<Marie16>(const char* input, const char* outputDirectory, std::size_t threads, const AssembleOptions& options);
+template int assembleAll<Marie32>(const char* input, const char* outputDirectory, std::size_t threads, const AssembleOptions& options);
+template int watchAssemble<Marie16>(const char* input, const char* output, const AssembleOptions& options);
+template int watchAssemble<Marie32>(const char* input, const char* output, const AssembleOptions& options);
@@ -1,4 +1,26 @@
 #pragma once
 
-int assemble(const char* input, const char* output);
-int assembleToVec(const char* input, const char* outputFile, std::vector<Word>& output);
+#include "instructions.hpp"
+
+struct AssembleOptions {
+    bool optimize = false;
+    // write the legacy big endian word dump instead of a container image
+    bool rawImage = false;
+    // also write <output>.map, see sourcemap.hpp
+    bool sourceMap = false;
+};
+
+template <typename Traits = Marie16>
+int assemble(const char* input, const char* output, const AssembleOptions& options);
+template <typename Traits = Marie16>
+int assembleToVec(const char* input, const char* outputFile, std::vector<typename Traits::Word>& output, const AssembleOptions& options);
+// Assembles every .asm file under the directory input, or every file the
+// manifest input lists one per line, into outputDirectory on threads threads.
+// Images keep their path relative to the directory or manifest, errors are
+// reported together once every file is done.
+template <typename Traits = Marie16>
+int assembleAll(const char* input, const char* outputDirectory, std::size_t threads, const AssembleOptions& options);
+// Assembles input to output, then reassembles it on every save until killed.
+// The parse stays resident and only the edited lines are parsed again.
+template <typename Traits = Marie16>
+int watchAssemble(const char* input, const char* output, const AssembleOptions& options);
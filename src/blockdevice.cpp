@@ -0,0 +1,35 @@
+#include "blockdevice.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BlockDevice::BlockDevice(const char* path)
+{
+    mFd = open(path, O_RDWR);
+    if (mFd == -1) {
+        throw std::runtime_error(fmt::format("cannot open block device {}: {}", path, std::strerror(errno)));
+    }
+
+    struct stat info {};
+    if (fstat(mFd, &info) == -1 || info.st_size <= 0) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("block device {} is empty", path));
+    }
+    mSize = static_cast<std::size_t>(info.st_size);
+
+    void* data = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (data == MAP_FAILED) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("cannot map block device {}: {}", path, std::strerror(errno)));
+    }
+    mData = static_cast<std::byte*>(data);
+    LOGD("mapped block device {} of {} bytes", path, mSize);
+}
+
+BlockDevice::~BlockDevice()
+{
+    munmap(mData, mSize);
+    close(mFd);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// A host file mapped into the process and exposed to a guest as a block
+// device. Blocks hold BlockWords words stored big endian like images, a
+// trailing partial block is not addressable.
+struct BlockDevice {
+    static constexpr std::size_t BlockWords = 256;
+
+    explicit BlockDevice(const char* path);
+    ~BlockDevice();
+
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+
+    [[nodiscard]] std::size_t blocks(std::size_t wordSize) const { return mSize / (BlockWords * wordSize); }
+    // bytes of the mapping, writes go straight to the file
+    [[nodiscard]] std::span<std::byte> bytes() const { return { mData, mSize }; }
+
+private:
+    int mFd = -1;
+    std::byte* mData = nullptr;
+    std::size_t mSize {};
+};
+
+// The control registers sit in the last words of the address space, a guest
+// stores a block number, a memory address and a block count, then a command.
+// The transfer is done when the command store returns and Status holds the
+// result. Addresses at and above MmioBase are not part of memory while a
+// device is attached.
+enum struct BlockRegister : unsigned {
+    Block,
+    Address,
+    Count,
+    Command, // write only
+    Status, // read only
+    Blocks, // read only, blocks on the device
+    RegisterCount,
+};
+
+enum struct BlockCommand : unsigned {
+    Read = 1, // device to memory
+    Write = 2, // memory to device
+};
+
+enum struct BlockStatus : unsigned {
+    Ok,
+    BadCommand,
+    OutsideDevice,
+    OutsideMemory,
+};
+
+template <typename Traits>
+constexpr std::size_t MmioBase = Traits::MaxMemory - 8;
+static_assert(static_cast<unsigned>(BlockRegister::RegisterCount) <= 8);
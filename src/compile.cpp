@@ -0,0 +1,504 @@
+#include "compile.hpp"
+
+#include "file.hpp"
+#include "instructions.hpp"
+#include "marie.hpp"
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// Translates an assembled image into a C program. Every address reachable as
+// code gets a label and one statement, computed targets (JumpI, resuming after
+// a store into code) go through a switch on the pc, and once the program
+// modifies an address that was compiled, execution continues in an embedded
+// interpreter that mirrors Marie::execInstr.
+struct Compiler {
+    Compiler(std::vector<Word> image, Word entryPoint);
+
+    [[nodiscard]] std::string generate();
+
+private:
+    std::vector<Word> mImage;
+    Word mEntryPoint;
+    std::vector<bool> mIsCode;
+
+    void findCode();
+    void emitInstruction(std::string& out, std::size_t address);
+
+    [[nodiscard]] bool compiled(std::size_t address) const;
+    [[nodiscard]] bool plainData(Word address) const;
+    [[nodiscard]] std::string gotoAddress(std::size_t address) const;
+};
+
+constexpr const char* Includes = R"(#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+)";
+
+constexpr const char* Prologue = R"(static uint16_t ac;
+static uint16_t pc;
+static int halt;
+static int code_dirty;
+
+static uint16_t read_hex(void)
+{
+    char line[256];
+    unsigned long value = 0;
+    if (fgets(line, sizeof line, stdin) == NULL) {
+        return 0;
+    }
+    if (strchr(line, '\n') == NULL) {
+        int c;
+        while ((c = getchar()) != '\n' && c != EOF) {
+        }
+    }
+    for (const char* c = line;; c++) {
+        int digit;
+        if (*c >= '0' && *c <= '9') {
+            digit = *c - '0';
+        } else if (*c >= 'a' && *c <= 'f') {
+            digit = *c - 'a' + 10;
+        } else if (*c >= 'A' && *c <= 'F') {
+            digit = *c - 'A' + 10;
+        } else {
+            break;
+        }
+        value = value * 16 + (unsigned long)digit;
+        if (value > 0xffff) {
+            return 0;
+        }
+    }
+    return (uint16_t)value;
+}
+
+static uint16_t load(uint16_t address)
+{
+    if (address >= IMAGE_SIZE) {
+        printf("attempting to address outside of memory at %x, returning 0 and halting\n", address);
+        halt = 1;
+        return 0;
+    }
+    return mem[address];
+}
+
+static void store(uint16_t address)
+{
+    if (address >= IMAGE_SIZE) {
+        printf("attempting to address outside of memory, doing nothing and halting\n");
+        halt = 1;
+        return;
+    }
+    if (is_code[address] && mem[address] != ac) {
+        code_dirty = 1;
+    }
+    mem[address] = ac;
+}
+
+static int skip_cond(uint16_t condition)
+{
+    switch (condition & 0x0c00) {
+    case 0x0000:
+        return (int16_t)ac < 0;
+    case 0x0400:
+        return (int16_t)ac == 0;
+    case 0x0800:
+        return (int16_t)ac > 0;
+    default:
+        return 0;
+    }
+}
+
+)";
+
+constexpr const char* Interpreter = R"(
+interp:
+    while (!halt && pc < IMAGE_SIZE) {
+        if (!code_dirty && is_code[pc]) {
+            goto dispatch;
+        }
+        uint16_t op = mem[pc] >> 12 & 0xf;
+        uint16_t x = mem[pc] & 0x0fff;
+        pc += 1;
+        switch (op) {
+        case 0x0:
+            ac = pc;
+            store(x);
+            ac = x + 1;
+            pc = ac;
+            break;
+        case 0x1:
+            ac = load(x);
+            break;
+        case 0x2:
+            store(x);
+            break;
+        case 0x3:
+            ac = ac + load(x);
+            break;
+        case 0x4:
+            ac = ac - load(x);
+            break;
+        case 0x5:
+            ac = read_hex();
+            break;
+        case 0x6:
+            printf("%x\n", ac);
+            break;
+        case 0x7:
+            halt = 1;
+            break;
+        case 0x8:
+            if (skip_cond(x) && pc < IMAGE_SIZE) {
+                pc += 1;
+            }
+            break;
+        case 0x9:
+            pc = x;
+            break;
+        case 0xa:
+            ac = 0;
+            break;
+        case 0xb:
+            ac = ac + load(load(x));
+            break;
+        case 0xc:
+            pc = load(x) & 0x0fff;
+            break;
+        case 0xd:
+            store(load(x));
+            break;
+        case 0xe:
+            ac = load(load(x));
+            break;
+        case 0xf: {
+            /* atomic extensions, a compiled program is a single hart */
+            uint16_t a = x & 0x3ff;
+            uint16_t old;
+            switch (x >> 10) {
+            case 0:
+                ac = 0;
+                break;
+            case 1:
+                old = load(a);
+                if (!halt) {
+                    ac = old + ac;
+                    store(a);
+                    ac = old;
+                }
+                break;
+            case 2:
+                old = load(a);
+                if (!halt) {
+                    if (old == 0) {
+                        store(a);
+                    }
+                    ac = old;
+                }
+                break;
+            default:
+                printf("Invalid instruction %x at PC %x\n", op, pc);
+            }
+            break;
+        }
+        default:
+            printf("Invalid instruction %x at PC %x\n", op, pc);
+        }
+    }
+
+done:
+    return ac;
+}
+)";
+
+Compiler::Compiler(std::vector<Word> image, Word entryPoint)
+    : mImage(std::move(image))
+    , mEntryPoint(entryPoint)
+    , mIsCode(mImage.size(), false)
+{
+}
+
+void Compiler::findCode()
+{
+    std::vector<std::size_t> work;
+    auto push = [&](std::size_t address) {
+        if (address < mImage.size() && !mIsCode[address]) {
+            mIsCode[address] = true;
+            work.push_back(address);
+        }
+    };
+
+    push(mEntryPoint);
+    while (!work.empty()) {
+        std::size_t address = work.back();
+        work.pop_back();
+
+        auto [instr, operand] = decodeInstruction(mImage[address]);
+        switch (instr) {
+        case Instruction::Jns:
+            // the subroutine body, and the return point its JumpI will dispatch to
+            push(operand + 1U);
+            push(address + 1);
+            break;
+        case Instruction::Jump:
+            push(operand);
+            break;
+        case Instruction::Skipcond:
+            push(address + 1);
+            push(address + 2);
+            break;
+        case Instruction::JumpI:
+        case Instruction::Halt:
+            break;
+        default:
+            push(address + 1);
+        }
+    }
+}
+
+bool Compiler::compiled(std::size_t address) const
+{
+    return address < mImage.size() && mIsCode[address];
+}
+
+bool Compiler::plainData(Word address) const
+{
+    return address < mImage.size() && !mIsCode[address];
+}
+
+std::string Compiler::gotoAddress(std::size_t address) const
+{
+    if (address >= mImage.size()) {
+        return "goto done;";
+    }
+    if (compiled(address)) {
+        return fmt::format("goto L_{:x};", address);
+    }
+    return fmt::format("pc = {:#x}; goto interp;", address);
+}
+
+void Compiler::emitInstruction(std::string& out, std::size_t address)
+{
+    auto [instr, x] = decodeInstruction(mImage[address]);
+    const std::size_t next = address + 1;
+
+    // any store that may touch compiled code or leave the image has to give
+    // control back to the dispatcher with the pc set after the instruction
+    auto storeTo = [&](const std::string& target) {
+        return fmt::format("store({}); if (code_dirty | halt) {{ pc = {:#x}; goto dispatch; }}", target, next);
+    };
+
+    out += fmt::format("L_{:x}:\n    ", address);
+    switch (instr) {
+    case Instruction::Jns: {
+        const std::size_t target = x + 1U;
+        if (plainData(x)) {
+            out += fmt::format("mem[{:#x}] = {:#x}; ", x, next);
+        } else {
+            out += fmt::format("ac = {:#x}; store({:#x}); ", next, x);
+            out += fmt::format("if (code_dirty | halt) {{ ac = pc = {:#x}; goto dispatch; }} ", target);
+        }
+        out += fmt::format("ac = {:#x}; {}", target, gotoAddress(target));
+        break;
+    }
+    case Instruction::Load:
+        if (x < mImage.size()) {
+            out += fmt::format("ac = mem[{:#x}];", x);
+        } else {
+            out += fmt::format("ac = load({:#x}); goto done;", x);
+        }
+        break;
+    case Instruction::Store:
+        if (plainData(x)) {
+            out += fmt::format("mem[{:#x}] = ac;", x);
+        } else {
+            out += storeTo(fmt::format("{:#x}", x));
+        }
+        break;
+    case Instruction::Add:
+        if (x < mImage.size()) {
+            out += fmt::format("ac = ac + mem[{:#x}];", x);
+        } else {
+            out += fmt::format("ac = ac + load({:#x}); goto done;", x);
+        }
+        break;
+    case Instruction::Subt:
+        if (x < mImage.size()) {
+            out += fmt::format("ac = ac - mem[{:#x}];", x);
+        } else {
+            out += fmt::format("ac = ac - load({:#x}); goto done;", x);
+        }
+        break;
+    case Instruction::Input:
+        out += "ac = read_hex();";
+        break;
+    case Instruction::Output:
+        out += "printf(\"%x\\n\", ac);";
+        break;
+    case Instruction::Halt:
+        out += "halt = 1; goto done;";
+        break;
+    case Instruction::Skipcond:
+        out += fmt::format("if (skip_cond({:#x})) {}", x, gotoAddress(address + 2));
+        break;
+    case Instruction::Jump:
+        out += gotoAddress(x);
+        break;
+    case Instruction::Clear:
+        out += "ac = 0;";
+        break;
+    case Instruction::AddI:
+        out += fmt::format("ac = ac + load(load({:#x})); if (halt) goto done;", x);
+        break;
+    case Instruction::JumpI:
+        out += fmt::format("pc = load({:#x}) & 0x0fff; if (halt) goto done; goto dispatch;", x);
+        break;
+    case Instruction::StoreI:
+        out += storeTo(fmt::format("load({:#x})", x));
+        break;
+    case Instruction::LoadI:
+        out += fmt::format("ac = load(load({:#x})); if (halt) goto done;", x);
+        break;
+    case Instruction::HartId:
+        out += "ac = 0;";
+        break;
+    case Instruction::FAdd:
+        out += fmt::format("{{ uint16_t old = load({0:#x}); if (halt) goto done; ac = old + ac; store({0:#x}); ac = old; }} ", x);
+        out += fmt::format("if (code_dirty | halt) {{ pc = {:#x}; goto dispatch; }}", next);
+        break;
+    case Instruction::Cas:
+        out += fmt::format("{{ uint16_t old = load({0:#x}); if (halt) goto done; if (old == 0) store({0:#x}); ac = old; }} ", x);
+        out += fmt::format("if (code_dirty | halt) {{ pc = {:#x}; goto dispatch; }}", next);
+        break;
+    default:
+        out += fmt::format("printf(\"Invalid instruction %x at PC %x\\n\", 0xf, {:#x});", next);
+    }
+    out += "\n";
+
+    // fall through into the next address like the run loop would
+    if (instr != Instruction::Halt && instr != Instruction::Jump && instr != Instruction::JumpI && instr != Instruction::Jns && !compiled(next)) {
+        out += fmt::format("    {}\n", gotoAddress(next));
+    }
+}
+
+std::string Compiler::generate()
+{
+    findCode();
+
+    std::string out = Includes;
+    out += fmt::format("#define IMAGE_SIZE {}\n\nstatic uint16_t mem[IMAGE_SIZE + 1] = {{", mImage.size());
+    for (std::size_t i = 0; i < mImage.size(); i++) {
+        out += fmt::format("{}{:#x},", i % 16 == 0 ? "\n    " : " ", mImage[i]);
+    }
+    out += "\n};\n\nstatic const unsigned char is_code[IMAGE_SIZE + 1] = {";
+    for (std::size_t i = 0; i < mImage.size(); i++) {
+        out += fmt::format("{}{},", i % 32 == 0 ? "\n    " : " ", mIsCode[i] ? 1 : 0);
+    }
+    out += "\n};\n\n";
+    out += Prologue;
+
+    // starts where exec-bin would, at the entry point of a container image
+    out += fmt::format("int main(void)\n{{\n    pc = {:#x};\n\ndispatch:\n", mEntryPoint);
+    out += "    if (halt || pc >= IMAGE_SIZE) {\n        goto done;\n    }\n";
+    out += "    if (code_dirty) {\n        goto interp;\n    }\n";
+    out += "    switch (pc) {\n";
+    for (std::size_t i = 0; i < mImage.size(); i++) {
+        if (mIsCode[i]) {
+            out += fmt::format("    case {:#x}: goto L_{:x};\n", i, i);
+        }
+    }
+    out += "    default: goto interp;\n    }\n\n";
+
+    for (std::size_t i = 0; i < mImage.size(); i++) {
+        if (mIsCode[i]) {
+            emitInstruction(out, i);
+        }
+    }
+
+    out += Interpreter;
+    return out;
+}
+
+// Runs $CC, or cc, without a shell so no path can expand into a command.
+// CC is split on whitespace like make does, for wrappers such as "ccache gcc".
+int runCompiler(const std::string& sourceFile, const char* output)
+{
+    const char* cc = std::getenv("CC");
+    std::string_view command = cc != nullptr ? cc : "";
+    std::vector<std::string> args;
+    while (!command.empty()) {
+        const std::size_t start = command.find_first_not_of(" \t\n");
+        if (start == std::string_view::npos) {
+            break;
+        }
+        command.remove_prefix(start);
+        const std::size_t end = std::min(command.find_first_of(" \t\n"), command.size());
+        args.emplace_back(command.substr(0, end));
+        command.remove_prefix(end);
+    }
+    if (args.empty()) {
+        args.emplace_back("cc");
+    }
+    args.insert(args.end(), { "-O2", "-o", output, sourceFile });
+    LOGD("compiling with {} and {} arguments", args.front(), args.size() - 1);
+
+    std::vector<char*> argv;
+    for (std::string& arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid {};
+    if (const int error = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ); error != 0) {
+        throw std::runtime_error(fmt::format("could not run {}: {}", args.front(), std::strerror(error)));
+    }
+    int status {};
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            throw std::runtime_error(fmt::format("could not wait for {}: {}", args.front(), std::strerror(errno)));
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+} // anonymous namespace
+
+int compileToNative(const char* input, const char* output)
+{
+    try {
+        std::vector<char> bytes = fileToVector<char>(input);
+        std::vector<Word> data;
+        Word entryPoint {};
+        if (isContainerImage(bytes)) {
+            ContainerImage<Word> image(std::move(bytes));
+            data.resize(image.imageWords());
+            image.decompressInto(data);
+            entryPoint = static_cast<Word>(image.entryPoint());
+        } else {
+            data = marieLoadImage(input);
+        }
+
+        if (data.size() > Marie16::MaxMemory) {
+            LOGW("Warning, an image size of {} is larger than MARIE's max memory of {} Bytes\n", data.size(), Marie16::MaxMemory);
+            data.resize(Marie16::MaxMemory);
+        }
+
+        Compiler compiler(std::move(data), entryPoint);
+        std::string source = compiler.generate();
+
+        std::string sourceFile = fmt::format("{}.c", output);
+        dataToFile(sourceFile.c_str(), std::span(source));
+
+        if (runCompiler(sourceFile, output) != 0) {
+            LOGE("C compiler failed on {}\n", sourceFile);
+            return 1;
+        }
+        return 0;
+    } catch (const std::runtime_error& error) {
+        LOGE("{}\n", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int compileToNative(const char* input, const char* output);
@@ -0,0 +1,280 @@
+#include "debugger.hpp"
+
+#include "file.hpp"
+#include "marie.hpp"
+
+namespace {
+
+std::vector<std::string_view> splitWords(std::string_view line)
+{
+    std::vector<std::string_view> words;
+    std::size_t start = 0;
+    while ((start = line.find_first_not_of(" \t\r", start)) != std::string_view::npos) {
+        const std::size_t end = std::min(line.find_first_of(" \t\r", start), line.size());
+        words.push_back(line.substr(start, end - start));
+        start = end;
+    }
+    return words;
+}
+
+template <typename T>
+std::optional<T> parseHex(std::string_view text)
+{
+    T value {};
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+    if (error != std::errc {} || end != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+template <typename Traits>
+struct Debugger {
+    using Vm = BasicMarie<Traits>;
+    using Word = typename Traits::Word;
+    using DebugStop = typename Vm::DebugStop;
+
+    explicit Debugger(const char* image);
+
+    int run();
+
+private:
+    std::optional<Vm> mVm;
+    std::vector<ImageSymbol> mSymbols;
+    std::unique_ptr<SourceMap> mSourceMap;
+
+    [[nodiscard]] std::optional<Word> address(std::string_view text) const;
+    [[nodiscard]] std::string describe(Word address) const;
+    void report(const DebugStop& stop);
+    void breakCommand(const std::vector<std::string_view>& words);
+    void watchCommand(const std::vector<std::string_view>& words);
+    void examineCommand(const std::vector<std::string_view>& words);
+};
+
+template <typename Traits>
+Debugger<Traits>::Debugger(const char* image)
+{
+    std::vector<char> bytes = fileToVector<char>(image);
+    if (isContainerImage(bytes)) {
+        ContainerImage<Word> container(std::move(bytes));
+        mSymbols = container.symbols();
+        mVm.emplace(container);
+    } else {
+        std::vector<Word> words = marieLoadImage<Traits>(image);
+        mVm.emplace(words.data(), words.size());
+    }
+    mSourceMap = SourceMap::openFor(image, mVm->memory());
+    mVm->setSourceMap(mSourceMap.get());
+}
+
+template <typename Traits>
+auto Debugger<Traits>::address(std::string_view text) const -> std::optional<Word>
+{
+    for (const ImageSymbol& symbol : mSymbols) {
+        if (symbol.name == text) {
+            return static_cast<Word>(symbol.address);
+        }
+    }
+    auto value = parseHex<Word>(text);
+    if (!value || *value >= mVm->imageSize()) {
+        fmt::print("{} is not a label or an address in the image\n", text);
+        return std::nullopt;
+    }
+    return value;
+}
+
+template <typename Traits>
+std::string Debugger<Traits>::describe(Word address) const
+{
+    if (mSourceMap != nullptr) {
+        return fmt::format("{:x} {}", address, mSourceMap->describe(address));
+    }
+    // the closest label at or before address
+    const ImageSymbol* closest = nullptr;
+    for (const ImageSymbol& symbol : mSymbols) {
+        if (symbol.address <= address && (closest == nullptr || symbol.address >= closest->address)) {
+            closest = &symbol;
+        }
+    }
+    if (closest == nullptr) {
+        return fmt::format("{:x}", address);
+    }
+    if (closest->address == address) {
+        return fmt::format("{:x} ({})", address, closest->name);
+    }
+    return fmt::format("{:x} ({}+{:x})", address, closest->name, address - closest->address);
+}
+
+template <typename Traits>
+void Debugger<Traits>::report(const DebugStop& stop)
+{
+    const Word pc = mVm->pc();
+    const auto next = Vm::decode(mVm->peek(pc));
+    switch (stop.reason) {
+    case DebugStop::Reason::Halted:
+        fmt::print("{} at {}, AC {:x}, {} instructions\n", mVm->faulted() ? "faulted" : "halted", describe(pc), mVm->accumulator(), mVm->retired());
+        return;
+    case DebugStop::Reason::Breakpoint:
+        fmt::print("breakpoint at {}\n", describe(stop.address));
+        break;
+    case DebugStop::Reason::WatchRead:
+        fmt::print("read of {}, holds {:x}\n", describe(stop.address), mVm->peek(stop.address));
+        break;
+    case DebugStop::Reason::WatchWrite:
+        fmt::print("write to {}, now {:x}\n", describe(stop.address), mVm->peek(stop.address));
+        break;
+    case DebugStop::Reason::Step:
+        break;
+    }
+    fmt::print("  next {}: {} {:x}, AC {:x}\n", describe(pc), InstructionToString(next.first), next.second, mVm->accumulator());
+}
+
+template <typename Traits>
+void Debugger<Traits>::breakCommand(const std::vector<std::string_view>& words)
+{
+    if (words.size() != 2 && words.size() != 6) {
+        fmt::print("usage: break [address] [if ac ==|!=|<|> [hex value]]\n");
+        return;
+    }
+    auto at = address(words[1]);
+    if (!at) {
+        return;
+    }
+    if (words.size() == 2) {
+        mVm->setBreakpoint(*at);
+        fmt::print("breakpoint at {}\n", describe(*at));
+        return;
+    }
+
+    using Compare = typename Vm::AcCondition::Compare;
+    static constexpr std::array<std::pair<std::string_view, Compare>, 4> Operators { {
+        { "==", Compare::Equal },
+        { "!=", Compare::NotEqual },
+        { "<", Compare::Less },
+        { ">", Compare::Greater },
+    } };
+    const auto op = std::find_if(Operators.begin(), Operators.end(), [&](const auto& entry) { return entry.first == words[4]; });
+    auto value = parseHex<Word>(words[5]);
+    if (words[2] != "if" || words[3] != "ac" || op == Operators.end() || !value) {
+        fmt::print("usage: break [address] [if ac ==|!=|<|> [hex value]]\n");
+        return;
+    }
+    mVm->setBreakpoint(*at, typename Vm::AcCondition { .compare = op->second, .value = *value });
+    fmt::print("breakpoint at {} if AC {} {:x}\n", describe(*at), op->first, *value);
+}
+
+template <typename Traits>
+void Debugger<Traits>::watchCommand(const std::vector<std::string_view>& words)
+{
+    using Watch = typename Vm::Watch;
+    Watch kind = Watch::Access;
+    if (words.size() == 3 && words[2] == "read") {
+        kind = Watch::Read;
+    } else if (words.size() == 3 && words[2] == "write") {
+        kind = Watch::Write;
+    } else if (words.size() != 2 && !(words.size() == 3 && words[2] == "access")) {
+        fmt::print("usage: watch [address] [read|write|access]\n");
+        return;
+    }
+    if (auto at = address(words[1])) {
+        mVm->setWatchpoint(*at, kind);
+        fmt::print("watching {}\n", describe(*at));
+    }
+}
+
+template <typename Traits>
+void Debugger<Traits>::examineCommand(const std::vector<std::string_view>& words)
+{
+    if (words.size() < 2 || words.size() > 3) {
+        fmt::print("usage: x [address] [count]\n");
+        return;
+    }
+    auto at = address(words[1]);
+    const auto count = words.size() == 3 ? parseHex<std::size_t>(words[2]) : std::optional<std::size_t> { 1 };
+    if (!at || !count) {
+        return;
+    }
+    for (std::size_t i = *at; i < std::min(*at + *count, mVm->imageSize()); i++) {
+        fmt::print("{}: {:x}\n", describe(static_cast<Word>(i)), mVm->peek(static_cast<Word>(i)));
+    }
+}
+
+template <typename Traits>
+int Debugger<Traits>::run()
+{
+    fmt::print("{} words, entry point {}\n", mVm->imageSize(), describe(mVm->pc()));
+    bool halted = false;
+    std::string line;
+    while (true) {
+        fmt::print("(mdb) ");
+        std::fflush(stdout);
+        if (!std::getline(std::cin, line)) {
+            fmt::print("\n");
+            break;
+        }
+        const std::vector<std::string_view> words = splitWords(line);
+        if (words.empty()) {
+            continue;
+        }
+
+        const std::string_view command = words.front();
+        if (command == "quit" || command == "q") {
+            break;
+        } else if (command == "break" || command == "b") {
+            breakCommand(words);
+        } else if (command == "watch" || command == "w") {
+            watchCommand(words);
+        } else if (command == "delete" || command == "d") {
+            if (words.size() == 2) {
+                if (auto at = address(words[1])) {
+                    mVm->clearDebugFlags(*at);
+                }
+            } else {
+                fmt::print("usage: delete [address]\n");
+            }
+        } else if (command == "continue" || command == "c" || command == "step" || command == "s") {
+            if (halted) {
+                fmt::print("the program has halted\n");
+                continue;
+            }
+            DebugStop stop;
+            if (command.front() == 'c') {
+                stop = mVm->debugRun();
+            } else {
+                const auto count = words.size() == 2 ? parseHex<u64>(words[1]) : std::optional<u64> { 1 };
+                for (u64 i = 0; i < count.value_or(1); i++) {
+                    stop = mVm->debugStep();
+                    if (stop.reason != DebugStop::Reason::Step) {
+                        break;
+                    }
+                }
+            }
+            halted = stop.reason == DebugStop::Reason::Halted;
+            report(stop);
+        } else if (command == "regs" || command == "r") {
+            fmt::print("PC {}, AC {:x}, {} instructions\n", describe(mVm->pc()), mVm->accumulator(), mVm->retired());
+        } else if (command == "x") {
+            examineCommand(words);
+        } else {
+            fmt::print("commands: break, watch, delete, continue, step, regs, x, quit\n");
+        }
+    }
+    return halted ? static_cast<int>(mVm->accumulator()) : 0;
+}
+
+} // anonymous namespace
+
+template <typename Traits>
+int debugImage(const char* image)
+{
+    try {
+        Debugger<Traits> debugger(image);
+        return debugger.run();
+    } catch (const std::runtime_error& error) {
+        LOGE("{}", error.what());
+        return 1;
+    }
+}
+
+template int debugImage<Marie16>(const char* image);
+template int debugImage<Marie32>(const char* image);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "instructions.hpp"
+
+// Runs an image under a command prompt on stdin, guest Input reads the
+// following lines of stdin. Addresses are hex or, for container images,
+// label names:
+//   break [address] [if ac ==|!=|<|> [hex value]]
+//   watch [address] [read|write|access]
+//   delete [address]    removes its breakpoint and watchpoint
+//   continue, step [count], regs, x [address] [count], quit
+// Returns the accumulator once the program halts, or 0 when quit early.
+template <typename Traits = Marie16>
+int debugImage(const char* image);
@@ -2,39 +2,107 @@
 
 #include "file.hpp"
 #include "instructions.hpp"
+#include "marie.hpp"
+#include "perf.hpp"
+#include "sourcemap.hpp"
 
 namespace {
 
-std::pair<Instruction, Word> decodeInstruction(Word instr)
-{
-    std::pair<Instruction, Word> val;
-    val.first = static_cast<Instruction>(instr >> 12 & 0xF);
-    val.second = static_cast<Word>(instr & 0x0FFF);
-    return val;
-}
-
 bool instrHasZeroOperands(Instruction tok)
 {
-    return (static_cast<int>(tok) >= static_cast<int>(Instruction::Input) && static_cast<int>(tok) <= static_cast<int>(Instruction::Halt)) || tok == Instruction::Clear;
+    return (static_cast<int>(tok) >= static_cast<int>(Instruction::Input) && static_cast<int>(tok) <= static_cast<int>(Instruction::Halt)) || tok == Instruction::Clear || tok == Instruction::HartId;
 }
 
 void appendInstruction(Word instruction, std::string& output)
 {
     auto instr = decodeInstruction(instruction);
     if (instrHasZeroOperands(instr.first)) {
-        output += fmt::format("{}\n", InstructionToString(instr.first));
+        output += InstructionToString(instr.first);
     } else {
-        output += fmt::format("{} {:x}\n", InstructionToString(instr.first), instr.second);
+        output += fmt::format("{} {:x}", InstructionToString(instr.first), instr.second);
     }
 }
 
+// The text of every possible word, newline included, back to back in one
+// pool. A word's text runs from its offset to the next word's, so the table
+// holds one u32 per word and disassembling a word is a single memcpy.
+class DisassemblyTable {
+public:
+    static constexpr std::size_t Words = std::size_t { 1 } << (sizeof(Word) * 8);
+
+    static const DisassemblyTable& get()
+    {
+        static const DisassemblyTable table;
+        return table;
+    }
+
+    [[nodiscard]] std::string_view line(Word word) const
+    {
+        return { mPool.data() + mOffsets[word], mOffsets[word + 1u] - mOffsets[word] };
+    }
+
+    // the line without its newline
+    [[nodiscard]] std::string_view text(Word word) const
+    {
+        const std::string_view whole = line(word);
+        return whole.substr(0, whole.size() - 1);
+    }
+
+private:
+    DisassemblyTable()
+    {
+        Perf::Phase phase("disassemble::table");
+        mOffsets.resize(Words + 1);
+        for (std::size_t word = 0; word < Words; word++) {
+            mOffsets[word] = static_cast<u32>(mPool.size());
+            appendInstruction(static_cast<Word>(word), mPool);
+            mPool += '\n';
+        }
+        mOffsets[Words] = static_cast<u32>(mPool.size());
+        mPool.shrink_to_fit();
+        phase.setBytes(mPool.size() + mOffsets.size() * sizeof(u32));
+    }
+
+    std::vector<u32> mOffsets;
+    std::string mPool;
+};
+
 std::string disassembleToString(const char* inputFile)
 {
     std::string output {};
-    std::vector<Word> data = fileToVector<Word>(inputFile);
+    std::vector<Word> data = marieLoadImage(inputFile);
+    std::unique_ptr<SourceMap> sourceMap = SourceMap::openFor(inputFile, std::span<const Word>(data));
+    const DisassemblyTable& table = DisassemblyTable::get();
+
+    Perf::Phase phase("disassemble");
+    phase.setWork(data.size() * sizeof(Word), "source byte");
+    phase.setBytes(data.size() * sizeof(Word));
+    if (sourceMap == nullptr) {
+        // size the output once, then every word is a copy out of the pool
+        std::size_t size = 0;
+        for (Word word : data) {
+            size += table.line(word).size();
+        }
+        output.resize(size);
+        char* cursor = output.data();
+        for (Word word : data) {
+            const std::string_view line = table.line(word);
+            std::memcpy(cursor, line.data(), line.size());
+            cursor += line.size();
+        }
+        return output;
+    }
 
-    for (Word instr : data) {
-        appendInstruction(std::rotr(instr, 8), output);
+    for (std::size_t address = 0; address < data.size(); address++) {
+        // with a source map, label starts become comment lines and every word names its source line
+        if (auto label = sourceMap->label(static_cast<u32>(address)); label && label->second == 0) {
+            output += fmt::format("; {}\n", label->first);
+        }
+        output += table.text(data[address]);
+        if (auto location = sourceMap->locate(static_cast<u32>(address))) {
+            output += fmt::format(" ; {}:{}:{}", location->file, location->line, location->column);
+        }
+        output += '\n';
     }
 
     return output;
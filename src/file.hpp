@@ -1,15 +1,25 @@
 #pragma once
 
+#include "perf.hpp"
+
+// reads into data, reusing its capacity
 template <typename T>
-[[nodiscard]] std::vector<T> fileToVector(const char* fileName)
+void fileToVector(const char* fileName, std::vector<T>& data)
 {
-    std::vector<T> data;
     std::fstream file(fileName, std::ios::in);
     std::size_t size = std::filesystem::file_size(fileName);
+    Perf::Phase phase("file::read");
+    phase.setBytes(size);
 
     data.resize(size / sizeof(T));
     file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(size));
+}
 
+template <typename T>
+[[nodiscard]] std::vector<T> fileToVector(const char* fileName)
+{
+    std::vector<T> data;
+    fileToVector(fileName, data);
     return data;
 }
 
@@ -17,5 +27,25 @@ template <typename T>
 void dataToFile(const char* fileName, const std::span<T>& data)
 {
     std::fstream file(fileName, std::ios::out);
+    Perf::Phase phase("file::write");
+    phase.setBytes(data.size() * sizeof(T));
     file.write(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size() * sizeof(T)));
 }
+
+// images are stored big endian and the host is assumed to be little endian
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T swapBytes(T value)
+{
+    if constexpr (sizeof(T) == 1) {
+        return value;
+    } else if constexpr (sizeof(T) == 2) {
+        return std::rotr(value, 8);
+    } else {
+        T result {};
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            result = static_cast<T>((result << 8) | (value & 0xFF));
+            value = static_cast<T>(value >> 8);
+        }
+        return result;
+    }
+}
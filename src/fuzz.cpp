@@ -0,0 +1,246 @@
+#include "fuzz.hpp"
+
+#include "file.hpp"
+#include "marie.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+std::size_t mergeCoverage(CoverageMap& total, CoverageMap& run)
+{
+    std::size_t added = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (std::size_t i = 0; i < total.words.size(); i += 2) {
+        auto* seenWords = reinterpret_cast<__m128i*>(&total.words[i]);
+        auto* hitWords = reinterpret_cast<__m128i*>(&run.words[i]);
+        const __m128i seen = _mm_load_si128(seenWords);
+        const __m128i hit = _mm_load_si128(hitWords);
+        const __m128i fresh = _mm_andnot_si128(seen, hit);
+        // most runs find nothing new, only count when a lane has new bits
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(fresh, zero)) != 0xFFFF) {
+            alignas(16) std::array<u64, 2> lanes {};
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes.data()), fresh);
+            added += static_cast<std::size_t>(std::popcount(lanes[0]) + std::popcount(lanes[1]));
+        }
+        _mm_store_si128(seenWords, _mm_or_si128(seen, hit));
+        _mm_store_si128(hitWords, zero);
+    }
+#else
+    for (std::size_t i = 0; i < total.words.size(); i++) {
+        added += static_cast<std::size_t>(std::popcount(run.words[i] & ~total.words[i]));
+        total.words[i] |= run.words[i];
+        run.words[i] = 0;
+    }
+#endif
+    return added;
+}
+
+namespace {
+
+// splitmix64, seeded per thread so a seed and thread count repeat a session
+struct Random {
+    u64 state;
+
+    u64 next()
+    {
+        state += 0x9E3779B97F4A7C15;
+        u64 z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        return z ^ (z >> 31);
+    }
+
+    std::size_t below(std::size_t bound) { return static_cast<std::size_t>(next() % bound); }
+};
+
+constexpr std::size_t MaxInputs = 64;
+
+template <typename Traits>
+std::vector<typename Traits::Word> randomInputs(Random& random)
+{
+    std::vector<typename Traits::Word> inputs(random.below(MaxInputs / 4 + 1));
+    for (auto& value : inputs) {
+        value = static_cast<typename Traits::Word>(random.next());
+    }
+    return inputs;
+}
+
+template <typename Traits>
+std::vector<typename Traits::Word> mutate(std::vector<typename Traits::Word> inputs, Random& random)
+{
+    using Word = typename Traits::Word;
+    using SignedWord = typename Traits::SignedWord;
+    static constexpr std::array<Word, 6> Interesting {
+        0,
+        1,
+        static_cast<Word>(-1),
+        static_cast<Word>(std::numeric_limits<SignedWord>::max()),
+        static_cast<Word>(std::numeric_limits<SignedWord>::min()),
+        static_cast<Word>(Traits::AddressMask),
+    };
+
+    const std::size_t mutations = 1 + random.below(4);
+    for (std::size_t i = 0; i < mutations; i++) {
+        const std::size_t at = inputs.empty() ? 0 : random.below(inputs.size());
+        switch (random.below(6)) {
+        case 0:
+            if (!inputs.empty()) {
+                inputs[at] = static_cast<Word>(random.next());
+            }
+            break;
+        case 1:
+            if (!inputs.empty()) {
+                inputs[at] = Interesting[random.below(Interesting.size())];
+            }
+            break;
+        case 2:
+            if (!inputs.empty()) {
+                inputs[at] ^= static_cast<Word>(Word { 1 } << random.below(sizeof(Word) * 8));
+            }
+            break;
+        case 3:
+            if (!inputs.empty()) {
+                inputs[at] = static_cast<Word>(inputs[at] + (random.below(2) == 0 ? 1 : -1));
+            }
+            break;
+        case 4:
+            if (inputs.size() < MaxInputs) {
+                inputs.insert(inputs.begin() + static_cast<std::ptrdiff_t>(random.below(inputs.size() + 1)), static_cast<Word>(random.next()));
+            }
+            break;
+        default:
+            if (!inputs.empty()) {
+                inputs.erase(inputs.begin() + static_cast<std::ptrdiff_t>(at));
+            }
+            break;
+        }
+    }
+    return inputs;
+}
+
+struct FuzzTotals {
+    u64 runs {};
+    u64 hangs {};
+    u64 faults {};
+    std::size_t corpus {};
+    std::set<u32> faultAddresses;
+    CoverageMap coverage;
+};
+
+template <typename Traits>
+void fuzzWorker(const BasicMarie<Traits>& prototype, const FuzzOptions& options, u64 runs, u64 seed, FuzzTotals& totals)
+{
+    using Word = typename Traits::Word;
+
+    BasicMarie<Traits> vm = prototype;
+    Random random { .state = seed };
+    std::vector<std::vector<Word>> corpus;
+    CoverageMap run;
+
+    std::vector<Word> inputs;
+    std::size_t nextInput = 0;
+    // an exhausted stream reads 0, like the end of stdin
+    vm.setInputSource([&]() -> std::optional<Word> {
+        return nextInput < inputs.size() ? inputs[nextInput++] : Word { 0 };
+    });
+    vm.setOutputSink([](Word) {});
+    vm.setQuiet(true);
+
+    for (u64 i = 0; i < runs; i++) {
+        inputs = corpus.empty() || random.below(8) == 0 ? randomInputs<Traits>(random) : mutate<Traits>(corpus[random.below(corpus.size())], random);
+        nextInput = 0;
+
+        vm.resetToSnapshot();
+        const auto state = vm.runCovered(options.budget, run.words);
+
+        if (mergeCoverage(totals.coverage, run) != 0) {
+            // keep only what was read, the rest made no difference to this run
+            inputs.resize(std::min(nextInput, inputs.size()));
+            corpus.push_back(inputs);
+        }
+        if (state == BasicMarie<Traits>::State::Running) {
+            totals.hangs++;
+        }
+        if (vm.faulted()) {
+            totals.faults++;
+            // execInstr runs with the PC already past the instruction
+            const u32 address = static_cast<u32>(vm.pc() - 1) & Traits::AddressMask;
+            if (totals.faultAddresses.insert(address).second && options.crashDirectory != nullptr) {
+                std::string text;
+                for (std::size_t value = 0; value < nextInput && value < inputs.size(); value++) {
+                    text += fmt::format("{:x}\n", inputs[value]);
+                }
+                const auto path = std::filesystem::path(options.crashDirectory) / fmt::format("crash-{:x}.txt", address);
+                std::ofstream(path, std::ios::out | std::ios::trunc) << text;
+            }
+        }
+    }
+    totals.runs = runs;
+    totals.corpus = corpus.size();
+}
+
+} // anonymous namespace
+
+template <typename Traits>
+int fuzzImage(const char* image, const FuzzOptions& options)
+{
+    try {
+        std::unique_ptr<BasicMarie<Traits>> prototype;
+        std::vector<char> bytes = fileToVector<char>(image);
+        if (isContainerImage(bytes)) {
+            prototype = std::make_unique<BasicMarie<Traits>>(ContainerImage<typename Traits::Word>(std::move(bytes)));
+        } else {
+            std::vector<typename Traits::Word> words = marieLoadImage<Traits>(image);
+            prototype = std::make_unique<BasicMarie<Traits>>(words.data(), words.size());
+        }
+        prototype->snapshot();
+        if (options.crashDirectory != nullptr) {
+            std::filesystem::create_directories(options.crashDirectory);
+        }
+
+        const std::size_t threads = std::max<std::size_t>(options.threads, 1);
+        std::vector<FuzzTotals> totals(threads);
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> workers;
+            for (std::size_t i = 0; i < threads; i++) {
+                const u64 runs = options.runs / threads + (i < options.runs % threads ? 1 : 0);
+                workers.emplace_back([&, i, runs] { fuzzWorker<Traits>(*prototype, options, runs, options.seed + i, totals[i]); });
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        FuzzTotals all;
+        std::size_t edges = 0;
+        for (FuzzTotals& worker : totals) {
+            all.runs += worker.runs;
+            all.hangs += worker.hangs;
+            all.faults += worker.faults;
+            all.corpus += worker.corpus;
+            all.faultAddresses.insert(worker.faultAddresses.begin(), worker.faultAddresses.end());
+            edges += mergeCoverage(all.coverage, worker.coverage);
+        }
+
+        fmt::print("{} runs in {:.2f}s ({:.0f} runs/s), {} edges, {} inputs in the corpus, {} hangs, {} faults at {} addresses\n",
+            all.runs,
+            seconds,
+            seconds > 0.0 ? static_cast<double>(all.runs) / seconds : 0.0,
+            edges,
+            all.corpus,
+            all.hangs,
+            all.faults,
+            all.faultAddresses.size());
+        for (u32 address : all.faultAddresses) {
+            fmt::print("fault at {:x}\n", address);
+        }
+        return all.faults == 0 ? 0 : 1;
+    } catch (const std::runtime_error& error) {
+        LOGE("{}", error.what());
+        return 1;
+    }
+}
+
+template int fuzzImage<Marie16>(const char* image, const FuzzOptions& options);
+template int fuzzImage<Marie32>(const char* image, const FuzzOptions& options);
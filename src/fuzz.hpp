@@ -0,0 +1,28 @@
+#pragma once
+
+#include "instructions.hpp"
+
+// Edges are hashed pairs of consecutive PCs, 16K of them keep a map at 2 KiB
+// so clearing and merging it per run stays cheaper than the run.
+struct CoverageMap {
+    static constexpr std::size_t Edges = std::size_t { 1 } << 14;
+    alignas(64) std::array<u64, Edges / 64> words {};
+};
+
+// ORs run into total and clears run in the same pass, returns the number of edges new to total
+std::size_t mergeCoverage(CoverageMap& total, CoverageMap& run);
+
+struct FuzzOptions {
+    u64 runs = 1000000;
+    u64 budget = 100000; // instructions per run, a run that uses them all counts as a hang
+    u64 seed = 1;
+    std::size_t threads = 1;
+    // saves one input per faulting address as crash-[address].txt, one hex value per line for exec-bin
+    const char* crashDirectory = nullptr;
+};
+
+// Runs the image against generated Input streams. Every thread keeps one VM
+// that is reset to the loaded image between runs and its own corpus of
+// streams that reached new edges, new streams mutate those or are random.
+template <typename Traits = Marie16>
+int fuzzImage(const char* image, const FuzzOptions& options);
@@ -0,0 +1,72 @@
+#include "harts.hpp"
+
+int runHarts(const char* image, const HartOptions& options)
+{
+    try {
+        using Hart = BasicMarie<MarieHart16>;
+
+        std::vector<Word> program = marieLoadImage(image);
+        if (program.size() > MarieHart16::MaxMemory) {
+            LOGW("Warning, an image size of {} is larger than MARIE's max memory of {} Bytes\n", program.size(), MarieHart16::MaxMemory);
+            program.resize(MarieHart16::MaxMemory);
+        }
+        const std::size_t harts = std::max<std::size_t>(options.harts, 1);
+        if (harts > std::size_t { 1 } << MarieHart16::WordBits) {
+            throw std::runtime_error(fmt::format("{} harts do not fit a hart id in a word", harts));
+        }
+
+        std::mutex ioLock;
+        std::vector<std::unique_ptr<Hart>> machines;
+        for (std::size_t id = 0; id < harts; id++) {
+            auto hart = std::make_unique<Hart>(std::span(program), program.size(), static_cast<Word>(id), options.order);
+            hart->setInputSource([&ioLock]() -> std::optional<Word> {
+                std::lock_guard guard(ioLock);
+                std::string line;
+                std::getline(std::cin, line);
+                Word value {};
+                std::from_chars(line.data(), line.data() + line.size(), value, 16);
+                return value;
+            });
+            hart->setOutputSink([&ioLock](Word value) {
+                std::lock_guard guard(ioLock);
+                fmt::print("{:x}\n", value);
+            });
+            machines.push_back(std::move(hart));
+        }
+
+        // release every hart at once so contention is measured from the same start
+        std::latch start(static_cast<std::ptrdiff_t>(harts) + 1);
+        std::vector<Word> results(harts);
+        std::chrono::steady_clock::duration elapsed {};
+        {
+            std::vector<std::jthread> threads;
+            for (std::size_t id = 0; id < harts; id++) {
+                threads.emplace_back([&, id] {
+                    start.arrive_and_wait();
+                    results[id] = machines[id]->run();
+                });
+            }
+            start.arrive_and_wait();
+            const auto began = std::chrono::steady_clock::now();
+            threads.clear();
+            elapsed = std::chrono::steady_clock::now() - began;
+        }
+
+        for (std::size_t id = 0; id < harts; id++) {
+            const auto& stats = machines[id]->atomicStats();
+            fmt::print("[hart {}] AC {:x} after {} instructions, {} fetch-adds, {} compare-swaps ({} failed)\n",
+                id,
+                results[id],
+                machines[id]->retired(),
+                stats.fetchAdds,
+                stats.compareSwaps,
+                stats.compareSwapFailures);
+        }
+        fmt::print("[harts] {} harts finished in {} us\n", harts, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+        return results[0];
+    } catch (const std::runtime_error& error) {
+        LOGE("{}\n", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "marie.hpp"
+
+struct HartOptions {
+    std::size_t harts {};
+    MemoryOrder order = MemoryOrder::Relaxed;
+};
+
+// Runs one image on several harts that share its memory, each hart on its own
+// host thread starting at the entry point, HartId tells them apart. Input and
+// Output are serialized between harts. Prints each hart's result and atomic
+// counters, returns the accumulator of hart 0.
+int runHarts(const char* image, const HartOptions& options);
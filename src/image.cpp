@@ -0,0 +1,348 @@
+#include "image.hpp"
+
+#include "file.hpp"
+#include "instructions.hpp"
+#include "perf.hpp"
+
+namespace {
+
+constexpr std::array<char, 4> Magic { 'M', 'R', 'I', 'E' };
+constexpr u16 Version = 1;
+constexpr std::size_t HeaderSize = 32;
+constexpr std::size_t SectionSize = 16;
+
+// the address space of the machine that runs words of this size
+template <typename WordType>
+constexpr std::size_t maxImageWords()
+{
+    return sizeof(WordType) == sizeof(Marie32::Word) ? Marie32::MaxMemory : Marie16::MaxMemory;
+}
+
+enum SectionKind : u8 {
+    Code = 1,
+    Data = 2,
+};
+
+enum SectionEncoding : u8 {
+    Raw = 0,
+    // LZ4 style tokens: the high nibble counts literal words and the low
+    // nibble the zero words that follow them, a nibble of 15 continues in
+    // extra bytes that are added up until one is below 255
+    ZeroRuns = 1,
+};
+
+struct ByteWriter {
+    std::vector<char> bytes;
+
+    template <std::unsigned_integral T>
+    void put(T value)
+    {
+        for (std::size_t i = sizeof(T); i > 0; i--) {
+            bytes.push_back(static_cast<char>(value >> ((i - 1) * 8) & 0xFF));
+        }
+    }
+
+    void putLength(std::size_t length)
+    {
+        while (length >= 255) {
+            put<u8>(255);
+            length -= 255;
+        }
+        put(static_cast<u8>(length));
+    }
+};
+
+struct ByteReader {
+    std::span<const char> bytes;
+    std::size_t pos {};
+
+    template <std::unsigned_integral T>
+    T get()
+    {
+        if (bytes.size() - pos < sizeof(T)) {
+            throw std::runtime_error("image is truncated");
+        }
+        T value {};
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            value = static_cast<T>((value << 8) | static_cast<u8>(bytes[pos++]));
+        }
+        return value;
+    }
+
+    std::size_t getLength()
+    {
+        std::size_t length {};
+        u8 part {};
+        do {
+            part = get<u8>();
+            length += part;
+        } while (part == 255);
+        return length;
+    }
+};
+
+template <typename WordType>
+std::vector<char> encodeZeroRuns(std::span<const WordType> words)
+{
+    ByteWriter out;
+    std::size_t i = 0;
+    while (i < words.size()) {
+        const std::size_t literalStart = i;
+        // single zeros are cheaper as literals than as a run
+        while (i < words.size() && !(words[i] == 0 && i + 1 < words.size() && words[i + 1] == 0)) {
+            i++;
+        }
+        const std::size_t literals = i - literalStart;
+
+        const std::size_t zeroStart = i;
+        while (i < words.size() && words[i] == 0) {
+            i++;
+        }
+        const std::size_t zeros = i - zeroStart;
+
+        out.put(static_cast<u8>(std::min<std::size_t>(literals, 15) << 4 | std::min<std::size_t>(zeros, 15)));
+        if (literals >= 15) {
+            out.putLength(literals - 15);
+        }
+        for (std::size_t j = literalStart; j < literalStart + literals; j++) {
+            out.put(words[j]);
+        }
+        if (zeros >= 15) {
+            out.putLength(zeros - 15);
+        }
+    }
+    return std::move(out.bytes);
+}
+
+template <typename WordType>
+void decodeZeroRuns(ByteReader in, std::span<WordType> out)
+{
+    std::size_t i = 0;
+    while (i < out.size()) {
+        const u8 token = in.get<u8>();
+
+        std::size_t literals = token >> 4;
+        if (literals == 15) {
+            literals += in.getLength();
+        }
+        if (literals > out.size() - i) {
+            throw std::runtime_error("image section overflows its size");
+        }
+        for (std::size_t j = 0; j < literals; j++) {
+            out[i++] = in.get<WordType>();
+        }
+
+        std::size_t zeros = token & 0xF;
+        if (zeros == 15) {
+            zeros += in.getLength();
+        }
+        if (zeros > out.size() - i) {
+            throw std::runtime_error("image section overflows its size");
+        }
+        std::fill_n(out.begin() + static_cast<std::ptrdiff_t>(i), zeros, WordType { 0 });
+        i += zeros;
+    }
+}
+
+} // anonymous namespace
+
+template <typename WordType>
+u32 imageChecksum(std::span<const WordType> words)
+{
+    // FNV-1a over the big endian bytes
+    u32 hash = 2166136261U;
+    for (WordType word : words) {
+        for (std::size_t i = sizeof(WordType); i > 0; i--) {
+            hash ^= static_cast<u8>(word >> ((i - 1) * 8) & 0xFF);
+            hash *= 16777619U;
+        }
+    }
+    return hash;
+}
+
+bool isContainerImage(std::span<const char> bytes)
+{
+    return bytes.size() >= Magic.size() && std::equal(Magic.begin(), Magic.end(), bytes.begin());
+}
+
+template <typename WordType>
+void writeContainerImage(const char* file, std::span<const WordType> words, const std::vector<bool>& isCode, const std::vector<ImageSymbol>& symbols)
+{
+    struct Pending {
+        u8 kind;
+        u8 encoding;
+        u32 address;
+        u32 words;
+        std::vector<char> payload;
+    };
+    std::vector<Pending> sections;
+    // ends before the file is written, which is a phase of its own
+    std::optional<Perf::Phase> phase;
+    phase.emplace("image::encode");
+    phase->setBytes(words.size() * sizeof(WordType));
+
+    std::size_t start = 0;
+    while (start < words.size()) {
+        const bool code = start < isCode.size() && isCode[start];
+        std::size_t end = start + 1;
+        while (end < words.size() && (end < isCode.size() && isCode[end]) == code) {
+            end++;
+        }
+
+        auto run = words.subspan(start, end - start);
+        // zero filled data is implied by the image size
+        if (code || std::any_of(run.begin(), run.end(), [](WordType word) { return word != 0; })) {
+            Pending section {
+                .kind = code ? Code : Data,
+                .encoding = ZeroRuns,
+                .address = static_cast<u32>(start),
+                .words = static_cast<u32>(run.size()),
+                .payload = encodeZeroRuns(run),
+            };
+            if (section.payload.size() >= run.size() * sizeof(WordType)) {
+                ByteWriter raw;
+                for (WordType word : run) {
+                    raw.put(word);
+                }
+                section.encoding = Raw;
+                section.payload = std::move(raw.bytes);
+            }
+            sections.push_back(std::move(section));
+        }
+        start = end;
+    }
+
+    ByteWriter out;
+    out.bytes.insert(out.bytes.end(), Magic.begin(), Magic.end());
+    out.put(Version);
+    out.put(static_cast<u16>(sizeof(WordType) * 8));
+    out.put(static_cast<u32>(words.size()));
+    out.put(u32 { 0 });
+    out.put(static_cast<u32>(sections.size()));
+    out.put(static_cast<u32>(symbols.size()));
+    out.put(imageChecksum(words));
+    out.put(u32 { 0 });
+
+    for (auto& section : sections) {
+        out.put(section.kind);
+        out.put(section.encoding);
+        out.put(u16 { 0 });
+        out.put(section.address);
+        out.put(section.words);
+        out.put(static_cast<u32>(section.payload.size()));
+    }
+    for (auto& symbol : symbols) {
+        out.put(symbol.address);
+        out.put(static_cast<u16>(symbol.name.size()));
+        out.bytes.insert(out.bytes.end(), symbol.name.begin(), symbol.name.end());
+    }
+    for (auto& section : sections) {
+        out.bytes.insert(out.bytes.end(), section.payload.begin(), section.payload.end());
+    }
+
+    LOGD("writing a {} word image as {} sections in {} bytes", words.size(), sections.size(), out.bytes.size());
+    phase.reset();
+    dataToFile(file, std::span(out.bytes));
+}
+
+template <typename WordType>
+ContainerImage<WordType>::ContainerImage(std::vector<char> bytes)
+    : mBytes(std::move(bytes))
+{
+    if (!isContainerImage(mBytes)) {
+        throw std::runtime_error("not a MARIE container image");
+    }
+
+    ByteReader in { .bytes = mBytes, .pos = Magic.size() };
+    const u16 version = in.get<u16>();
+    if (version != Version) {
+        throw std::runtime_error(fmt::format("unsupported image version {}", version));
+    }
+    const u16 wordBits = in.get<u16>();
+    if (wordBits != sizeof(WordType) * 8) {
+        throw std::runtime_error(fmt::format("image has {} bit words, expected {}", wordBits, sizeof(WordType) * 8));
+    }
+    mImageWords = in.get<u32>();
+    // every reader allocates this many words, check it before any of them does
+    if (mImageWords > maxImageWords<WordType>()) {
+        throw std::runtime_error(fmt::format("an image size of {} is larger than MARIE's max memory of {} words", mImageWords, maxImageWords<WordType>()));
+    }
+    mEntryPoint = in.get<u32>();
+    const u32 sectionCount = in.get<u32>();
+    const u32 symbolCount = in.get<u32>();
+    mChecksum = in.get<u32>();
+    (void)in.get<u32>();
+
+    if (sectionCount > (mBytes.size() - HeaderSize) / SectionSize) {
+        throw std::runtime_error("image section table is truncated");
+    }
+    for (u32 i = 0; i < sectionCount; i++) {
+        Section section;
+        section.kind = in.get<u8>();
+        section.encoding = in.get<u8>();
+        (void)in.get<u16>();
+        section.address = in.get<u32>();
+        section.words = in.get<u32>();
+        section.storedBytes = in.get<u32>();
+        if (section.address > mImageWords || section.words > mImageWords - section.address) {
+            throw std::runtime_error(fmt::format("image section {} lies outside of the image", i));
+        }
+        if (section.encoding != Raw && section.encoding != ZeroRuns) {
+            throw std::runtime_error(fmt::format("image section {} has an unknown encoding", i));
+        }
+        mSections.push_back(section);
+    }
+
+    for (u32 i = 0; i < symbolCount; i++) {
+        ImageSymbol symbol;
+        symbol.address = in.get<u32>();
+        const u16 length = in.get<u16>();
+        if (mBytes.size() - in.pos < length) {
+            throw std::runtime_error("image symbol table is truncated");
+        }
+        symbol.name.assign(mBytes.data() + in.pos, length);
+        in.pos += length;
+        mSymbols.push_back(std::move(symbol));
+    }
+
+    for (auto& section : mSections) {
+        section.payload = in.pos;
+        if (mBytes.size() - in.pos < section.storedBytes) {
+            throw std::runtime_error("image section payload is truncated");
+        }
+        in.pos += section.storedBytes;
+    }
+}
+
+template <typename WordType>
+void ContainerImage<WordType>::decompressInto(std::span<WordType> memory) const
+{
+    if (memory.size() < mImageWords) {
+        throw std::runtime_error("memory is smaller than the image");
+    }
+
+    Perf::Phase phase("image::decode");
+    phase.setBytes(mBytes.size());
+    for (const auto& section : mSections) {
+        ByteReader in { .bytes = std::span(mBytes).subspan(section.payload, section.storedBytes), .pos = 0 };
+        auto out = memory.subspan(section.address, section.words);
+        if (section.encoding == ZeroRuns) {
+            decodeZeroRuns(in, out);
+        } else {
+            for (WordType& word : out) {
+                word = in.get<WordType>();
+            }
+        }
+    }
+
+    if (imageChecksum<WordType>(memory.first(mImageWords)) != mChecksum) {
+        throw std::runtime_error("image checksum mismatch");
+    }
+}
+
+template u32 imageChecksum<Marie16::Word>(std::span<const Marie16::Word>);
+template u32 imageChecksum<Marie32::Word>(std::span<const Marie32::Word>);
+template void writeContainerImage<Marie16::Word>(const char*, std::span<const Marie16::Word>, const std::vector<bool>&, const std::vector<ImageSymbol>&);
+template void writeContainerImage<Marie32::Word>(const char*, std::span<const Marie32::Word>, const std::vector<bool>&, const std::vector<ImageSymbol>&);
+template struct ContainerImage<Marie16::Word>;
+template struct ContainerImage<Marie32::Word>;
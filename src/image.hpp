@@ -0,0 +1,58 @@
+#pragma once
+
+// Container layout, every field big endian:
+//   header     magic "MRIE", u16 version, u16 word bits, u32 image words,
+//              u32 entry point, u32 section count, u32 symbol count,
+//              u32 FNV-1a checksum of the image words, u32 reserved
+//   sections   u8 kind (code/data), u8 encoding (raw/zero runs), u16 reserved,
+//              u32 address, u32 words, u32 stored bytes
+//   symbols    u32 address, u16 name length, name
+//   payloads   one per section, in section order
+// Words not covered by a section are zero.
+
+struct ImageSymbol {
+    std::string name;
+    u32 address {};
+};
+
+[[nodiscard]] bool isContainerImage(std::span<const char> bytes);
+
+// FNV-1a over the big endian bytes of the words, the checksum a container
+// stores and source maps are matched against
+template <typename WordType>
+[[nodiscard]] u32 imageChecksum(std::span<const WordType> words);
+
+// isCode marks instruction words, each run of code or data becomes a section
+template <typename WordType>
+void writeContainerImage(const char* file, std::span<const WordType> words, const std::vector<bool>& isCode, const std::vector<ImageSymbol>& symbols);
+
+// Parses and bounds checks a container, including an image size that has to
+// fit the address space of its word size. decompressInto then writes the
+// image straight into VM memory and verifies the checksum.
+template <typename WordType>
+struct ContainerImage {
+    explicit ContainerImage(std::vector<char> bytes);
+
+    [[nodiscard]] u32 imageWords() const { return mImageWords; }
+    [[nodiscard]] u32 entryPoint() const { return mEntryPoint; }
+    [[nodiscard]] const std::vector<ImageSymbol>& symbols() const { return mSymbols; }
+
+    void decompressInto(std::span<WordType> memory) const;
+
+private:
+    struct Section {
+        u8 kind {};
+        u8 encoding {};
+        u32 address {};
+        u32 words {};
+        std::size_t payload {};
+        u32 storedBytes {};
+    };
+
+    std::vector<char> mBytes;
+    u32 mImageWords {};
+    u32 mEntryPoint {};
+    u32 mChecksum {};
+    std::vector<Section> mSections;
+    std::vector<ImageSymbol> mSymbols;
+};
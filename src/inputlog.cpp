@@ -0,0 +1,107 @@
+#include "inputlog.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::array<char, 4> Magic { 'M', 'R', 'I', 'N' };
+constexpr u16 Version = 1;
+
+struct Header {
+    std::array<char, 4> magic;
+    u16 version;
+    u16 wordBits;
+};
+
+constexpr std::size_t RecordBytes = sizeof(u64) + sizeof(u32);
+
+} // anonymous namespace
+
+InputRecorder::InputRecorder(const char* path, unsigned wordBits)
+    : mFile(path, std::ios::out | std::ios::binary | std::ios::trunc)
+    , mPath(path)
+{
+    if (!mFile) {
+        throw std::runtime_error(fmt::format("cannot create input log {}", path));
+    }
+    const Header header { .magic = Magic, .version = Version, .wordBits = static_cast<u16>(wordBits) };
+    mFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+void InputRecorder::record(u64 retired, u32 value)
+{
+    std::array<char, RecordBytes> bytes {};
+    std::memcpy(bytes.data(), &retired, sizeof(retired));
+    std::memcpy(bytes.data() + sizeof(retired), &value, sizeof(value));
+    mFile.write(bytes.data(), bytes.size());
+    // keep the log complete up to the last Input if the run never halts
+    mFile.flush();
+    if (!mFile) {
+        LOGW("could not write to input log {}", mPath);
+    }
+}
+
+InputReplay::InputReplay(const char* path, unsigned wordBits)
+{
+    mFd = open(path, O_RDONLY);
+    if (mFd == -1) {
+        throw std::runtime_error(fmt::format("cannot open input log {}: {}", path, std::strerror(errno)));
+    }
+
+    struct stat info {};
+    if (fstat(mFd, &info) == -1 || static_cast<std::size_t>(info.st_size) < sizeof(Header)) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("input log {} is truncated", path));
+    }
+    mSize = static_cast<std::size_t>(info.st_size);
+
+    void* data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (data == MAP_FAILED) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("cannot map input log {}: {}", path, std::strerror(errno)));
+    }
+    mData = static_cast<const std::byte*>(data);
+
+    Header header {};
+    std::memcpy(&header, mData, sizeof(header));
+    if (header.magic != Magic || header.version != Version || header.wordBits != wordBits) {
+        munmap(const_cast<std::byte*>(mData), mSize);
+        close(mFd);
+        throw std::runtime_error(fmt::format("{} is not an input log for {} bit words", path, wordBits));
+    }
+    mRecords = (mSize - sizeof(Header)) / RecordBytes;
+    LOGD("replaying {} inputs from {}", mRecords, path);
+}
+
+InputReplay::~InputReplay()
+{
+    munmap(const_cast<std::byte*>(mData), mSize);
+    close(mFd);
+}
+
+u32 InputReplay::next(u64 retired)
+{
+    if (mNext == mRecords) {
+        if (!mDiverged) {
+            LOGW("the input log is exhausted after {} values, Input reads 0 from here on", mRecords);
+            mDiverged = true;
+        }
+        return 0;
+    }
+
+    const std::byte* record = mData + sizeof(Header) + mNext * RecordBytes;
+    mNext++;
+    u64 recorded {};
+    u32 value {};
+    std::memcpy(&recorded, record, sizeof(recorded));
+    std::memcpy(&value, record + sizeof(recorded), sizeof(value));
+
+    if (recorded != retired && !mDiverged) {
+        LOGW("input {} was recorded after {} instructions but is read after {}, the run no longer follows the log", mNext, recorded, retired);
+        mDiverged = true;
+    }
+    return value;
+}
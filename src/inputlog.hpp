@@ -0,0 +1,40 @@
+#pragma once
+
+// Log of every value Input consumed during a run, in host byte order:
+//   header     magic "MRIN", u16 version, u16 word bits
+//   records    u64 instructions retired before the Input, u32 value, 12 bytes each
+// A replay feeds the values back in order, the instruction counts show where
+// it stops following the recorded run.
+
+struct InputRecorder {
+    InputRecorder(const char* path, unsigned wordBits);
+
+    void record(u64 retired, u32 value);
+
+private:
+    std::ofstream mFile;
+    std::string mPath;
+};
+
+// maps the log read only, values are read straight from the mapping
+struct InputReplay {
+    InputReplay(const char* path, unsigned wordBits);
+    ~InputReplay();
+
+    InputReplay(const InputReplay&) = delete;
+    InputReplay& operator=(const InputReplay&) = delete;
+
+    // The next value, or 0 like the end of stdin once the log is exhausted.
+    // Warns once when retired differs from the recorded count.
+    u32 next(u64 retired);
+
+    [[nodiscard]] std::size_t remaining() const { return mRecords - mNext; }
+
+private:
+    int mFd = -1;
+    const std::byte* mData = nullptr;
+    std::size_t mSize {};
+    std::size_t mRecords {};
+    std::size_t mNext {};
+    bool mDiverged = false;
+};
@@ -19,6 +19,11 @@ enum struct Instruction : u32 {
     StoreI,
     LoadI,
     Unknown,
+
+    // atomic extensions, all encoded with opcode 0xF
+    HartId,
+    FAdd,
+    Cas,
 };
 
 inline const char* InstructionToString(Instruction instr)
@@ -56,7 +61,83 @@ inline const char* InstructionToString(Instruction instr)
         return "LoadI";
     case Instruction::Unknown:
         return "Unknown";
+    case Instruction::HartId:
+        return "HartId";
+    case Instruction::FAdd:
+        return "FAdd";
+    case Instruction::Cas:
+        return "Cas";
     default:
         return "Invalid instruction";
     }
 }
+
+[[nodiscard]] constexpr bool isExtension(Instruction instr)
+{
+    return instr == Instruction::HartId || instr == Instruction::FAdd || instr == Instruction::Cas;
+}
+
+// Word layout of a MARIE machine. The opcode sits in the 4 bits above the
+// address operand, Skipcond keeps reading its condition from operand bits 10
+// and 11 at every width so programs keep their 0x000/0x400/0x800 conditions.
+// Opcode 0xF holds the atomic extensions, the top two operand bits pick
+// HartId, FAdd or Cas which leaves them an address two bits shorter.
+// SharedMemory builds the harts of a multi-hart machine, see BasicMarie.
+template <std::unsigned_integral WordType, unsigned AddressBitCount, bool SharedMemory = false>
+struct MarieTraits {
+    using Word = WordType;
+    using SignedWord = std::make_signed_t<WordType>;
+
+    static constexpr unsigned WordBits = sizeof(Word) * 8;
+    static constexpr unsigned AddressBits = AddressBitCount;
+    static constexpr std::size_t MaxMemory = std::size_t { 1 } << AddressBits;
+    static constexpr Word AddressMask = static_cast<Word>(MaxMemory - 1);
+    static constexpr unsigned ExtAddressBits = AddressBits - 2;
+    static constexpr Word ExtAddressMask = static_cast<Word>((std::size_t { 1 } << ExtAddressBits) - 1);
+    static constexpr bool Shared = SharedMemory;
+    // address spaces up to 4096 words live inline in the VM, larger ones are
+    // sized to the image, and harts keep no memory of their own
+    static constexpr bool InlineMemory = !Shared && MaxMemory <= 4096;
+
+    static_assert(AddressBits >= 12 && AddressBits + 4 <= WordBits, "the opcode and Skipcond conditions must fit");
+
+    static constexpr unsigned operandBits(Instruction instr)
+    {
+        return isExtension(instr) ? ExtAddressBits : AddressBits;
+    }
+
+    static constexpr std::pair<Instruction, Word> decode(Word instr)
+    {
+        std::pair<Instruction, Word> val;
+        val.first = static_cast<Instruction>(instr >> AddressBits & 0xF);
+        val.second = static_cast<Word>(instr & AddressMask);
+        if (val.first == Instruction::Unknown) [[unlikely]] {
+            const unsigned extension = val.second >> ExtAddressBits;
+            if (extension < 3) {
+                val.first = static_cast<Instruction>(static_cast<unsigned>(Instruction::HartId) + extension);
+                val.second = static_cast<Word>(val.second & ExtAddressMask);
+            }
+        }
+        return val;
+    }
+
+    static constexpr Word encode(Instruction instr, Word operand)
+    {
+        if (isExtension(instr)) {
+            const unsigned extension = static_cast<unsigned>(instr) - static_cast<unsigned>(Instruction::HartId);
+            return static_cast<Word>(static_cast<Word>(Word { 0xF } << AddressBits)
+                | static_cast<Word>(extension << ExtAddressBits)
+                | (operand & ExtAddressMask));
+        }
+        return static_cast<Word>(static_cast<Word>(static_cast<Word>(instr) << AddressBits) | (operand & AddressMask));
+    }
+};
+
+using Marie16 = MarieTraits<u16, 12>;
+using Marie32 = MarieTraits<u32, 24>;
+using MarieHart16 = MarieTraits<u16, 12, true>;
+
+inline std::pair<Instruction, Word> decodeInstruction(Word instr)
+{
+    return Marie16::decode(instr);
+}
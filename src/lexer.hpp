@@ -0,0 +1,430 @@
+#pragma once
+
+#include "instructions.hpp"
+#include "static_hashtable.hpp"
+
+// Tokens, keywords and the lexer are constexpr so the same code serves the
+// runtime assembler and the compile time one in static_assemble.hpp.
+
+enum struct Token {
+    Label,
+    DecNumber,
+    HexNumber,
+
+    Jns,
+    Load,
+    Store,
+    Add,
+    Subt,
+    Input,
+    Output,
+    Halt,
+    Skipcond,
+    Jump,
+    Clear,
+    AddI,
+    JumpI,
+    LoadI,
+    StoreI,
+    HartId,
+    FAdd,
+    Cas,
+
+    Comma,
+    Unknown,
+
+    Eof,
+};
+
+constexpr const char* tokenToString(Token tok)
+{
+    switch (tok) {
+    case Token::Label:
+        return "Token::Label";
+    case Token::DecNumber:
+        return "Token::DecNumber";
+    case Token::HexNumber:
+        return "Token::HexNumber";
+    case Token::Jns:
+        return "Token::Jns";
+    case Token::Load:
+        return "Token::Load";
+    case Token::Store:
+        return "Token::Store";
+    case Token::Add:
+        return "Token::Add";
+    case Token::Subt:
+        return "Token::Subt";
+    case Token::Input:
+        return "Token::Input";
+    case Token::Output:
+        return "Token::Output";
+    case Token::Halt:
+        return "Token::Halt";
+    case Token::Skipcond:
+        return "Token::Skipcond";
+    case Token::Jump:
+        return "Token::Jump";
+    case Token::Clear:
+        return "Token::Clear";
+    case Token::AddI:
+        return "Token::AddI";
+    case Token::JumpI:
+        return "Token::JumpI";
+    case Token::LoadI:
+        return "Token::LoadI";
+    case Token::StoreI:
+        return "Token::StoreI";
+    case Token::HartId:
+        return "Token::HartId";
+    case Token::FAdd:
+        return "Token::FAdd";
+    case Token::Cas:
+        return "Token::Cas";
+    case Token::Comma:
+        return "Token::Comma";
+    case Token::Unknown:
+        return "Token::Unknown";
+    case Token::Eof:
+        return "Token::Eof";
+    default:
+        return "Unknown Token";
+    }
+}
+
+constexpr bool tokenIsInstruction(Token tok)
+{
+    return (static_cast<int>(tok) >= static_cast<int>(Token::Jns) && static_cast<int>(tok) <= static_cast<int>(Token::Cas));
+}
+
+// Instruction::Unknown for tokens that are not instructions
+constexpr Instruction tokenToInstruction(Token tok)
+{
+    if (!tokenIsInstruction(tok)) {
+        return Instruction::Unknown;
+    }
+
+    // the extensions follow Instruction::Unknown, which has no token
+    if (static_cast<int>(tok) >= static_cast<int>(Token::HartId)) {
+        constexpr int extensionOffset = static_cast<int>(Token::HartId) - static_cast<int>(Instruction::HartId);
+        return static_cast<Instruction>(static_cast<int>(tok) - extensionOffset);
+    }
+
+    constexpr int offset = static_cast<int>(Token::Jns) - static_cast<int>(Instruction::Jns);
+
+    return static_cast<Instruction>(static_cast<int>(tok) - offset);
+}
+
+constexpr bool tokenHasZeroOperands(Token tok)
+{
+    return (static_cast<int>(tok) >= static_cast<int>(Token::Input) && static_cast<int>(tok) <= static_cast<int>(Token::Halt)) || tok == Token::Clear || tok == Token::HartId;
+}
+
+// Parses the digits of a DecNumber or HexNumber token. Like std::from_chars a
+// value that does not fit the word is read as 0.
+template <std::unsigned_integral WordType>
+constexpr WordType parseNumber(std::string_view digits, unsigned base)
+{
+    WordType value {};
+    for (char c : digits) {
+        const auto digit = static_cast<unsigned>(c - '0');
+        if (value > (std::numeric_limits<WordType>::max() - digit) / base) {
+            return 0;
+        }
+        value = static_cast<WordType>(value * base + digit);
+    }
+    return value;
+}
+
+constexpr std::size_t string_view_hash(std::string_view str)
+{
+    std::size_t hash = 0;
+    for (auto c : str) {
+        hash = static_cast<std::size_t>(c) + (hash << 6) + (hash << 16) - hash;
+    }
+    return hash;
+}
+
+inline constexpr static_hashtable<std::string_view, Token, 30, string_view_hash> keywords({
+    { "jns", Token::Jns },
+    { "load", Token::Load },
+    { "store", Token::Store },
+    { "add", Token::Add },
+    { "subt", Token::Subt },
+    { "input", Token::Input },
+    { "output", Token::Output },
+    { "halt", Token::Halt },
+    { "skipcond", Token::Skipcond },
+    { "jump", Token::Jump },
+    { "clear", Token::Clear },
+    { "addi", Token::AddI },
+    { "jumpi", Token::JumpI },
+    { "loadi", Token::LoadI },
+    { "storei", Token::StoreI },
+    { "hartid", Token::HartId },
+    { "fadd", Token::FAdd },
+    { "cas", Token::Cas },
+});
+
+// The lexer reports errors as values, nextToken keeps going after an error and
+// the caller collects it with takeError.
+struct LexError {
+    enum struct Kind {
+        MissingHexDigits, // 0x not followed by a digit
+        UnexpectedCharacter,
+    };
+
+    Kind kind {};
+    std::size_t textLocation {};
+    char character {};
+};
+
+struct Lexer {
+    // firstLine numbers the lines of a text that is a piece of a larger one
+    constexpr explicit Lexer(const std::string_view text, std::size_t firstLine = 1);
+
+    constexpr std::pair<Token, std::size_t> nextToken();
+    // the error of the last nextToken, if it had one
+    constexpr std::optional<LexError> takeError();
+
+    [[nodiscard]] constexpr std::string_view getPrevString() const { return mPrevString; }
+    // line number and text of the line holding textLocation
+    [[nodiscard]] constexpr std::pair<std::size_t, std::string_view> getLine(std::size_t textLocation) const;
+    // line number and column, counting from 1, of textLocation
+    [[nodiscard]] constexpr std::pair<std::size_t, std::size_t> getPosition(std::size_t textLocation) const;
+    [[nodiscard]] constexpr std::size_t textSize() const { return mText.size(); }
+    [[nodiscard]] constexpr std::string_view text() const { return mText; }
+
+private:
+    std::string_view mText;
+    std::size_t mTextLocation {};
+    std::optional<LexError> mError;
+
+    // where the last lookup ended up, tokens and errors come in text order so the next one starts close by
+    struct LineCache {
+        std::size_t location {};
+        std::size_t line {};
+        std::size_t lineStart {};
+    };
+    // constant evaluation cannot use a mutable member, it counts from mFirstLine every time
+    mutable LineCache mLineCache;
+    std::size_t mFirstLine {};
+
+    constexpr LineCache seekLine(std::size_t textLocation) const;
+
+    std::string_view mPrevString;
+    static constexpr std::size_t PrevStringLowerBufferSize = 15;
+    std::array<char, PrevStringLowerBufferSize> mPrevStringLower {};
+
+    constexpr char nextChar();
+    constexpr char peekChar() const;
+    constexpr void consumeChar();
+
+    static constexpr bool isNum(const char c);
+    static constexpr bool isAlpha(const char c);
+    static constexpr bool isAlphaNum(const char c);
+    static constexpr bool isWhiteSpace(const char c);
+    static constexpr char toLower(const char c);
+};
+
+constexpr Lexer::Lexer(std::string_view text, std::size_t firstLine)
+    : mText(text)
+    , mLineCache { .location = 0, .line = firstLine, .lineStart = 0 }
+    , mFirstLine(firstLine)
+{
+}
+
+constexpr std::pair<Token, std::size_t> Lexer::nextToken()
+{
+    char c = nextChar();
+    while (true) {
+        while (isWhiteSpace(c)) {
+            c = nextChar();
+        }
+        if (c != ';') {
+            break;
+        }
+        // skip the comment, then whitespace again
+        while (c != '\n' && c != '\0') {
+            c = nextChar();
+        }
+    }
+
+    if (c == '\0') {
+        return { Token::Eof, mTextLocation };
+    }
+
+    std::size_t startLocation = mTextLocation - 1;
+    if (isAlpha(c)) {
+        c = peekChar();
+        while (isAlphaNum(c)) {
+            consumeChar();
+            c = peekChar();
+        }
+
+        mPrevString = std::string_view(mText.data() + startLocation, mTextLocation - startLocation);
+
+        std::size_t lowerLen = std::min(mPrevString.length(), PrevStringLowerBufferSize);
+        for (std::size_t i = 0; i < lowerLen; i++) {
+            mPrevStringLower[i] = toLower(mPrevString[i]);
+        }
+
+        auto result = keywords.get(std::string_view { mPrevStringLower.data(), lowerLen });
+        // result will be 0 (aka Token::Label) if not found
+        return { result, startLocation };
+    }
+
+    if (isNum(c)) {
+        bool isHex = false;
+        if (c == '0') {
+            const char newC = peekChar();
+            if (toLower(newC) == 'x') {
+                consumeChar();
+                c = nextChar();
+                isHex = true;
+            }
+        }
+        startLocation = mTextLocation - 1;
+
+        if (!isNum(c)) {
+            // this has to be hex, correct me if I'm wrong
+            mError = LexError { .kind = LexError::Kind::MissingHexDigits, .textLocation = mTextLocation - 1, .character = c };
+            mPrevString = "0";
+            return { Token::HexNumber, startLocation };
+        }
+
+        c = peekChar();
+        while (isNum(c)) {
+            consumeChar();
+            c = peekChar();
+        }
+
+        mPrevString = std::string_view { mText.data() + startLocation, mTextLocation - startLocation };
+
+        if (isHex) {
+            return { Token::HexNumber, startLocation };
+        } else {
+            return { Token::DecNumber, startLocation };
+        }
+    }
+
+    if (c == ',') {
+        return { Token::Comma, startLocation };
+    }
+    if (c == ':') {
+        return { Token::Comma, startLocation };
+    }
+
+    mError = LexError { .kind = LexError::Kind::UnexpectedCharacter, .textLocation = mTextLocation, .character = c };
+    return { Token::Unknown, startLocation };
+}
+
+constexpr std::optional<LexError> Lexer::takeError()
+{
+    return std::exchange(mError, std::nullopt);
+}
+
+constexpr auto Lexer::seekLine(std::size_t textLocation) const -> LineCache
+{
+    textLocation = std::min(textLocation, mText.size());
+    if (std::is_constant_evaluated()) {
+        LineCache counted { .location = textLocation, .line = mFirstLine, .lineStart = 0 };
+        for (std::size_t i = 0; i < textLocation; i++) {
+            if (mText[i] == '\n') {
+                counted.lineStart = i + 1;
+                counted.line++;
+            }
+        }
+        return counted;
+    }
+
+    // counting lines from the last lookup beats tracking every newline while lexing
+    LineCache& cache = mLineCache;
+    if (textLocation >= cache.location) {
+        for (std::size_t i = cache.location; i < textLocation; i++) {
+            if (mText[i] == '\n') {
+                cache.lineStart = i + 1;
+                cache.line++;
+            }
+        }
+    } else {
+        for (std::size_t i = textLocation; i < cache.location; i++) {
+            if (mText[i] == '\n') {
+                cache.line--;
+            }
+        }
+        const std::size_t newline = textLocation == 0 ? std::string_view::npos : mText.rfind('\n', textLocation - 1);
+        cache.lineStart = newline == std::string_view::npos ? 0 : newline + 1;
+    }
+    cache.location = textLocation;
+    return cache;
+}
+
+constexpr std::pair<std::size_t, std::string_view> Lexer::getLine(std::size_t textLocation) const
+{
+    textLocation = std::min(textLocation, mText.size());
+    const LineCache position = seekLine(textLocation);
+    const std::size_t start = position.lineStart;
+    const std::size_t lineNum = position.line;
+
+    while (textLocation < mText.size() && mText[textLocation] != '\n' && mText[textLocation] != '\0') {
+        textLocation++;
+    }
+
+    return {
+        lineNum,
+        mText.substr(start, textLocation - start)
+    };
+}
+
+constexpr std::pair<std::size_t, std::size_t> Lexer::getPosition(std::size_t textLocation) const
+{
+    const LineCache cache = seekLine(textLocation);
+    return { cache.line, cache.location - cache.lineStart + 1 };
+}
+
+constexpr char Lexer::nextChar()
+{
+    if (mTextLocation >= mText.size()) {
+        return '\0';
+    }
+    return mText[mTextLocation++];
+}
+
+constexpr char Lexer::peekChar() const
+{
+    if (mTextLocation >= mText.size()) {
+        return '\0';
+    }
+    return mText[mTextLocation];
+}
+
+constexpr void Lexer::consumeChar()
+{
+    (void)nextChar();
+}
+
+constexpr bool Lexer::isNum(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool Lexer::isAlpha(const char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+constexpr bool Lexer::isAlphaNum(const char c)
+{
+    return isNum(c) || isAlpha(c);
+}
+
+constexpr bool Lexer::isWhiteSpace(const char c)
+{
+    return c == '\n' || c == '\r' || c == '\t' || c == ' ';
+}
+
+constexpr char Lexer::toLower(const char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
@@ -1,13 +1,30 @@
 #include "assemble.hpp"
+#include "compile.hpp"
+#include "debugger.hpp"
 #include "disassemble.hpp"
+#include "fuzz.hpp"
+#include "harts.hpp"
 #include "marie.hpp"
+#include "memo.hpp"
+#include "metrics.hpp"
+#include "perf.hpp"
+#include "pipeline.hpp"
+#include "scheduler.hpp"
 
 enum Operation {
     None,
     Execfile,
     Execbin,
     Assemble,
+    AssembleAll,
+    Watch,
     Disassemble,
+    Compile,
+    Schedule,
+    Pipeline,
+    Harts,
+    Debug,
+    Fuzz,
 };
 
 struct ArgParser {
@@ -16,11 +33,35 @@ struct ArgParser {
 
     bool invalid = false;
     char* input = nullptr;
+    std::vector<const char*> inputs;
     char* output = nullptr;
     Operation operation = None;
+    AssembleOptions assembly;
+    char* memoDirectory = nullptr;
+    ExecOptions exec;
+    bool perfCounters = false;
+    std::optional<Perf::StatsFormat> stats;
+    bool metrics = false;
+    Metrics::ExportOptions metricsExport;
+    FuzzOptions fuzz;
+    unsigned wordSize = 16;
+    ScheduleOptions schedule {
+        .threads = std::thread::hardware_concurrency(),
+        .quantum = 10000,
+        .limits = {},
+    };
+    std::size_t pipeCapacity = 1024;
+    bool pipePool = false;
+    bool pipePin = true;
+    HartOptions harts {
+        .harts = 2,
+        .order = MemoryOrder::Relaxed,
+    };
 
 private:
     std::span<char*> args;
+
+    bool numberAfter(std::size_t& i, u64& value);
 };
 
 ArgParser::ArgParser(const std::span<char*> args)
@@ -35,32 +76,246 @@ ArgParser::ArgParser(const std::span<char*> args)
                 fmt::print("no output file given after \"-o\"\n");
                 invalid = true;
             }
+        } else if (strcmp(args[i], "-O") == 0) {
+            assembly.optimize = true;
+        } else if (strcmp(args[i], "--memoize") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                memoDirectory = args[i];
+            } else {
+                fmt::print("no directory given after \"--memoize\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--block-device") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                exec.blockDevice = args[i];
+            } else {
+                fmt::print("no file given after \"--block-device\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--record-input") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                exec.recordInput = args[i];
+            } else {
+                fmt::print("no file given after \"--record-input\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--replay-input") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                exec.replayInput = args[i];
+            } else {
+                fmt::print("no file given after \"--replay-input\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--profile") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                exec.profile.report = args[i];
+            } else {
+                fmt::print("no file given after \"--profile\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--profile-hz") == 0) {
+            u64 frequency {};
+            if (numberAfter(i, frequency)) {
+                if (frequency >= 1 && frequency <= 100000) {
+                    exec.profile.frequency = static_cast<unsigned>(frequency);
+                } else {
+                    fmt::print("the profiling frequency must be from 1 to 100000 Hz, got {}\n", frequency);
+                    invalid = true;
+                }
+            }
+        } else if (strcmp(args[i], "--cycles") == 0) {
+            exec.cycleAccurate = true;
+        } else if (strcmp(args[i], "--raw") == 0) {
+            assembly.rawImage = true;
+        } else if (strcmp(args[i], "--source-map") == 0) {
+            assembly.sourceMap = true;
+        } else if (strcmp(args[i], "--perf-counters") == 0) {
+            perfCounters = true;
+        } else if (strcmp(args[i], "--stats") == 0) {
+            stats = Perf::StatsFormat::Table;
+        } else if (strcmp(args[i], "--stats-json") == 0) {
+            stats = Perf::StatsFormat::Json;
+        } else if (strcmp(args[i], "--word-size") == 0) {
+            u64 bits {};
+            if (numberAfter(i, bits)) {
+                if (bits == 16 || bits == 32) {
+                    wordSize = static_cast<unsigned>(bits);
+                } else {
+                    fmt::print("word size must be 16 or 32, got {}\n", bits);
+                    invalid = true;
+                }
+            }
+        } else if (strcmp(args[i], "-j") == 0) {
+            u64 threads {};
+            if (numberAfter(i, threads)) {
+                schedule.threads = threads;
+            }
+        } else if (strcmp(args[i], "--quantum") == 0) {
+            u64 quantum {};
+            if (numberAfter(i, quantum)) {
+                if (quantum >= 1) {
+                    schedule.quantum = quantum;
+                } else {
+                    // a VM would never get through a slice
+                    fmt::print("the quantum must be at least 1 instruction, got {}\n", quantum);
+                    invalid = true;
+                }
+            }
+        } else if (strcmp(args[i], "--budget") == 0) {
+            (void)numberAfter(i, schedule.limits.instructionBudget);
+        } else if (strcmp(args[i], "--runs") == 0) {
+            (void)numberAfter(i, fuzz.runs);
+        } else if (strcmp(args[i], "--seed") == 0) {
+            (void)numberAfter(i, fuzz.seed);
+        } else if (strcmp(args[i], "--crashes") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                fuzz.crashDirectory = args[i];
+            } else {
+                fmt::print("no directory given after \"--crashes\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--metrics") == 0) {
+            metrics = true;
+        } else if (strcmp(args[i], "--metrics-file") == 0) {
+            if (i + 1 < args.size()) {
+                i++;
+                metrics = true;
+                metricsExport.textfile = args[i];
+            } else {
+                fmt::print("no file given after \"--metrics-file\"\n");
+                invalid = true;
+            }
+        } else if (strcmp(args[i], "--metrics-interval") == 0) {
+            u64 milliseconds {};
+            if (numberAfter(i, milliseconds)) {
+                metricsExport.interval = std::chrono::milliseconds(std::max<u64>(milliseconds, 1));
+            }
+        } else if (strcmp(args[i], "--time-limit") == 0) {
+            u64 milliseconds {};
+            if (numberAfter(i, milliseconds)) {
+                schedule.limits.wallClock = std::chrono::milliseconds(milliseconds);
+            }
+        } else if (strcmp(args[i], "--capacity") == 0) {
+            u64 capacity {};
+            if (numberAfter(i, capacity)) {
+                pipeCapacity = capacity;
+            }
+        } else if (strcmp(args[i], "--harts") == 0) {
+            u64 count {};
+            if (numberAfter(i, count)) {
+                harts.harts = count;
+            }
+        } else if (strcmp(args[i], "--memory-order") == 0) {
+            if (i + 1 < args.size() && strcmp(args[i + 1], "relaxed") == 0) {
+                harts.order = MemoryOrder::Relaxed;
+            } else if (i + 1 < args.size() && strcmp(args[i + 1], "seq-cst") == 0) {
+                harts.order = MemoryOrder::SequentiallyConsistent;
+            } else {
+                fmt::print("memory order must be relaxed or seq-cst\n");
+                invalid = true;
+            }
+            i++;
+        } else if (strcmp(args[i], "--pool") == 0) {
+            pipePool = true;
+        } else if (strcmp(args[i], "--no-pin") == 0) {
+            pipePin = false;
         } else if (strcmp(args[i], "exec-bin") == 0) {
             operation = Execbin;
         } else if (strcmp(args[i], "exec-file") == 0) {
             operation = Execfile;
         } else if (strcmp(args[i], "assemble") == 0) {
             operation = Assemble;
+        } else if (strcmp(args[i], "assemble-all") == 0) {
+            operation = AssembleAll;
+        } else if (strcmp(args[i], "watch") == 0) {
+            operation = Watch;
         } else if (strcmp(args[i], "disassemble") == 0) {
             operation = Disassemble;
+        } else if (strcmp(args[i], "compile") == 0) {
+            operation = Compile;
+        } else if (strcmp(args[i], "schedule") == 0) {
+            operation = Schedule;
+        } else if (strcmp(args[i], "pipeline") == 0) {
+            operation = Pipeline;
+        } else if (strcmp(args[i], "harts") == 0) {
+            operation = Harts;
+        } else if (strcmp(args[i], "debug") == 0) {
+            operation = Debug;
+        } else if (strcmp(args[i], "fuzz") == 0) {
+            operation = Fuzz;
         } else {
             input = args[i];
+            inputs.push_back(args[i]);
         }
     }
 }
 
+bool ArgParser::numberAfter(std::size_t& i, u64& value)
+{
+    const char* flag = args[i];
+    if (i + 1 >= args.size()) {
+        fmt::print("no number given after \"{}\"\n", flag);
+        invalid = true;
+        return false;
+    }
+    i++;
+    std::string_view text = args[i];
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || ptr != text.data() + text.size()) {
+        fmt::print("expected a number after \"{}\", got \"{}\"\n", flag, text);
+        invalid = true;
+        return false;
+    }
+    return true;
+}
+
 int ArgParser::invalidArgs()
 {
-    fmt::print("Usage {} [command] [input] -o [output]\nCommands: assemble, exec-file, exec-bin, disassemble\n", args[0]);
+    fmt::print("Usage {} [command] [input] -o [output] [-O] [--raw] [--source-map] [--word-size 16|32] [--perf-counters] [--stats|--stats-json]\n"
+               "Commands: assemble, assemble-all, watch, exec-file, exec-bin, disassemble, compile, schedule, pipeline, harts, debug, fuzz\n"
+               "assemble and exec-file read the source from stdin when input is -\n"
+               "assemble-all options: [directory|manifest] -o [directory] -j [threads]\n"
+               "exec-bin options: --memoize [directory]\n"
+               "exec-bin and exec-file options: --block-device [file] --record-input [file] --replay-input [file] --cycles --profile [file|-] --profile-hz [rate]\n"
+               "exec-bin, exec-file and schedule options: --metrics --metrics-file [file] --metrics-interval [ms]\n"
+               "schedule options: [images...] -j [threads] --quantum [instructions] --budget [instructions] --time-limit [ms]\n"
+               "pipeline options: [images...] --capacity [words] --no-pin --pool, and the schedule options with --pool\n"
+               "harts options: --harts [count] --memory-order relaxed|seq-cst\n"
+               "fuzz options: --runs [count] --seed [number] --crashes [directory] -j [threads] --budget [instructions per run]\n", args[0]);
     return -1;
 }
 
-int main(int argc, char** argv)
+template <typename Traits>
+int execFile(const ArgParser& parser)
 {
-    ArgParser parser(std::span(argv, static_cast<std::size_t>(argc)));
+    std::vector<typename Traits::Word> program {};
+    if (assembleToVec<Traits>(parser.input, parser.output, program, parser.assembly) != 0) {
+        return 1;
+    }
+    try {
+        return static_cast<int>(marieExecuteVec<Traits>(program, parser.exec));
+    } catch (const std::runtime_error& error) {
+        LOGE("{}", error.what());
+        return 1;
+    }
+}
 
+int runOperation(ArgParser& parser)
+{
     if (parser.invalid) {
         return parser.invalidArgs();
+    } else if (parser.exec.recordInput != nullptr && parser.exec.replayInput != nullptr) {
+        fmt::print("--record-input and --replay-input cannot be used together\n");
+        return parser.invalidArgs();
+    } else if (parser.exec.profile.report != nullptr && parser.exec.cycleAccurate) {
+        fmt::print("--profile and --cycles cannot be used together\n");
+        return parser.invalidArgs();
     } else {
         switch (parser.operation) {
         case Assemble: {
@@ -72,25 +327,85 @@ int main(int argc, char** argv)
                 fmt::print("No outputs given\n");
                 return parser.invalidArgs();
             }
-            return assemble(parser.input, parser.output);
+            if (parser.wordSize == 32) {
+                return assemble<Marie32>(parser.input, parser.output, parser.assembly);
+            }
+            return assemble(parser.input, parser.output, parser.assembly);
         } // Assemble
+        case AssembleAll: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.output == nullptr) {
+                fmt::print("No outputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.wordSize == 32) {
+                return assembleAll<Marie32>(parser.input, parser.output, parser.schedule.threads, parser.assembly);
+            }
+            return assembleAll(parser.input, parser.output, parser.schedule.threads, parser.assembly);
+        } // AssembleAll
+        case Watch: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.output == nullptr) {
+                fmt::print("No outputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.wordSize == 32) {
+                return watchAssemble<Marie32>(parser.input, parser.output, parser.assembly);
+            }
+            return watchAssemble(parser.input, parser.output, parser.assembly);
+        } // Watch
         case Execfile: {
             if (parser.input == nullptr) {
                 fmt::print("No inputs given\n");
                 return parser.invalidArgs();
             }
-            std::vector<Word> program {};
-            if (assembleToVec(parser.input, parser.output, program) != 0) {
-                return 1;
+            if (parser.wordSize == 32) {
+                return execFile<Marie32>(parser);
             }
-            return marieExecuteVec(program);
+            return execFile<Marie16>(parser);
         } // Exec
         case Execbin: {
             if (parser.input == nullptr) {
                 fmt::print("No inputs given\n");
                 return parser.invalidArgs();
             }
-            return marieExecute(parser.input);
+            try {
+                if (parser.memoDirectory != nullptr && parser.exec.blockDevice != nullptr) {
+                    fmt::print("--memoize cannot be used with --block-device, the run depends on the device file\n");
+                    return parser.invalidArgs();
+                }
+                if (parser.memoDirectory != nullptr && (parser.exec.recordInput != nullptr || parser.exec.replayInput != nullptr)) {
+                    fmt::print("--memoize cannot be used with --record-input or --replay-input\n");
+                    return parser.invalidArgs();
+                }
+                if (parser.memoDirectory != nullptr && parser.exec.cycleAccurate) {
+                    fmt::print("--memoize cannot be used with --cycles, a memoized run executes no cycles\n");
+                    return parser.invalidArgs();
+                }
+                if (parser.memoDirectory != nullptr && parser.exec.profile.report != nullptr) {
+                    fmt::print("--memoize cannot be used with --profile, a memoized run executes nothing to sample\n");
+                    return parser.invalidArgs();
+                }
+                if (parser.memoDirectory != nullptr) {
+                    if (parser.wordSize == 32) {
+                        return static_cast<int>(marieExecuteMemoized<Marie32>(parser.input, parser.memoDirectory));
+                    }
+                    return marieExecuteMemoized(parser.input, parser.memoDirectory);
+                }
+                if (parser.wordSize == 32) {
+                    return static_cast<int>(marieExecute<Marie32>(parser.input, parser.exec));
+                }
+                return marieExecute(parser.input, parser.exec);
+            } catch (const std::runtime_error& error) {
+                LOGE("{}", error.what());
+                return 1;
+            }
         } // Execbin
         case Disassemble: {
             if (parser.input == nullptr) {
@@ -102,6 +417,69 @@ int main(int argc, char** argv)
             }
             return disassembleToFile(parser.input, parser.output);
         } // Disassemble
+        case Compile: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.output == nullptr) {
+                fmt::print("No outputs given\n");
+                return parser.invalidArgs();
+            }
+            return compileToNative(parser.input, parser.output);
+        } // Compile
+        case Schedule: {
+            if (parser.inputs.empty()) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            return scheduleImages(parser.inputs, parser.schedule);
+        } // Schedule
+        case Pipeline: {
+            if (parser.inputs.empty()) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            return pipelineImages(parser.inputs,
+                PipelineOptions {
+                    .capacity = parser.pipeCapacity,
+                    .pinThreads = parser.pipePin,
+                    .usePool = parser.pipePool,
+                    .schedule = parser.schedule,
+                });
+        } // Pipeline
+        case Harts: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            return runHarts(parser.input, parser.harts);
+        } // Harts
+        case Debug: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            if (parser.wordSize == 32) {
+                return debugImage<Marie32>(parser.input);
+            }
+            return debugImage(parser.input);
+        } // Debug
+        case Fuzz: {
+            if (parser.input == nullptr) {
+                fmt::print("No inputs given\n");
+                return parser.invalidArgs();
+            }
+            FuzzOptions options = parser.fuzz;
+            options.threads = parser.schedule.threads;
+            if (parser.schedule.limits.instructionBudget != 0) {
+                options.budget = parser.schedule.limits.instructionBudget;
+            }
+            if (parser.wordSize == 32) {
+                return fuzzImage<Marie32>(parser.input, options);
+            }
+            return fuzzImage(parser.input, options);
+        } // Fuzz
         default:
             fmt::print("No operation given\n");
             return parser.invalidArgs();
@@ -110,3 +488,29 @@ int main(int argc, char** argv)
 
     return 0;
 }
+
+int main(int argc, char** argv)
+{
+    ArgParser parser(std::span(argv, static_cast<std::size_t>(argc)));
+
+    if (parser.perfCounters) {
+        Perf::enableCounters();
+    }
+    if (parser.stats) {
+        Perf::enableStats(*parser.stats);
+    }
+    if (parser.metrics) {
+        try {
+            Metrics::enable(parser.metricsExport);
+        } catch (const std::runtime_error& error) {
+            LOGE("{}", error.what());
+            return 1;
+        }
+    }
+
+    int status = runOperation(parser);
+
+    Metrics::shutdown();
+    Perf::report();
+    return status;
+}
@@ -2,73 +2,291 @@
 
 #include "file.hpp"
 #include "instructions.hpp"
+#include "metrics.hpp"
+#include "perf.hpp"
+#include "static_assemble.hpp"
+#include "static_marie.hpp"
 
 namespace {
 
-struct Marie {
-    Marie(const Word* image, size_t imageSize);
+// prerun has to follow the VM, a halting program ends with the memory it stored
+constexpr auto prerunHalted = prerun(assembleProgram<"load x\nadd x\nstore y\nhalt\nx, 0x15\ny, 0x0\n">(), 100);
+static_assert(prerunHalted.stop == PrerunStop::Halted && prerunHalted.memory[5] == 0x2A
+    && prerunHalted.accumulator == 0x2A && prerunHalted.retired == 4);
+// and stops before I/O so the VM executes it
+constexpr auto prerunOutput = prerun(assembleProgram<"load x\noutput\nhalt\nx, 0x7\n">(), 100);
+static_assert(prerunOutput.stop == PrerunStop::SideEffect && prerunOutput.pc == 1 && prerunOutput.accumulator == 7);
 
-    Word run();
-    static std::pair<Instruction, Word> decode(Word instr);
-    void execInstr(std::pair<Instruction, Word>& instr);
-
-private:
-    static constexpr std::size_t MaxMemory = 4096;
-    std::array<Word, MaxMemory> mMemory {};
-    std::size_t mImageSize {};
-
-    Word mAC {}; // Accumulator
-    // Word MAR {}; // Memory Address Register
-    // Word MBR {}; // Memory Buffer Register
-    Word mPC {}; // Program Counter
-    // Word IR {}; // Instruction Register (holds the next expression to be executed)
-    // Word InREG {}; //  Input Register (holds data from the input device)
-
-    bool mSkipNext = false;
-    // bool errors = false;
-    bool mHalt = false;
-
-    [[nodiscard]] static Word userInputHex();
-    [[nodiscard]] Word memoryAtAddress(const Word address);
-    void storeAtAddress(const Word address);
-    [[nodiscard]] bool skipCond(Word condition) const;
-};
+} // anonymous namespace
 
-Marie::Marie(const Word* image, size_t imageSize)
+template <typename Traits>
+BasicMarie<Traits>::BasicMarie(const Word* image, size_t imageSize)
+    requires(!Traits::Shared)
     : mImageSize(imageSize)
 {
     if (imageSize > MaxMemory) {
         LOGW("Warning, an image size of {} is larger than MARIE's max memory of {} Bytes\n", imageSize, MaxMemory);
         mImageSize = MaxMemory;
     }
+    allocateMemory();
     std::memcpy(mMemory.data(), image, mImageSize * sizeof(Word));
     LOGD("Created a MARIE virtual machine with an imageSize of {}", mImageSize);
 }
 
-Word Marie::run()
+template <typename Traits>
+BasicMarie<Traits>::BasicMarie(const ContainerImage<Word>& image)
+    requires(!Traits::Shared)
+    : mImageSize(image.imageWords())
+    , mEntryPoint(static_cast<Word>(image.entryPoint()))
+{
+    if (mImageSize > MaxMemory) {
+        throw std::runtime_error(fmt::format("an image size of {} is larger than MARIE's max memory of {} words", mImageSize, MaxMemory));
+    }
+    allocateMemory();
+    image.decompressInto(std::span(mMemory.data(), mImageSize));
+    mPC = mEntryPoint;
+    LOGD("Created a MARIE virtual machine from a container with an imageSize of {}", mImageSize);
+}
+
+template <typename Traits>
+BasicMarie<Traits>::BasicMarie(std::span<Word> sharedMemory, size_t imageSize, Word hartId, MemoryOrder order)
+    requires(Traits::Shared)
+    : mImageSize(std::min({ imageSize, sharedMemory.size(), MaxMemory }))
+    , mShared(sharedMemory.data())
+    , mHartId(hartId)
+    , mOrder(order)
+{
+    LOGD("Created MARIE hart {} sharing {} words", hartId, mImageSize);
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::allocateMemory()
+{
+    if constexpr (!Traits::InlineMemory && !Traits::Shared) {
+        mMemory.resize(mImageSize);
+        mDecoded.resize(mImageSize);
+        mCodeBitmap.resize((mImageSize >> PageShift) + 1);
+    }
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::run() -> Word
 {
     LOGT("run called on MARIE virtual machine")
-    mPC = 0;
+    mPC = mEntryPoint;
 
     while (!mHalt && mPC < mImageSize) {
-        auto instr = decode(memoryAtAddress(mPC));
+        auto instr = fetch(mPC);
         mPC += 1;
         execInstr(instr);
+        mRetired++;
     }
 
     LOGD("run finished on MARIE virtual machine with mPC of {}", mPC);
+    LOGD("code cache: {} decodes, {} stores into code, {} invalidations",
+        mCodeWriteStats.decodes,
+        mCodeWriteStats.codeStores,
+        mCodeWriteStats.invalidations);
     return mAC;
 }
 
-std::pair<Instruction, Word> Marie::decode(Word instr)
+template <typename Traits>
+auto BasicMarie<Traits>::runSlice(u64 maxInstructions) -> State
+{
+    mWaitingInput = false;
+
+    for (u64 i = 0; i < maxInstructions; i++) {
+        if (mHalt || mPC >= mImageSize) {
+            return State::Halted;
+        }
+        auto instr = fetch(mPC);
+        mPC += 1;
+        execInstr(instr);
+        if (mWaitingInput) [[unlikely]] {
+            return State::WaitingInput;
+        }
+        mRetired++;
+    }
+
+    return (mHalt || mPC >= mImageSize) ? State::Halted : State::Running;
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::runSampled(std::atomic<u32>& publishedPc) -> Word
+    requires(!Traits::Shared)
 {
-    std::pair<Instruction, Word> val;
-    val.first = static_cast<Instruction>(instr >> 12 & 0xF);
-    val.second = static_cast<Word>(instr & 0x0FFF);
-    return val;
+    mPC = mEntryPoint;
+
+    while (!mHalt && mPC < mImageSize) {
+        // a relaxed store is a plain move, the SIGPROF handler reads it on this thread
+        publishedPc.store(static_cast<u32>(mPC), std::memory_order_relaxed);
+        auto instr = fetch(mPC);
+        mPC += 1;
+        execInstr(instr);
+        mRetired++;
+    }
+
+    LOGD("runSampled finished on MARIE virtual machine with mPC of {}", mPC);
+    return mAC;
 }
 
-void Marie::execInstr(std::pair<Instruction, Word>& instr)
+template <typename Traits>
+auto BasicMarie<Traits>::runMicrocode(u64 maxInstructions) -> State
+    requires(!Traits::Shared)
+{
+    mWaitingInput = false;
+    if (mSkipNext) {
+        // a Skipcond ran before resumeAt, its PC <- PC + 1 is still due
+        mSkipNext = false;
+        mPC += 1;
+        mRetired++;
+    }
+
+    for (u64 i = 0; i < maxInstructions; i++) {
+        if (mHalt || mPC >= mImageSize) {
+            return State::Halted;
+        }
+        // MAR <- PC, IR <- M[MAR] and PC <- PC + 1, then decode and MAR <- IR[11-0]
+        mMAR = mPC;
+        mIR = mMemory[mMAR];
+        mPC += 1;
+        const auto [instruction, operand] = fetch(mMAR);
+        mMAR = operand;
+
+        u64 cycles = FetchCycles;
+        for (const MicroOp op : MicrocodeTable.sequence(instruction)) {
+            cycles++;
+            switch (op) {
+            case MicroOp::MbrFromMemory:
+                mMBR = memoryAtAddress(mMAR);
+                break;
+            case MicroOp::MemoryFromMbr:
+                storeAtAddress(mMAR, mMBR);
+                break;
+            case MicroOp::MbrFromAc:
+                mMBR = mAC;
+                break;
+            case MicroOp::AcFromMbr:
+                mAC = mMBR;
+                break;
+            case MicroOp::AcAddMbr:
+                mAC = static_cast<Word>(mAC + mMBR);
+                break;
+            case MicroOp::AcSubtractMbr:
+                mAC = static_cast<Word>(mAC - mMBR);
+                break;
+            case MicroOp::AcFromInReg: {
+                if (!mInputSource) {
+                    mInREG = userInputHex();
+                } else if (auto value = mInputSource()) {
+                    mInREG = *value;
+                } else {
+                    // retry this Input once the source has data
+                    mWaitingInput = true;
+                    mPC -= 1;
+                    break;
+                }
+                Metrics::add(Metrics::InputValues);
+                mAC = mInREG;
+                break;
+            }
+            case MicroOp::OutRegFromAc:
+                mOutREG = mAC;
+                Metrics::add(Metrics::OutputValues);
+                if (mOutputSink) {
+                    mOutputSink(mOutREG);
+                } else {
+                    fmt::print("{:x}\n", mOutREG);
+                }
+                break;
+            case MicroOp::Halt:
+                mHalt = true;
+                break;
+            case MicroOp::SkipIfCondition:
+                if (skipCond(operand)) {
+                    // the skipped instruction is never fetched but counts as retired, like in run
+                    mPC += 1;
+                    mRetired++;
+                }
+                break;
+            case MicroOp::PcFromIr:
+                mPC = operand;
+                break;
+            case MicroOp::MbrFromPc:
+                mMBR = mPC;
+                break;
+            case MicroOp::MbrFromIr:
+                mMBR = operand;
+                break;
+            case MicroOp::AcFromOne:
+                mAC = 1;
+                break;
+            case MicroOp::PcFromAc:
+                mPC = mAC;
+                break;
+            case MicroOp::AcFromZero:
+                mAC = 0;
+                break;
+            case MicroOp::MarFromMbr:
+                mMAR = mMBR;
+                break;
+            case MicroOp::PcFromMbr:
+                mPC = mMBR & Traits::AddressMask;
+                break;
+            case MicroOp::AcFromHartId:
+                mAC = mHartId;
+                break;
+            case MicroOp::MemoryFromMbrPlusAc:
+                mAtomicStats.fetchAdds++;
+                storeAtAddress(mMAR, static_cast<Word>(mMBR + mAC));
+                break;
+            case MicroOp::MemoryFromAcIfMbrZero:
+                mAtomicStats.compareSwaps++;
+                if (mMBR == 0) {
+                    storeAtAddress(mMAR, mAC);
+                } else {
+                    mAtomicStats.compareSwapFailures++;
+                }
+                break;
+            case MicroOp::Invalid:
+                Metrics::add(Metrics::InvalidOpcodes);
+                if (!mQuiet) {
+                    fmt::print("Invalid instruction {:x} at PC {:x}\n", static_cast<int>(instruction), mPC);
+                }
+                break;
+            }
+            if (mFaulted || mWaitingInput) [[unlikely]] {
+                break;
+            }
+        }
+        if (mWaitingInput) [[unlikely]] {
+            return State::WaitingInput;
+        }
+        mCycles += cycles;
+        mInstructionMix[static_cast<std::size_t>(instruction)]++;
+        mRetired++;
+    }
+
+    return (mHalt || mPC >= mImageSize) ? State::Halted : State::Running;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::resumeAt(Word pc, Word accumulator, bool skipNext)
+{
+    mEntryPoint = pc;
+    mPC = pc;
+    mAC = accumulator;
+    mSkipNext = skipNext;
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::decode(Word instr) -> std::pair<Instruction, Word>
+{
+    return Traits::decode(instr);
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::execInstr(std::pair<Instruction, Word>& instr)
 {
     if (mSkipNext) {
         LOGD("skipping instruction");
@@ -81,8 +299,8 @@ void Marie::execInstr(std::pair<Instruction, Word>& instr)
     switch (instr.first) {
     case Instruction::Jns: {
         mAC = mPC;
-        storeAtAddress(instr.second);
-        mAC = instr.second + 1;
+        storeAtAddress(instr.second, mAC);
+        mAC = static_cast<Word>(instr.second + 1);
         mPC = mAC;
         break;
     }
@@ -90,7 +308,7 @@ void Marie::execInstr(std::pair<Instruction, Word>& instr)
         mAC = memoryAtAddress(instr.second);
         break;
     case Instruction::Store:
-        storeAtAddress(instr.second);
+        storeAtAddress(instr.second, mAC);
         break;
     case Instruction::Add:
         mAC = mAC + memoryAtAddress(instr.second);
@@ -98,11 +316,30 @@ void Marie::execInstr(std::pair<Instruction, Word>& instr)
     case Instruction::Subt:
         mAC = mAC - memoryAtAddress(instr.second);
         break;
-    case Instruction::Input:
-        mAC = userInputHex();
+    case Instruction::Input: {
+        if (!mInputSource) {
+            mAC = userInputHex();
+            Metrics::add(Metrics::InputValues);
+            break;
+        }
+        auto value = mInputSource();
+        if (!value) {
+            // retry this Input once the source has data
+            mWaitingInput = true;
+            mPC -= 1;
+            break;
+        }
+        mAC = *value;
+        Metrics::add(Metrics::InputValues);
         break;
+    }
     case Instruction::Output:
-        fmt::print("{:x}\n", mAC);
+        Metrics::add(Metrics::OutputValues);
+        if (mOutputSink) {
+            mOutputSink(mAC);
+        } else {
+            fmt::print("{:x}\n", mAC);
+        }
         break;
     case Instruction::Halt:
         mHalt = true;
@@ -120,20 +357,33 @@ void Marie::execInstr(std::pair<Instruction, Word>& instr)
         mAC = mAC + memoryAtAddress(memoryAtAddress(instr.second));
         break;
     case Instruction::JumpI:
-        mPC = memoryAtAddress(instr.second) & 0x0FFF;
+        mPC = memoryAtAddress(instr.second) & Traits::AddressMask;
         break;
     case Instruction::LoadI:
         mAC = memoryAtAddress(memoryAtAddress(instr.second));
         break;
     case Instruction::StoreI:
-        storeAtAddress(memoryAtAddress(instr.second));
+        storeAtAddress(memoryAtAddress(instr.second), mAC);
+        break;
+    case Instruction::HartId:
+        mAC = mHartId;
+        break;
+    case Instruction::FAdd:
+        mAC = fetchAdd(instr.second);
+        break;
+    case Instruction::Cas:
+        mAC = compareSwap(instr.second);
         break;
     default:
-        fmt::print("Invalid instruction {:x} at PC {:x}\n", static_cast<int>(instr.first), mPC);
+        Metrics::add(Metrics::InvalidOpcodes);
+        if (!mQuiet) {
+            fmt::print("Invalid instruction {:x} at PC {:x}\n", static_cast<int>(instr.first), mPC);
+        }
     }
 }
 
-[[nodiscard]] Word Marie::userInputHex()
+template <typename Traits>
+[[nodiscard]] auto BasicMarie<Traits>::userInputHex() -> Word
 {
     std::string line;
     std::getline(std::cin, line);
@@ -144,27 +394,509 @@ void Marie::execInstr(std::pair<Instruction, Word>& instr)
     return value;
 }
 
-[[nodiscard]] Word Marie::memoryAtAddress(const Word address)
+template <typename Traits>
+[[nodiscard]] auto BasicMarie<Traits>::fetch(const Word address) -> std::pair<Instruction, Word>
+{
+    if constexpr (Traits::Shared) {
+        return decode(std::atomic_ref<Word>(mShared[address]).load(plainOrder()));
+    }
+
+    // run only fetches below mImageSize so no bounds check is needed here
+    u64& page = mCodeBitmap[address >> PageShift];
+    const u64 bit = u64 { 1 } << (address & PageMask);
+    if ((page & bit) == 0) {
+        mDecoded[address] = decode(mMemory[address]);
+        if (!mDebugFlags.empty() && (mDebugFlags[address] & BreakFlags) != 0) [[unlikely]] {
+            // left out of the cache, so every fetch of a breakpoint comes back here
+            breakpointFetched(address);
+            return mDecoded[address];
+        }
+        page |= bit;
+        mCodeWriteStats.decodes++;
+    }
+    return mDecoded[address];
+}
+
+template <typename Traits>
+[[nodiscard]] auto BasicMarie<Traits>::memoryAtAddress(const Word address) -> Word
 {
     if (address >= mImageSize) {
-        fmt::print("attempting to address outside of memory at {:x}, returning 0 and halting\n", address);
-        mHalt = true;
+        if (mDevice != nullptr && address >= MmioBase<Traits>) {
+            return mmioLoad(address);
+        }
+        if (!mQuiet) {
+            fmt::print("attempting to address outside of memory at {:x}, returning 0 and halting\n", address);
+        }
+        fault();
         return 0;
     }
+    if constexpr (Traits::Shared) {
+        return std::atomic_ref<Word>(mShared[address]).load(plainOrder());
+    } else {
+        if (mWatching && ((mWatchBitmap[address >> PageShift] >> (address & PageMask)) & 1) != 0) [[unlikely]] {
+            watchedAccess(address, Watch::Read);
+        }
+    }
     return *(mMemory.data() + address);
 }
 
-void Marie::storeAtAddress(const Word address)
+template <typename Traits>
+void BasicMarie<Traits>::storeAtAddress(const Word address, const Word value)
 {
     if (address >= mImageSize) {
-        fmt::print("attempting to address outside of memory, doing nothing and halting\n");
+        if (mDevice != nullptr && address >= MmioBase<Traits>) {
+            mmioStore(address, value);
+            return;
+        }
+        if (!mQuiet) {
+            fmt::print("attempting to address outside of memory, doing nothing and halting\n");
+        }
+        fault();
+        return;
+    }
+    if constexpr (Traits::Shared) {
+        std::atomic_ref<Word>(mShared[address]).store(value, plainOrder());
+        return;
+    }
+    if (mCodeBitmap[address >> PageShift] != 0) [[unlikely]] {
+        invalidateCode(address, value);
+    }
+    if (mWatching && ((mWatchBitmap[address >> PageShift] >> (address & PageMask)) & 1) != 0) [[unlikely]] {
+        watchedAccess(address, Watch::Write);
+    }
+    if (mTrackDirty) {
+        markDirty(address);
+    }
+    *(mMemory.data() + address) = value;
+}
+
+// FAdd X: AC = M[X], M[X] = M[X] + AC in one step
+template <typename Traits>
+auto BasicMarie<Traits>::fetchAdd(const Word address) -> Word
+{
+    mAtomicStats.fetchAdds++;
+    if constexpr (Traits::Shared) {
+        if (address < mImageSize) {
+            return std::atomic_ref<Word>(mShared[address]).fetch_add(mAC, atomicOrder());
+        }
+    }
+
+    const Word old = memoryAtAddress(address);
+    if (mFaulted) {
+        return mAC;
+    }
+    storeAtAddress(address, static_cast<Word>(old + mAC));
+    return old;
+}
+
+// Cas X: M[X] = AC if M[X] is 0, AC = the old M[X] either way, so a hart owns
+// a lock word when Cas leaves 0 in AC
+template <typename Traits>
+auto BasicMarie<Traits>::compareSwap(const Word address) -> Word
+{
+    mAtomicStats.compareSwaps++;
+    if constexpr (Traits::Shared) {
+        if (address < mImageSize) {
+            Word expected = 0;
+            const bool failureIsSeqCst = mOrder == MemoryOrder::SequentiallyConsistent;
+            if (!std::atomic_ref<Word>(mShared[address]).compare_exchange_strong(expected, mAC, atomicOrder(), failureIsSeqCst ? std::memory_order_seq_cst : std::memory_order_acquire)) {
+                mAtomicStats.compareSwapFailures++;
+            }
+            return expected;
+        }
+    }
+
+    const Word old = memoryAtAddress(address);
+    if (mFaulted) {
+        return mAC;
+    }
+    if (old == 0) {
+        storeAtAddress(address, mAC);
+    } else {
+        mAtomicStats.compareSwapFailures++;
+    }
+    return old;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::attachBlockDevice(BlockDevice& device)
+    requires(!Traits::Shared)
+{
+    if (mImageSize > MmioBase<Traits>) {
+        LOGW("the image overlaps the block device registers at {:x}, the words from there on are not reachable", MmioBase<Traits>);
+        mImageSize = MmioBase<Traits>;
+    }
+    mDevice = &device;
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::mmioLoad(const Word address) const -> Word
+{
+    const auto reg = static_cast<BlockRegister>(address - MmioBase<Traits>);
+    switch (reg) {
+    case BlockRegister::Blocks:
+        return static_cast<Word>(std::min<std::size_t>(mDevice->blocks(sizeof(Word)), std::numeric_limits<Word>::max()));
+    case BlockRegister::Block:
+    case BlockRegister::Address:
+    case BlockRegister::Count:
+    case BlockRegister::Status:
+        return mDeviceRegisters[static_cast<std::size_t>(reg)];
+    default:
+        return 0;
+    }
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::mmioStore(const Word address, const Word value)
+{
+    const auto reg = static_cast<BlockRegister>(address - MmioBase<Traits>);
+    switch (reg) {
+    case BlockRegister::Block:
+    case BlockRegister::Address:
+    case BlockRegister::Count:
+        mDeviceRegisters[static_cast<std::size_t>(reg)] = value;
+        break;
+    case BlockRegister::Command:
+        mDeviceRegisters[static_cast<std::size_t>(BlockRegister::Status)] = static_cast<Word>(blockTransfer(value));
+        break;
+    default:
+        break;
+    }
+}
+
+// copies whole blocks between the mapping and memory, swapping the byte order in one pass
+template <typename Traits>
+BlockStatus BasicMarie<Traits>::blockTransfer(Word command)
+{
+    const std::size_t block = mDeviceRegisters[static_cast<std::size_t>(BlockRegister::Block)];
+    const std::size_t address = mDeviceRegisters[static_cast<std::size_t>(BlockRegister::Address)];
+    const std::size_t count = mDeviceRegisters[static_cast<std::size_t>(BlockRegister::Count)];
+    const std::size_t words = count * BlockDevice::BlockWords;
+
+    if (command != static_cast<Word>(BlockCommand::Read) && command != static_cast<Word>(BlockCommand::Write)) {
+        return BlockStatus::BadCommand;
+    }
+    if (block + count > mDevice->blocks(sizeof(Word))) {
+        return BlockStatus::OutsideDevice;
+    }
+    if (address + words > mImageSize) {
+        return BlockStatus::OutsideMemory;
+    }
+
+    Word* memory = mMemory.data() + address;
+    std::byte* disk = mDevice->bytes().data() + block * BlockDevice::BlockWords * sizeof(Word);
+    if (command == static_cast<Word>(BlockCommand::Read)) {
+        for (std::size_t i = 0; i < words; i++) {
+            Word value {};
+            std::memcpy(&value, disk + i * sizeof(Word), sizeof(Word));
+            memory[i] = swapBytes(value);
+            if (mTrackDirty) {
+                markDirty(static_cast<Word>(address + i));
+            }
+        }
+        // the transfer may overwrite code, decode those pages again
+        if (words != 0) {
+            std::fill(mCodeBitmap.begin() + static_cast<std::ptrdiff_t>(address >> PageShift),
+                mCodeBitmap.begin() + static_cast<std::ptrdiff_t>(((address + words - 1) >> PageShift) + 1),
+                u64 { 0 });
+        }
+    } else {
+        for (std::size_t i = 0; i < words; i++) {
+            const Word value = swapBytes(memory[i]);
+            std::memcpy(disk + i * sizeof(Word), &value, sizeof(Word));
+        }
+    }
+    LOGD("block device {} of {} blocks at block {} and address {:x}", command == static_cast<Word>(BlockCommand::Read) ? "read" : "write", count, block, address);
+    return BlockStatus::Ok;
+}
+
+template <typename Traits>
+std::memory_order BasicMarie<Traits>::plainOrder() const
+{
+    return mOrder == MemoryOrder::SequentiallyConsistent ? std::memory_order_seq_cst : std::memory_order_relaxed;
+}
+
+template <typename Traits>
+std::memory_order BasicMarie<Traits>::atomicOrder() const
+{
+    return mOrder == MemoryOrder::SequentiallyConsistent ? std::memory_order_seq_cst : std::memory_order_acq_rel;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::invalidateCode(const Word address, const Word value)
+{
+    const u64 bit = u64 { 1 } << (address & PageMask);
+    u64& page = mCodeBitmap[address >> PageShift];
+    if ((page & bit) == 0) {
+        return;
+    }
+
+    mCodeWriteStats.codeStores++;
+    if (mMemory[address] != value) {
+        LOGD("store into code at {:x}, invalidating its decoded entry", address);
+        page &= ~bit;
+        mCodeWriteStats.invalidations++;
+    }
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::fault()
+{
+    if (!mQuiet && mSourceMap != nullptr) {
+        // execInstr runs with mPC already past the instruction
+        fmt::print("  in {}\n", mSourceMap->describe(static_cast<u32>(mPC - 1)));
+    }
+    mHalt = true;
+    mFaulted = true;
+    Metrics::add(Metrics::OutOfBounds);
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::markDirty(const Word address)
+{
+    mDirtyBitmap[address >> PageShift] |= u64 { 1 } << (address & PageMask);
+    mDirtyPages[address >> (PageShift * 2)] |= u64 { 1 } << ((address >> PageShift) & PageMask);
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::snapshot()
+    requires(!Traits::Shared)
+{
+    mSnapshot = Snapshot {
+        .memory = std::vector<Word>(mMemory.begin(), mMemory.begin() + static_cast<std::ptrdiff_t>(mImageSize)),
+        .ac = mAC,
+        .pc = mPC,
+        .skipNext = mSkipNext,
+    };
+    mDirtyBitmap.assign((mImageSize >> PageShift) + 1, 0);
+    mDirtyPages.assign((mImageSize >> (PageShift * 2)) + 1, 0);
+    mTrackDirty = true;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::resetToSnapshot()
+    requires(!Traits::Shared)
+{
+    for (std::size_t group = 0; group < mDirtyPages.size(); group++) {
+        for (u64 pages = std::exchange(mDirtyPages[group], 0); pages != 0; pages &= pages - 1) {
+            const std::size_t page = (group << PageShift) + static_cast<std::size_t>(std::countr_zero(pages));
+            const u64 dirty = std::exchange(mDirtyBitmap[page], 0);
+            for (u64 words = dirty; words != 0; words &= words - 1) {
+                const std::size_t address = (page << PageShift) + static_cast<std::size_t>(std::countr_zero(words));
+                mMemory[address] = mSnapshot.memory[address];
+            }
+            // restored code decodes again, like after a store into it
+            mCodeBitmap[page] &= ~dirty;
+        }
+    }
+
+    mAC = mSnapshot.ac;
+    mPC = mSnapshot.pc;
+    mSkipNext = mSnapshot.skipNext;
+    mHalt = false;
+    mWaitingInput = false;
+    mFaulted = false;
+    mRetired = 0;
+    mPreviousLocation = 0;
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::runCovered(u64 maxInstructions, std::span<u64> edges) -> State
+    requires(!Traits::Shared)
+{
+    const std::size_t edgeMask = edges.size() * 64 - 1;
+    u32 previous = mPreviousLocation;
+    mWaitingInput = false;
+
+    for (u64 i = 0; i < maxInstructions; i++) {
+        if (mHalt || mPC >= mImageSize) {
+            mPreviousLocation = previous;
+            return State::Halted;
+        }
+        // Fibonacci hashing spreads neighbouring addresses over the whole map
+        const u32 location = static_cast<u32>(mPC) * 0x9E3779B1U;
+        const std::size_t edge = ((location >> 16) ^ previous) & edgeMask;
+        edges[edge >> 6] |= u64 { 1 } << (edge & 63);
+        previous = (location >> 16) >> 1;
+
+        auto instr = fetch(mPC);
+        mPC += 1;
+        execInstr(instr);
+        if (mWaitingInput) [[unlikely]] {
+            mPreviousLocation = previous;
+            return State::WaitingInput;
+        }
+        mRetired++;
+    }
+
+    mPreviousLocation = previous;
+    return (mHalt || mPC >= mImageSize) ? State::Halted : State::Running;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::allocateDebugFlags()
+{
+    if (mDebugFlags.empty()) {
+        mDebugFlags.resize(mImageSize);
+        mWatchBitmap.resize((mImageSize >> PageShift) + 1);
+    }
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::setBreakpoint(Word address, std::optional<AcCondition> condition)
+    requires(!Traits::Shared)
+{
+    if (address >= mImageSize) {
+        throw std::runtime_error(fmt::format("{:x} is outside of the image", address));
+    }
+    allocateDebugFlags();
+    mDebugFlags[address] &= static_cast<u8>(~BreakFlags);
+    if (condition) {
+        mDebugFlags[address] |= BreakConditional;
+        mBreakConditions[address] = *condition;
+    } else {
+        mDebugFlags[address] |= BreakAlways;
+        mBreakConditions.erase(address);
+    }
+    // drop the decoded entry so the next fetch sees the flag
+    mCodeBitmap[address >> PageShift] &= ~(u64 { 1 } << (address & PageMask));
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::setWatchpoint(Word address, Watch kind)
+    requires(!Traits::Shared)
+{
+    if (address >= mImageSize) {
+        throw std::runtime_error(fmt::format("{:x} is outside of the image", address));
+    }
+    allocateDebugFlags();
+    mDebugFlags[address] |= static_cast<u8>(static_cast<u8>(kind) << 2);
+    mWatchBitmap[address >> PageShift] |= u64 { 1 } << (address & PageMask);
+    mWatching = true;
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::clearDebugFlags(Word address)
+    requires(!Traits::Shared)
+{
+    if (address >= mDebugFlags.size()) {
+        return;
+    }
+    mDebugFlags[address] = 0;
+    mBreakConditions.erase(address);
+    mWatchBitmap[address >> PageShift] &= ~(u64 { 1 } << (address & PageMask));
+    mWatching = std::any_of(mWatchBitmap.begin(), mWatchBitmap.end(), [](u64 page) { return page != 0; });
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::breakpointFetched(const Word address)
+{
+    if (address == mPassBreakpoint) {
+        mPassBreakpoint = std::numeric_limits<std::size_t>::max();
+        return;
+    }
+
+    bool stop = (mDebugFlags[address] & BreakAlways) != 0;
+    if (auto condition = mBreakConditions.find(address); !stop && condition != mBreakConditions.end()) {
+        using SignedWord = typename Traits::SignedWord;
+        const auto ac = static_cast<SignedWord>(mAC);
+        const auto value = static_cast<SignedWord>(condition->second.value);
+        switch (condition->second.compare) {
+        case AcCondition::Compare::Equal:
+            stop = ac == value;
+            break;
+        case AcCondition::Compare::NotEqual:
+            stop = ac != value;
+            break;
+        case AcCondition::Compare::Less:
+            stop = ac < value;
+            break;
+        case AcCondition::Compare::Greater:
+            stop = ac > value;
+            break;
+        }
+    }
+    if (stop) {
+        mDebugStop = DebugStop { .reason = DebugStop::Reason::Breakpoint, .address = address };
         mHalt = true;
+    }
+}
+
+template <typename Traits>
+void BasicMarie<Traits>::watchedAccess(const Word address, Watch kind)
+{
+    if ((mDebugFlags[address] & (static_cast<u8>(kind) << 2)) == 0 || mDebugStop) {
         return;
     }
-    *(mMemory.data() + address) = mAC;
+    // the instruction completes, the run loop stops before the next one
+    mDebugStop = DebugStop {
+        .reason = kind == Watch::Read ? DebugStop::Reason::WatchRead : DebugStop::Reason::WatchWrite,
+        .address = address,
+    };
+    mHalt = true;
 }
 
-[[nodiscard]] bool Marie::skipCond(Word condition) const
+template <typename Traits>
+void BasicMarie<Traits>::resumeDebugging()
+{
+    if (!mDebugStop) {
+        return;
+    }
+    if (mDebugStop->reason == DebugStop::Reason::Breakpoint) {
+        mPassBreakpoint = mDebugStop->address;
+    }
+    mDebugStop.reset();
+    mHalt = mFaulted;
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::debugRun() -> DebugStop
+    requires(!Traits::Shared)
+{
+    resumeDebugging();
+    while (!mHalt && mPC < mImageSize) {
+        auto instr = fetch(mPC);
+        if (mHalt) [[unlikely]] {
+            // a breakpoint stops before its instruction
+            break;
+        }
+        mPC += 1;
+        execInstr(instr);
+        mRetired++;
+    }
+    return mDebugStop.value_or(DebugStop { .reason = DebugStop::Reason::Halted, .address = mPC });
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::debugStep() -> DebugStop
+    requires(!Traits::Shared)
+{
+    resumeDebugging();
+    if (mHalt || mPC >= mImageSize) {
+        return DebugStop { .reason = DebugStop::Reason::Halted, .address = mPC };
+    }
+    mPassBreakpoint = mPC;
+    auto instr = fetch(mPC);
+    mPassBreakpoint = std::numeric_limits<std::size_t>::max();
+    mPC += 1;
+    execInstr(instr);
+    mRetired++;
+    if (mDebugStop) {
+        return *mDebugStop;
+    }
+    // a step that ran Halt or faulted has nothing left to resume
+    return DebugStop { .reason = mHalt ? DebugStop::Reason::Halted : DebugStop::Reason::Step, .address = mPC };
+}
+
+template <typename Traits>
+auto BasicMarie<Traits>::peek(Word address) const -> Word
+    requires(!Traits::Shared)
+{
+    return address < mImageSize ? mMemory[address] : 0;
+}
+
+template <typename Traits>
+[[nodiscard]] bool BasicMarie<Traits>::skipCond(Word condition) const
 {
     condition = condition & 0x0C00;
 
@@ -174,19 +906,19 @@ void Marie::storeAtAddress(const Word address)
 
     switch (condition) {
     case SkipLt: {
-        if (static_cast<int16_t>(mAC) < 0) {
+        if (static_cast<typename Traits::SignedWord>(mAC) < 0) {
             return true;
         }
         break;
     }
     case SkipEq: {
-        if (static_cast<int16_t>(mAC) == 0) {
+        if (static_cast<typename Traits::SignedWord>(mAC) == 0) {
             return true;
         }
         break;
     }
     case SkipGt: {
-        if (static_cast<int16_t>(mAC) > 0) {
+        if (static_cast<typename Traits::SignedWord>(mAC) > 0) {
             return true;
         }
         break;
@@ -198,27 +930,192 @@ void Marie::storeAtAddress(const Word address)
     return false;
 }
 
-} // anonymous namespace
+template struct BasicMarie<Marie16>;
+template struct BasicMarie<Marie32>;
+template struct BasicMarie<MarieHart16>;
+
+namespace {
 
-Word marieExecute(const char* inputFile)
+template <typename WordType>
+std::vector<WordType> wordsFromDump(const std::vector<char>& bytes)
 {
-    std::vector<Word> data = fileToVector<Word>(inputFile);
+    std::vector<WordType> data(bytes.size() / sizeof(WordType));
+    std::memcpy(data.data(), bytes.data(), data.size() * sizeof(WordType));
 
+    Perf::Phase phase("endian swap");
+    phase.setBytes(bytes.size());
     // Convert from big to little endian
-    for (Word& i : data) {
-        i = std::rotr(i, 8);
+    for (auto& i : data) {
+        i = swapBytes(i);
+    }
+
+    return data;
+}
+
+template <typename Traits>
+typename Traits::Word runCycleAccurate(BasicMarie<Traits>& vm)
+{
+    Perf::Phase phase("Marie::runMicrocode");
+    while (vm.runMicrocode() == BasicMarie<Traits>::State::WaitingInput) {
+        // the sources exec sets up block for a value, a source that has none yet is retried
+        std::this_thread::yield();
+    }
+    const typename Traits::Word result = vm.accumulator();
+    phase.setWork(vm.cycles(), "microstep");
+    phase.setBytes(vm.imageSize() * sizeof(typename Traits::Word));
+    Metrics::add(Metrics::Retired, vm.retired());
+    if (!vm.faulted()) {
+        Metrics::add(Metrics::Halts);
+    }
+
+    const auto& mix = vm.instructionMix();
+    const u64 executed = std::accumulate(mix.begin(), mix.end(), u64 { 0 });
+    fmt::print(stderr, "{} cycles, {} instructions, {:.2f} cycles per instruction\n",
+        vm.cycles(),
+        executed,
+        executed != 0 ? static_cast<double>(vm.cycles()) / static_cast<double>(executed) : 0.0);
+    for (std::size_t i = 0; i < mix.size(); i++) {
+        if (mix[i] != 0) {
+            const auto instruction = static_cast<Instruction>(i);
+            // a faulting instruction stopped short, its count uses the full sequence
+            fmt::print(stderr, "  {:<8} {:>12} x {} cycles\n", InstructionToString(instruction), mix[i], MicrocodeTable.cycles(instruction));
+        }
     }
+    return result;
+}
 
-    Marie vm(data.data(), data.size());
-    Word result = vm.run();
+template <typename Traits>
+typename Traits::Word runProfiled(BasicMarie<Traits>& vm, const Profiler::Options& options)
+{
+    using Word = typename Traits::Word;
+    const std::span<const Word> memory = vm.memory();
+    Profiler::Target target {
+        .memory = std::as_bytes(memory),
+        .wordBytes = sizeof(Word),
+        .subroutines = Profiler::findSubroutines<Traits>(memory),
+        .sourceMap = vm.sourceMap(),
+    };
 
+    std::atomic<u32> pc { static_cast<u32>(vm.pc()) };
+    Perf::Phase phase("Marie::run");
+    Profiler::Session session(options, std::move(target), pc);
+    const Word result = vm.runSampled(pc);
+    session.finish();
+    phase.setWork(vm.retired(), "guest instruction");
+    phase.setBytes(vm.imageSize() * sizeof(Word));
+    Metrics::add(Metrics::Retired, vm.retired());
+    if (!vm.faulted()) {
+        Metrics::add(Metrics::Halts);
+    }
     return result;
 }
 
-Word marieExecuteVec(const std::vector<Word>& program)
+// attaches what options ask for and runs vm, the device and logs live as long as the run
+template <typename Traits>
+typename Traits::Word runWithOptions(BasicMarie<Traits>& vm, const ExecOptions& options)
 {
-    Marie vm(program.data(), program.size());
-    Word result = vm.run();
+    using Word = typename Traits::Word;
+    constexpr unsigned WordBits = sizeof(Word) * 8;
 
+    std::optional<BlockDevice> device;
+    if (options.blockDevice != nullptr) {
+        vm.attachBlockDevice(device.emplace(options.blockDevice));
+    }
+
+    std::optional<InputRecorder> recorder;
+    std::optional<InputReplay> replay;
+    if (options.replayInput != nullptr) {
+        replay.emplace(options.replayInput, WordBits);
+        vm.setInputSource([&]() -> std::optional<Word> {
+            return static_cast<Word>(replay->next(vm.retired()));
+        });
+    } else if (options.recordInput != nullptr) {
+        recorder.emplace(options.recordInput, WordBits);
+        vm.setInputSource([&]() -> std::optional<Word> {
+            const Word value = BasicMarie<Traits>::userInputHex();
+            recorder->record(vm.retired(), value);
+            return value;
+        });
+    }
+
+    if (options.cycleAccurate) {
+        return runCycleAccurate(vm);
+    }
+    if (options.profile.report != nullptr) {
+        return runProfiled(vm, options.profile);
+    }
+
+    Perf::Phase phase("Marie::run");
+    Word result {};
+    if (Metrics::enabled()) {
+        // slices let the exporter see the progress of a long run
+        u64 counted = 0;
+        while (vm.runSlice(Metrics::SliceInstructions) != BasicMarie<Traits>::State::Halted) {
+            Metrics::add(Metrics::Retired, vm.retired() - counted);
+            counted = vm.retired();
+        }
+        Metrics::add(Metrics::Retired, vm.retired() - counted);
+        if (!vm.faulted()) {
+            Metrics::add(Metrics::Halts);
+        }
+        result = vm.accumulator();
+    } else {
+        result = vm.run();
+    }
+    phase.setWork(vm.retired(), "guest instruction");
+    phase.setBytes(vm.imageSize() * sizeof(Word));
+
+    if (replay && replay->remaining() != 0) {
+        LOGW("the run halted with {} recorded inputs left", replay->remaining());
+    }
     return result;
 }
+
+} // anonymous namespace
+
+template <typename Traits>
+std::vector<typename Traits::Word> marieLoadImage(const char* file)
+{
+    std::vector<char> bytes = fileToVector<char>(file);
+    if (isContainerImage(bytes)) {
+        ContainerImage<typename Traits::Word> image(std::move(bytes));
+        std::vector<typename Traits::Word> data(image.imageWords());
+        image.decompressInto(data);
+        return data;
+    }
+
+    return wordsFromDump<typename Traits::Word>(bytes);
+}
+
+template <typename Traits>
+typename Traits::Word marieExecute(const char* inputFile, const ExecOptions& options)
+{
+    std::vector<char> bytes = fileToVector<char>(inputFile);
+    std::optional<BasicMarie<Traits>> vm;
+    if (isContainerImage(bytes)) {
+        vm.emplace(ContainerImage<typename Traits::Word>(std::move(bytes)));
+    } else {
+        std::vector<typename Traits::Word> data = wordsFromDump<typename Traits::Word>(bytes);
+        vm.emplace(data.data(), data.size());
+    }
+
+    // a map written by assemble --source-map next to the image names fault locations
+    std::unique_ptr<SourceMap> sourceMap = SourceMap::openFor(inputFile, vm->memory());
+    vm->setSourceMap(sourceMap.get());
+
+    return runWithOptions(*vm, options);
+}
+
+template <typename Traits>
+typename Traits::Word marieExecuteVec(const std::vector<typename Traits::Word>& program, const ExecOptions& options)
+{
+    BasicMarie<Traits> vm(program.data(), program.size());
+    return runWithOptions(vm, options);
+}
+
+template std::vector<Marie16::Word> marieLoadImage<Marie16>(const char* file);
+template std::vector<Marie32::Word> marieLoadImage<Marie32>(const char* file);
+template Marie16::Word marieExecute<Marie16>(const char* file, const ExecOptions& options);
+template Marie32::Word marieExecute<Marie32>(const char* file, const ExecOptions& options);
+template Marie16::Word marieExecuteVec<Marie16>(const std::vector<Marie16::Word>& program, const ExecOptions& options);
+template Marie32::Word marieExecuteVec<Marie32>(const std::vector<Marie32::Word>& program, const ExecOptions& options);
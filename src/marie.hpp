@@ -1,4 +1,299 @@
 #pragma once
 
-Word marieExecute(const char* file);
-Word marieExecuteVec(const std::vector<Word>& program);
+#include "blockdevice.hpp"
+#include "image.hpp"
+#include "inputlog.hpp"
+#include "instructions.hpp"
+#include "microcode.hpp"
+#include "profiler.hpp"
+#include "sourcemap.hpp"
+
+// How the harts of a multi-hart machine see each other's plain Load and Store.
+// Relaxed only guarantees every word has a single order of writes, FAdd and Cas
+// then acquire and release. SequentiallyConsistent orders every access.
+enum struct MemoryOrder {
+    Relaxed,
+    SequentiallyConsistent,
+};
+
+template <typename Traits>
+struct BasicMarie {
+    using Word = typename Traits::Word;
+
+    BasicMarie(const Word* image, size_t imageSize)
+        requires(!Traits::Shared);
+    // decompresses the container straight into VM memory and starts at its entry point
+    explicit BasicMarie(const ContainerImage<Word>& image)
+        requires(!Traits::Shared);
+    // A hart with its own AC and PC working on memory shared with the other
+    // harts, which must outlive it. Fetches read memory every time so harts see
+    // code the others write.
+    BasicMarie(std::span<Word> sharedMemory, size_t imageSize, Word hartId, MemoryOrder order)
+        requires(Traits::Shared);
+
+    enum struct State {
+        Running,
+        Halted,
+        WaitingInput,
+    };
+
+    // Input returns std::nullopt when no value is ready yet, the Input
+    // instruction is then retried on the next runSlice.
+    using InputSource = std::function<std::optional<Word>()>;
+    using OutputSink = std::function<void(Word)>;
+
+    // runs from the entry point until Halt, an InputSource returning std::nullopt is polled until it has a value
+    Word run();
+    // Runs like runSlice, but one register transfer of microcode.hpp per clock
+    // cycle through MAR, MBR, IR, InREG and OutREG. An access outside of memory
+    // ends its instruction at the faulting transfer and halts.
+    State runMicrocode(u64 maxInstructions = std::numeric_limits<u64>::max())
+        requires(!Traits::Shared);
+    // run that stores the PC of each instruction to publishedPc before running it, for Profiler
+    Word runSampled(std::atomic<u32>& publishedPc)
+        requires(!Traits::Shared);
+    // runs at most maxInstructions and returns why it stopped, resumes where the last slice left off
+    State runSlice(u64 maxInstructions);
+    static std::pair<Instruction, Word> decode(Word instr);
+    void execInstr(std::pair<Instruction, Word>& instr);
+
+    // without an input source or output sink Input reads stdin and Output prints to stdout
+    [[nodiscard]] static Word userInputHex();
+    void setInputSource(InputSource source) { mInputSource = std::move(source); }
+    void setOutputSink(OutputSink sink) { mOutputSink = std::move(sink); }
+
+    // stops run and runSlice before the next instruction, e.g. from an output sink
+    void halt() { mHalt = true; }
+
+    // continues a machine stopped elsewhere, e.g. by prerun at compile time, run and runSlice then start at pc
+    void resumeAt(Word pc, Word accumulator, bool skipNext);
+
+    // fault messages name the source line of the faulting instruction, the map must outlive the VM
+    void setSourceMap(const SourceMap* map) { mSourceMap = map; }
+    [[nodiscard]] const SourceMap* sourceMap() const { return mSourceMap; }
+
+    // maps the device's control registers at MmioBase, the device must outlive the VM
+    void attachBlockDevice(BlockDevice& device)
+        requires(!Traits::Shared);
+
+    // Breakpoints and watchpoints are flags per address. A fetch only looks
+    // at them for a flagged address, which never enters the decode cache, and
+    // loads and stores test one bit of a shadow bitmap, so the code between
+    // them runs at full speed. Use debugRun and debugStep, not run.
+    struct AcCondition {
+        enum struct Compare {
+            Equal,
+            NotEqual,
+            Less,
+            Greater,
+        };
+        Compare compare = Compare::Equal;
+        Word value {}; // compared signed, like Skipcond
+    };
+    enum struct Watch : u8 {
+        Read = 1,
+        Write = 2,
+        Access = 3,
+    };
+    struct DebugStop {
+        enum struct Reason {
+            Halted,
+            Step,
+            Breakpoint,
+            WatchRead,
+            WatchWrite,
+        };
+        Reason reason = Reason::Halted;
+        Word address {}; // of the breakpoint or the watched word
+    };
+
+    // a conditional breakpoint stops when AC before the instruction matches
+    void setBreakpoint(Word address, std::optional<AcCondition> condition = std::nullopt)
+        requires(!Traits::Shared);
+    void setWatchpoint(Word address, Watch kind)
+        requires(!Traits::Shared);
+    // removes the breakpoint and watchpoint on address
+    void clearDebugFlags(Word address)
+        requires(!Traits::Shared);
+    // Runs until Halt, before the instruction at a breakpoint or after the
+    // instruction that touched a watched word. Resuming from a breakpoint
+    // runs its instruction first.
+    DebugStop debugRun()
+        requires(!Traits::Shared);
+    // runs one instruction, breakpoints do not stop it but watchpoints are reported
+    DebugStop debugStep()
+        requires(!Traits::Shared);
+    // the loaded words, the span stays valid for the life of the VM
+    [[nodiscard]] std::span<const Word> memory() const
+        requires(!Traits::Shared)
+    {
+        return { mMemory.data(), mImageSize };
+    }
+    // memory as the guest sees it, without triggering watchpoints
+    [[nodiscard]] Word peek(Word address) const
+        requires(!Traits::Shared);
+
+    // Fuzzing keeps one VM per thread: snapshot copies memory and registers
+    // once, resetToSnapshot then restores only the words stored to since,
+    // found through a dirty bitmap kept on the store path.
+    void snapshot()
+        requires(!Traits::Shared);
+    void resetToSnapshot()
+        requires(!Traits::Shared);
+    // runSlice that also sets a bit per control flow edge taken, edges.size() must be a power of two
+    State runCovered(u64 maxInstructions, std::span<u64> edges)
+        requires(!Traits::Shared);
+    // keeps fault and invalid instruction messages off stdout
+    void setQuiet(bool quiet) { mQuiet = quiet; }
+
+    [[nodiscard]] Word pc() const { return mPC; }
+    [[nodiscard]] Word accumulator() const { return mAC; }
+    [[nodiscard]] u64 retired() const { return mRetired; }
+    // clock cycles and instructions executed per Instruction by runMicrocode, skipped ones run no cycles
+    [[nodiscard]] u64 cycles() const { return mCycles; }
+    [[nodiscard]] const std::array<u64, InstructionCount>& instructionMix() const { return mInstructionMix; }
+    [[nodiscard]] std::size_t imageSize() const { return mImageSize; }
+    // set when an access outside of memory halted the VM
+    [[nodiscard]] bool faulted() const { return mFaulted; }
+
+    // counters for the self-modifying code write barrier
+    struct CodeWriteStats {
+        u64 decodes {}; // words decoded into the instruction cache
+        u64 codeStores {}; // stores that hit an address executed before
+        u64 invalidations {}; // code stores that changed the word and dropped its decoded entry
+    };
+    [[nodiscard]] const CodeWriteStats& codeWriteStats() const { return mCodeWriteStats; }
+
+    struct AtomicStats {
+        u64 fetchAdds {};
+        u64 compareSwaps {};
+        u64 compareSwapFailures {}; // Cas that found a non zero word, a measure of contention
+    };
+    [[nodiscard]] const AtomicStats& atomicStats() const { return mAtomicStats; }
+
+private:
+    static constexpr std::size_t MaxMemory = Traits::MaxMemory;
+
+    template <typename T, std::size_t Size>
+    using Storage = std::conditional_t<Traits::InlineMemory, std::array<T, Size>, std::vector<T>>;
+
+    Storage<Word, MaxMemory> mMemory {};
+    std::size_t mImageSize {};
+    Word mEntryPoint {};
+
+    // Every word fetched as an instruction is decoded once into mDecoded and its
+    // bit is set in mCodeBitmap, one u64 per 64 word page. A set bit means the
+    // decoded entry is valid, stores only have to look further when the page
+    // they hit holds code, so programs that never modify themselves pay one
+    // load and compare per store.
+    static constexpr std::size_t PageShift = 6;
+    static constexpr std::size_t PageMask = (1U << PageShift) - 1;
+    Storage<u64, MaxMemory / 64> mCodeBitmap {};
+    Storage<std::pair<Instruction, Word>, MaxMemory> mDecoded {};
+    CodeWriteStats mCodeWriteStats {};
+
+    const SourceMap* mSourceMap = nullptr;
+
+    enum DebugFlag : u8 {
+        BreakAlways = 1,
+        BreakConditional = 2,
+        BreakFlags = BreakAlways | BreakConditional,
+        WatchRead = static_cast<u8>(Watch::Read) << 2,
+        WatchWrite = static_cast<u8>(Watch::Write) << 2,
+    };
+    // a bit per word stored to since the snapshot, and a bit per page of it with any set
+    std::vector<u64> mDirtyBitmap;
+    std::vector<u64> mDirtyPages;
+    bool mTrackDirty = false;
+    struct Snapshot {
+        std::vector<Word> memory;
+        Word ac {};
+        Word pc {};
+        bool skipNext = false;
+    } mSnapshot;
+    // hash of the last location runCovered saw, halved like AFL so A->B and B->A differ
+    u32 mPreviousLocation {};
+    bool mQuiet = false;
+
+    // DebugFlag bits per word, sized on the first breakpoint or watchpoint
+    std::vector<u8> mDebugFlags;
+    std::unordered_map<Word, AcCondition> mBreakConditions;
+    // a bit per word with a watchpoint, laid out like mCodeBitmap
+    std::vector<u64> mWatchBitmap;
+    bool mWatching = false;
+    std::optional<DebugStop> mDebugStop;
+    // a breakpoint that lets its instruction run once, when resuming from it or stepping
+    std::size_t mPassBreakpoint = std::numeric_limits<std::size_t>::max();
+
+    BlockDevice* mDevice = nullptr;
+    std::array<Word, static_cast<std::size_t>(BlockRegister::RegisterCount)> mDeviceRegisters {};
+
+    Word* mShared = nullptr;
+    Word mHartId {};
+    MemoryOrder mOrder = MemoryOrder::Relaxed;
+    AtomicStats mAtomicStats {};
+
+    Word mAC {}; // Accumulator
+    Word mMAR {}; // Memory Address Register
+    Word mMBR {}; // Memory Buffer Register
+    Word mPC {}; // Program Counter
+    Word mIR {}; // Instruction Register (holds the next expression to be executed)
+    Word mInREG {}; //  Input Register (holds data from the input device)
+    Word mOutREG {}; // Output Register (holds data for the output device)
+    // only runMicrocode uses the registers above the PC and these
+    u64 mCycles {};
+    std::array<u64, InstructionCount> mInstructionMix {};
+
+    bool mSkipNext = false;
+    // bool errors = false;
+    bool mHalt = false;
+    bool mWaitingInput = false;
+    bool mFaulted = false;
+    u64 mRetired {}; // instructions executed, skipped ones included
+
+    InputSource mInputSource;
+    OutputSink mOutputSink;
+
+    [[nodiscard]] std::pair<Instruction, Word> fetch(const Word address);
+    [[nodiscard]] Word memoryAtAddress(const Word address);
+    void storeAtAddress(const Word address, const Word value);
+    void invalidateCode(const Word address, const Word value);
+    void allocateMemory();
+    [[nodiscard]] Word mmioLoad(const Word address) const;
+    void mmioStore(const Word address, const Word value);
+    [[nodiscard]] BlockStatus blockTransfer(Word command);
+    [[nodiscard]] Word fetchAdd(const Word address);
+    [[nodiscard]] Word compareSwap(const Word address);
+    [[nodiscard]] std::memory_order plainOrder() const;
+    [[nodiscard]] std::memory_order atomicOrder() const;
+    [[nodiscard]] bool skipCond(Word condition) const;
+    void fault();
+    void allocateDebugFlags();
+    void breakpointFetched(const Word address);
+    void watchedAccess(const Word address, Watch kind);
+    void resumeDebugging();
+    void markDirty(const Word address);
+};
+
+using Marie = BasicMarie<Marie16>;
+
+// reads a container image, or a legacy big endian word dump, from disk
+template <typename Traits = Marie16>
+std::vector<typename Traits::Word> marieLoadImage(const char* file);
+struct ExecOptions {
+    // a file to attach as the VM's block device
+    const char* blockDevice = nullptr;
+    // write every value Input reads from stdin to this log, see inputlog.hpp
+    const char* recordInput = nullptr;
+    // feed Input from a log instead of stdin
+    const char* replayInput = nullptr;
+    // run with runMicrocode and print the cycle counts to stderr
+    bool cycleAccurate = false;
+    // sample the run and write a profile when profile.report is set
+    Profiler::Options profile;
+};
+
+template <typename Traits = Marie16>
+typename Traits::Word marieExecute(const char* file, const ExecOptions& options = {});
+template <typename Traits = Marie16>
+typename Traits::Word marieExecuteVec(const std::vector<typename Traits::Word>& program, const ExecOptions& options = {});
@@ -0,0 +1,279 @@
+#include "memo.hpp"
+
+#include "file.hpp"
+
+namespace {
+
+constexpr std::array<char, 4> Magic { 'M', 'R', 'M', 'O' };
+constexpr u16 Version = 2;
+
+// key and result header of a cache file, stored in host byte order
+struct FileHeader {
+    std::array<char, 4> magic;
+    u16 version;
+    u16 wordBits;
+    u64 image;
+    u64 input;
+    u64 imageWords;
+    u64 entryPoint;
+    u64 accumulator;
+    u64 retired;
+    u64 outputs;
+};
+
+u64 mix(u64 value)
+{
+    value ^= value >> 30;
+    value *= 0xBF58476D1CE4E5B9U;
+    value ^= value >> 27;
+    value *= 0x94D049BB133111EBU;
+    return value ^ (value >> 31);
+}
+
+// eight bytes per step, only needs to tell runs apart, not resist attacks
+u64 hashBytes(const char* data, std::size_t size)
+{
+    u64 hash = 0x9E3779B97F4A7C15U ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 block {};
+        std::memcpy(&block, data + i, 8);
+        hash = std::rotl(hash ^ mix(block), 29) * 0x9E3779B97F4A7C15U;
+    }
+    u64 tail {};
+    std::memcpy(&tail, data + i, size - i);
+    return mix(hash ^ mix(tail ^ (size - i)));
+}
+
+} // anonymous namespace
+
+template <typename Traits>
+RunMemo<Traits>::RunMemo(std::size_t capacity, std::filesystem::path directory)
+    : mCapacity(std::max<std::size_t>(capacity, 1))
+    , mDirectory(std::move(directory))
+{
+}
+
+template <typename Traits>
+bool RunMemo<Traits>::mayReadInput(std::span<const Word> image)
+{
+    return std::any_of(image.begin(), image.end(), [](Word word) {
+        return Traits::decode(word).first == Instruction::Input;
+    });
+}
+
+template <typename Traits>
+auto RunMemo<Traits>::execute(const std::vector<Word>& image, Word entryPoint, std::string_view input) -> Result
+{
+    const bool readsInput = mayReadInput(image);
+    const Key key {
+        .image = hashBytes(reinterpret_cast<const char*>(image.data()), image.size() * sizeof(Word)),
+        .input = readsInput ? hashBytes(input.data(), input.size()) : 0,
+        .imageWords = image.size(),
+        .entryPoint = entryPoint,
+    };
+
+    if (const Result* cached = find(key)) {
+        mStats.hits++;
+        for (Word value : cached->output) {
+            fmt::print("{:x}\n", value);
+        }
+        return *cached;
+    }
+
+    mStats.misses++;
+    Result result;
+    bool unpredictedInput = false;
+
+    BasicMarie<Traits> vm(image.data(), image.size());
+    // starts where a VM built from the container would
+    vm.resumeAt(entryPoint, 0, false);
+    vm.setInputSource([&]() -> std::optional<Word> {
+        if (!readsInput) {
+            // only self-modifying code gets here, read stdin like the VM would and keep the result out of the cache
+            unpredictedInput = true;
+            std::string text;
+            std::getline(std::cin, text);
+            Word value {};
+            std::from_chars(text.data(), text.data() + text.size(), value, 16);
+            return value;
+        }
+        const std::size_t end = std::min(input.find('\n'), input.size());
+        std::string_view line = input.substr(0, end);
+        input.remove_prefix(std::min(end + 1, input.size()));
+
+        // an exhausted input reads 0 like the end of stdin
+        Word value {};
+        std::from_chars(line.data(), line.data() + line.size(), value, 16);
+        return value;
+    });
+    vm.setOutputSink([&result](Word value) {
+        result.output.push_back(value);
+        fmt::print("{:x}\n", value);
+    });
+
+    result.accumulator = vm.run();
+    result.retired = vm.retired();
+
+    if (unpredictedInput) {
+        mStats.rejected++;
+        LOGW("the image executed an Input it did not contain, not caching this run");
+        return result;
+    }
+    if (vm.faulted()) {
+        // the fault message is printed by the VM and would be missing from a replay
+        mStats.rejected++;
+        return result;
+    }
+
+    store(key, result);
+    insert(key, result);
+    return result;
+}
+
+template <typename Traits>
+auto RunMemo<Traits>::find(const Key& key) -> const Result*
+{
+    if (auto entry = mEntries.find(key); entry != mEntries.end()) {
+        mRecent.splice(mRecent.begin(), mRecent, entry->second);
+        return &entry->second->second;
+    }
+
+    std::optional<Result> loaded = load(key);
+    if (!loaded) {
+        return nullptr;
+    }
+    mStats.diskHits++;
+    insert(key, std::move(*loaded));
+    return &mRecent.front().second;
+}
+
+template <typename Traits>
+void RunMemo<Traits>::insert(const Key& key, Result result)
+{
+    if (auto entry = mEntries.find(key); entry != mEntries.end()) {
+        mRecent.erase(entry->second);
+        mEntries.erase(entry);
+    }
+    mRecent.emplace_front(key, std::move(result));
+    mEntries[key] = mRecent.begin();
+
+    if (mRecent.size() > mCapacity) {
+        mEntries.erase(mRecent.back().first);
+        mRecent.pop_back();
+    }
+}
+
+template <typename Traits>
+std::filesystem::path RunMemo<Traits>::pathFor(const Key& key) const
+{
+    return mDirectory / fmt::format("{:016x}-{:016x}-{:x}-{}.memo", key.image, key.input, key.entryPoint, sizeof(Word) * 8);
+}
+
+template <typename Traits>
+auto RunMemo<Traits>::load(const Key& key) const -> std::optional<Result>
+{
+    if (mDirectory.empty()) {
+        return std::nullopt;
+    }
+    const std::filesystem::path path = pathFor(key);
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) {
+        return std::nullopt;
+    }
+
+    std::vector<char> bytes = fileToVector<char>(path.c_str());
+    FileHeader header {};
+    if (bytes.size() < sizeof(header)) {
+        LOGW("ignoring truncated memo file {}", path.string());
+        return std::nullopt;
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+
+    // the file name only holds the hashes, everything else has to match too
+    if (header.magic != Magic || header.version != Version || header.wordBits != sizeof(Word) * 8
+        || header.image != key.image || header.input != key.input || header.imageWords != key.imageWords || header.entryPoint != key.entryPoint
+        || header.outputs != (bytes.size() - sizeof(header)) / sizeof(Word)) {
+        LOGW("ignoring memo file {} that does not match its key", path.string());
+        return std::nullopt;
+    }
+
+    Result result {
+        .accumulator = static_cast<Word>(header.accumulator),
+        .retired = header.retired,
+        .output = std::vector<Word>(header.outputs),
+    };
+    std::memcpy(result.output.data(), bytes.data() + sizeof(header), result.output.size() * sizeof(Word));
+    return result;
+}
+
+template <typename Traits>
+void RunMemo<Traits>::store(const Key& key, const Result& result) const
+{
+    if (mDirectory.empty()) {
+        return;
+    }
+
+    FileHeader header {
+        .magic = Magic,
+        .version = Version,
+        .wordBits = sizeof(Word) * 8,
+        .image = key.image,
+        .input = key.input,
+        .imageWords = key.imageWords,
+        .entryPoint = key.entryPoint,
+        .accumulator = result.accumulator,
+        .retired = result.retired,
+        .outputs = result.output.size(),
+    };
+    std::vector<char> bytes(sizeof(header) + result.output.size() * sizeof(Word));
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    std::memcpy(bytes.data() + sizeof(header), result.output.data(), result.output.size() * sizeof(Word));
+
+    // write then rename so concurrent runs never read a partial file
+    const std::filesystem::path path = pathFor(key);
+    std::filesystem::path temporary = path;
+    temporary += fmt::format(".{}.tmp", std::hash<std::thread::id> {}(std::this_thread::get_id()));
+    std::error_code error;
+    std::filesystem::create_directories(mDirectory, error);
+    dataToFile(temporary.c_str(), std::span(bytes));
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        LOGW("could not store memo file {}: {}", path.string(), error.message());
+        std::filesystem::remove(temporary, error);
+    }
+}
+
+template <typename Traits>
+typename Traits::Word marieExecuteMemoized(const char* file, const char* directory)
+{
+    using Word = typename Traits::Word;
+
+    // read like marieExecute, a container image starts at its entry point
+    std::vector<char> bytes = fileToVector<char>(file);
+    std::vector<Word> image;
+    Word entryPoint {};
+    if (isContainerImage(bytes)) {
+        ContainerImage<Word> container(std::move(bytes));
+        image.resize(container.imageWords());
+        container.decompressInto(image);
+        entryPoint = static_cast<Word>(container.entryPoint());
+    } else {
+        image = marieLoadImage<Traits>(file);
+    }
+
+    std::string input;
+    if (RunMemo<Traits>::mayReadInput(image)) {
+        input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+
+    RunMemo<Traits> memo(1, directory);
+    auto result = memo.execute(image, entryPoint, input);
+    LOGD("memo: {} hits, {} from disk, {} misses", memo.stats().hits, memo.stats().diskHits, memo.stats().misses);
+    return result.accumulator;
+}
+
+template struct RunMemo<Marie16>;
+template struct RunMemo<Marie32>;
+template Marie16::Word marieExecuteMemoized<Marie16>(const char* file, const char* directory);
+template Marie32::Word marieExecuteMemoized<Marie32>(const char* file, const char* directory);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "marie.hpp"
+
+// Memoizes complete runs of an image. A run only depends on the image, its
+// entry point and what Input reads, so the key is a hash of the image words,
+// the entry point and, for images that contain an Input instruction, a hash
+// of the whole input text which is then read up front. Results live in an
+// in-memory LRU for callers that keep one RunMemo across runs and, when a
+// directory is given, in one file per key so they outlive the process.
+template <typename Traits>
+struct RunMemo {
+    using Word = typename Traits::Word;
+
+    struct Result {
+        Word accumulator {};
+        u64 retired {};
+        std::vector<Word> output;
+    };
+
+    struct Stats {
+        u64 hits {};
+        u64 diskHits {};
+        u64 misses {};
+        u64 rejected {}; // runs left uncached, an unpredicted Input or a memory fault
+    };
+
+    explicit RunMemo(std::size_t capacity, std::filesystem::path directory = {});
+
+    // false when no word of the image decodes to Input, the input text is then not part of the key
+    [[nodiscard]] static bool mayReadInput(std::span<const Word> image);
+
+    // Returns the cached result, or runs the image with Input reading lines of
+    // input like stdin and caches the result. Output is printed as it would be
+    // by Marie::run in both cases.
+    Result execute(const std::vector<Word>& image, Word entryPoint, std::string_view input);
+
+    [[nodiscard]] const Stats& stats() const { return mStats; }
+
+private:
+    struct Key {
+        u64 image {};
+        u64 input {};
+        std::size_t imageWords {};
+        Word entryPoint {};
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const { return key.image ^ (key.input * 0x9E3779B97F4A7C15U) ^ key.entryPoint; }
+    };
+
+    using Entry = std::pair<Key, Result>;
+
+    std::size_t mCapacity;
+    std::filesystem::path mDirectory;
+    std::list<Entry> mRecent; // most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator, KeyHash> mEntries;
+    Stats mStats {};
+
+    [[nodiscard]] const Result* find(const Key& key);
+    void insert(const Key& key, Result result);
+    [[nodiscard]] std::optional<Result> load(const Key& key) const;
+    void store(const Key& key, const Result& result) const;
+    [[nodiscard]] std::filesystem::path pathFor(const Key& key) const;
+};
+
+// exec-bin with memoization, results persist in directory. Each process runs
+// one image once, so only the files in directory ever hit, not the LRU.
+template <typename Traits = Marie16>
+typename Traits::Word marieExecuteMemoized(const char* file, const char* directory);
@@ -0,0 +1,244 @@
+#include "metrics.hpp"
+
+#include <csignal>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+using Metrics::CounterCount;
+using Metrics::GaugeCount;
+
+// only its thread writes a shard, so plain loads and stores of the atomics are enough
+struct alignas(64) Shard {
+    std::array<std::atomic<u64>, CounterCount> counters {};
+    Shard* next = nullptr;
+};
+
+// shards are never freed, a thread that exited still counts towards the totals
+std::atomic<Shard*> shards { nullptr };
+
+Shard& localShard()
+{
+    thread_local Shard* shard = [] {
+        auto* created = new Shard;
+        created->next = shards.load(std::memory_order_relaxed);
+        while (!shards.compare_exchange_weak(created->next, created, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        return created;
+    }();
+    return *shard;
+}
+
+std::array<u64, CounterCount> totals()
+{
+    std::array<u64, CounterCount> sum {};
+    for (Shard* shard = shards.load(std::memory_order_acquire); shard != nullptr; shard = shard->next) {
+        for (std::size_t i = 0; i < CounterCount; i++) {
+            sum[i] += shard->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+struct Description {
+    const char* name;
+    const char* type;
+    const char* help;
+};
+
+constexpr std::array<Description, CounterCount> CounterDescriptions { {
+    { "marie_instructions_retired_total", "counter", "Guest instructions executed, skipped ones included." },
+    { "marie_halts_total", "counter", "Runs that ended with Halt or by running past the image." },
+    { "marie_out_of_bounds_total", "counter", "Loads and stores outside of memory, each halts its VM." },
+    { "marie_invalid_opcodes_total", "counter", "Words executed that decode to no instruction." },
+    { "marie_input_values_total", "counter", "Values read by Input." },
+    { "marie_output_values_total", "counter", "Values written by Output." },
+} };
+
+constexpr std::array<Description, GaugeCount> GaugeDescriptions { {
+    { "marie_run_queue_depth", "gauge", "Scheduler VMs ready to run." },
+    { "marie_parked_vms", "gauge", "Scheduler VMs waiting for input." },
+} };
+
+struct State {
+    std::atomic<bool> enabled { false };
+    std::array<std::atomic<u64>, GaugeCount> gauges {};
+    Metrics::ExportOptions options;
+    // the signal handler and shutdown wake the export thread through this pipe
+    std::array<int, 2> wakeup { -1, -1 };
+    std::jthread exporter;
+
+    // instructions per second between the last two exports
+    std::mutex rateLock;
+    u64 lastRetired {};
+    std::chrono::steady_clock::time_point lastExport;
+    double instructionsPerSecond {};
+};
+
+State& state()
+{
+    static State instance;
+    return instance;
+}
+
+constexpr char DumpRequest = 'd';
+constexpr char StopRequest = 'q';
+
+void requestDump(int /*signal*/)
+{
+    // write is async signal safe, the export thread does the formatting
+    const char request = DumpRequest;
+    (void)!write(state().wakeup[1], &request, 1);
+}
+
+void updateRate()
+{
+    State& metrics = state();
+    std::lock_guard guard(metrics.rateLock);
+    const auto now = std::chrono::steady_clock::now();
+    const u64 retired = totals()[Metrics::Retired];
+    const double seconds = std::chrono::duration<double>(now - metrics.lastExport).count();
+    if (seconds > 0.0) {
+        metrics.instructionsPerSecond = static_cast<double>(retired - metrics.lastRetired) / seconds;
+    }
+    metrics.lastRetired = retired;
+    metrics.lastExport = now;
+}
+
+void writeTextfile(const char* path)
+{
+    const std::string temporary = fmt::format("{}.tmp", path);
+    {
+        std::ofstream file(temporary, std::ios::out | std::ios::trunc);
+        file << Metrics::prometheusText();
+        if (!file) {
+            LOGW("could not write metrics to {}", temporary);
+            return;
+        }
+    }
+    // a rename replaces the file in one step, the node exporter never reads half of it
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        LOGW("could not replace {}: {}", path, error.message());
+    }
+}
+
+void exportLoop(State& metrics)
+{
+    const int timeout = static_cast<int>(metrics.options.interval.count());
+    while (true) {
+        pollfd fd { .fd = metrics.wakeup[0], .events = POLLIN, .revents = 0 };
+        const int ready = poll(&fd, 1, timeout);
+        char request = 0;
+        if (ready > 0 && read(metrics.wakeup[0], &request, 1) != 1) {
+            request = 0;
+        }
+        if (request == StopRequest) {
+            return;
+        }
+        if (request == DumpRequest) {
+            fmt::print(stderr, "{}", Metrics::prometheusText());
+            continue;
+        }
+        if (ready == 0) {
+            updateRate();
+            if (metrics.options.textfile != nullptr) {
+                writeTextfile(metrics.options.textfile);
+            }
+        }
+    }
+}
+
+} // anonymous namespace
+
+namespace Metrics {
+
+void enable(const ExportOptions& options)
+{
+    State& metrics = state();
+    if (metrics.enabled.exchange(true)) {
+        return;
+    }
+    metrics.options = options;
+    metrics.lastExport = std::chrono::steady_clock::now();
+    if (pipe(metrics.wakeup.data()) == -1) {
+        throw std::runtime_error(fmt::format("cannot create the metrics pipe: {}", std::strerror(errno)));
+    }
+
+    struct sigaction action {};
+    action.sa_handler = requestDump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+
+    metrics.exporter = std::jthread([&metrics] { exportLoop(metrics); });
+    LOGD("metrics enabled, kill -USR1 {} dumps them", getpid());
+}
+
+bool enabled()
+{
+    return state().enabled.load(std::memory_order_relaxed);
+}
+
+void shutdown()
+{
+    State& metrics = state();
+    if (!metrics.enabled || !metrics.exporter.joinable()) {
+        return;
+    }
+    const char request = StopRequest;
+    (void)!write(metrics.wakeup[1], &request, 1);
+    metrics.exporter.join();
+
+    signal(SIGUSR1, SIG_DFL);
+    updateRate();
+    if (metrics.options.textfile != nullptr) {
+        writeTextfile(metrics.options.textfile);
+    }
+}
+
+void add(Counter counter, u64 amount)
+{
+    if (!enabled()) {
+        return;
+    }
+    std::atomic<u64>& value = localShard().counters[counter];
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void setGauge(Gauge gauge, u64 value)
+{
+    if (enabled()) {
+        state().gauges[gauge].store(value, std::memory_order_relaxed);
+    }
+}
+
+std::string prometheusText()
+{
+    State& metrics = state();
+    const auto counters = totals();
+    std::string text;
+    for (std::size_t i = 0; i < CounterCount; i++) {
+        const Description& metric = CounterDescriptions[i];
+        text += fmt::format("# HELP {0} {1}\n# TYPE {0} {2}\n{0} {3}\n", metric.name, metric.help, metric.type, counters[i]);
+    }
+    for (std::size_t i = 0; i < GaugeCount; i++) {
+        const Description& metric = GaugeDescriptions[i];
+        text += fmt::format("# HELP {0} {1}\n# TYPE {0} {2}\n{0} {3}\n", metric.name, metric.help, metric.type, metrics.gauges[i].load(std::memory_order_relaxed));
+    }
+
+    double instructionsPerSecond {};
+    {
+        std::lock_guard guard(metrics.rateLock);
+        instructionsPerSecond = metrics.instructionsPerSecond;
+    }
+    text += fmt::format("# HELP marie_instructions_per_second Guest instructions retired per second over the last export interval.\n"
+                        "# TYPE marie_instructions_per_second gauge\n"
+                        "marie_instructions_per_second {:.0f}\n",
+        instructionsPerSecond);
+    return text;
+}
+
+} // namespace Metrics
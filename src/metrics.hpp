@@ -0,0 +1,47 @@
+#pragma once
+
+// Process wide counters for long and batch runs. Each thread adds to its own
+// cache line sized shard, readers sum the shards without taking a lock. When
+// enabled, SIGUSR1 dumps them to stderr and a textfile for the Prometheus
+// node exporter is rewritten every interval.
+namespace Metrics {
+
+enum Counter : std::size_t {
+    Retired,
+    Halts,
+    OutOfBounds, // loads and stores outside of memory
+    InvalidOpcodes,
+    InputValues,
+    OutputValues,
+    CounterCount,
+};
+
+enum Gauge : std::size_t {
+    RunQueueDepth, // scheduler VMs ready to run
+    ParkedVms, // scheduler VMs waiting for input
+    GaugeCount,
+};
+
+struct ExportOptions {
+    // written to a temporary file and renamed over this one, nullptr only enables the SIGUSR1 dump
+    const char* textfile = nullptr;
+    std::chrono::milliseconds interval { 5000 };
+};
+
+// starts the export thread and installs the SIGUSR1 handler
+void enable(const ExportOptions& options);
+[[nodiscard]] bool enabled();
+// writes the textfile one last time and stops the export thread
+void shutdown();
+
+// both do nothing unless enabled
+void add(Counter counter, u64 amount = 1);
+void setGauge(Gauge gauge, u64 value);
+
+// the counters in the Prometheus text exposition format
+[[nodiscard]] std::string prometheusText();
+
+// runs per slice of the VM between updates, so long runs show progress
+inline constexpr u64 SliceInstructions = u64 { 1 } << 20;
+
+} // namespace Metrics
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "instructions.hpp"
+
+// The register transfers of the textbook MARIE datapath, one clock cycle
+// each. Every instruction starts with the same fetch and decode:
+//   MAR <- PC
+//   IR <- M[MAR], PC <- PC + 1
+//   decode IR[15-12], MAR <- IR[11-0]
+// and then runs the sequence MicrocodeTable holds for it.
+enum struct MicroOp : u8 {
+    MbrFromMemory, // MBR <- M[MAR]
+    MemoryFromMbr, // M[MAR] <- MBR
+    MbrFromAc, // MBR <- AC
+    AcFromMbr, // AC <- MBR
+    AcAddMbr, // AC <- AC + MBR
+    AcSubtractMbr, // AC <- AC - MBR
+    AcFromInReg, // AC <- InREG, InREG read from the input device
+    OutRegFromAc, // OutREG <- AC, OutREG written to the output device
+    Halt,
+    SkipIfCondition, // if IR[11-10] holds for AC then PC <- PC + 1
+    PcFromIr, // PC <- IR[11-0]
+    MbrFromPc, // MBR <- PC
+    MbrFromIr, // MBR <- IR[11-0]
+    AcFromOne, // AC <- 1
+    PcFromAc, // PC <- AC
+    AcFromZero, // AC <- 0
+    MarFromMbr, // MAR <- MBR
+    PcFromMbr, // PC <- MBR
+    AcFromHartId, // AC <- the hart id
+    MemoryFromMbrPlusAc, // M[MAR] <- MBR + AC
+    MemoryFromAcIfMbrZero, // if MBR = 0 then M[MAR] <- AC
+    Invalid, // no instruction, reported and skipped
+};
+
+inline constexpr unsigned FetchCycles = 3;
+inline constexpr std::size_t InstructionCount = static_cast<std::size_t>(Instruction::Cas) + 1;
+
+// the sequence of instruction i is ops[start[i]] up to ops[start[i + 1]]
+struct Microcode {
+    std::array<MicroOp, 64> ops {};
+    std::array<u8, InstructionCount + 1> start {};
+
+    [[nodiscard]] constexpr std::span<const MicroOp> sequence(Instruction instr) const
+    {
+        const auto index = static_cast<std::size_t>(instr);
+        return { ops.data() + start[index], ops.data() + start[index + 1] };
+    }
+
+    [[nodiscard]] constexpr unsigned cycles(Instruction instr) const
+    {
+        const auto index = static_cast<std::size_t>(instr);
+        return FetchCycles + start[index + 1] - start[index];
+    }
+};
+
+constexpr Microcode buildMicrocode()
+{
+    using enum MicroOp;
+    // in Instruction order
+    const std::array<std::initializer_list<MicroOp>, InstructionCount> sequences { {
+        { MbrFromPc, MemoryFromMbr, MbrFromIr, AcFromOne, AcAddMbr, PcFromAc }, // Jns
+        { MbrFromMemory, AcFromMbr }, // Load
+        { MbrFromAc, MemoryFromMbr }, // Store
+        { MbrFromMemory, AcAddMbr }, // Add
+        { MbrFromMemory, AcSubtractMbr }, // Subt
+        { AcFromInReg }, // Input
+        { OutRegFromAc }, // Output
+        { Halt }, // Halt
+        { SkipIfCondition }, // Skipcond
+        { PcFromIr }, // Jump
+        { AcFromZero }, // Clear
+        { MbrFromMemory, MarFromMbr, MbrFromMemory, AcAddMbr }, // AddI
+        { MbrFromMemory, PcFromMbr }, // JumpI
+        { MbrFromMemory, MarFromMbr, MbrFromAc, MemoryFromMbr }, // StoreI
+        { MbrFromMemory, MarFromMbr, MbrFromMemory, AcFromMbr }, // LoadI
+        { Invalid }, // Unknown
+        { AcFromHartId }, // HartId
+        { MbrFromMemory, MemoryFromMbrPlusAc, AcFromMbr }, // FAdd
+        { MbrFromMemory, MemoryFromAcIfMbrZero, AcFromMbr }, // Cas
+    } };
+
+    Microcode microcode;
+    std::size_t used = 0;
+    for (std::size_t i = 0; i < sequences.size(); i++) {
+        microcode.start[i] = static_cast<u8>(used);
+        for (MicroOp op : sequences[i]) {
+            microcode.ops[used++] = op;
+        }
+    }
+    microcode.start[InstructionCount] = static_cast<u8>(used);
+    return microcode;
+}
+
+inline constexpr Microcode MicrocodeTable = buildMicrocode();
+
+static_assert(MicrocodeTable.cycles(Instruction::Load) == 5 && MicrocodeTable.cycles(Instruction::Jns) == 9);
@@ -0,0 +1,513 @@
+#include "optimize.hpp"
+
+#include "instructions.hpp"
+
+namespace {
+
+constexpr std::size_t MaxMemory = Marie16::MaxMemory;
+
+bool hasAddressOperand(Instruction instr)
+{
+    switch (instr) {
+    case Instruction::Input:
+    case Instruction::Output:
+    case Instruction::Halt:
+    case Instruction::Skipcond:
+    case Instruction::Clear:
+    case Instruction::Unknown:
+        return false;
+    default:
+        return true;
+    }
+}
+
+Word encodeInstruction(Instruction instr, Word operand)
+{
+    constexpr Word shift = 12U;
+    return static_cast<Word>(static_cast<Word>(static_cast<Word>(instr) << shift) | (operand & 0x0fff));
+}
+
+// Every pass only removes or rewrites words it can prove are not observed, so
+// the optimizer refuses programs it cannot see through: a StoreI or a Store/Jns
+// into an instruction may modify code, an operand outside the image halts, and
+// the atomic extensions mean other harts may observe memory.
+// Words are only removed when every address the program can observe is an
+// operand it can rewrite, indirect loads and computed JumpI targets hold
+// addresses as data so they keep the original layout. A jump is only
+// threaded when no Load, Add, Subt, JumpI or indirect read can see its word.
+struct Optimizer {
+    Optimizer(std::vector<Word>& program, const std::vector<bool>& isCode);
+
+    [[nodiscard]] OptimizeResult run();
+
+private:
+    std::vector<Word>& mProgram;
+    std::size_t mOriginalSize;
+    std::vector<bool> mIsCode;
+    std::vector<bool> mRemoved;
+
+    // filled in by analyze
+    std::vector<bool> mWritten; // operand of a Store
+    std::vector<bool> mJnsSlot; // operand of a Jns, holds a return address
+    std::vector<std::size_t> mJnsSites;
+    std::vector<bool> mRead; // read as data by a Load, Add, Subt or JumpI, or through a LoadI or AddI
+    bool mReadsUnknown = false; // an indirect read through a word the program writes
+    bool mCanRelocate = true;
+    bool mUnknownTargets = false;
+
+    // filled in by buildCfg
+    std::vector<bool> mReachable;
+    std::vector<bool> mLeader;
+    bool mFallsOffEnd = false;
+
+    [[nodiscard]] bool analyze();
+    [[nodiscard]] bool buildCfg();
+    std::size_t threadJumps();
+    std::size_t removeRedundantLoads();
+    std::size_t foldConstants();
+    std::size_t removeUnreachable();
+    OptimizeResult relocate();
+
+    [[nodiscard]] std::pair<Instruction, Word> at(std::size_t address) const;
+    [[nodiscard]] std::size_t nextLive(std::size_t address) const;
+    [[nodiscard]] bool constantData(Word address) const;
+    [[nodiscard]] std::optional<Word> constantWord(Word value);
+};
+
+Optimizer::Optimizer(std::vector<Word>& program, const std::vector<bool>& isCode)
+    : mProgram(program)
+    , mOriginalSize(program.size())
+    , mIsCode(isCode)
+    , mRemoved(program.size(), false)
+    , mWritten(program.size(), false)
+    , mJnsSlot(program.size(), false)
+    , mRead(program.size(), false)
+{
+}
+
+std::pair<Instruction, Word> Optimizer::at(std::size_t address) const
+{
+    return decodeInstruction(mProgram[address]);
+}
+
+std::size_t Optimizer::nextLive(std::size_t address) const
+{
+    do {
+        address++;
+    } while (address < mProgram.size() && mRemoved[address]);
+    return address;
+}
+
+bool Optimizer::constantData(Word address) const
+{
+    return address < mProgram.size() && !mIsCode[address] && !mWritten[address] && !mJnsSlot[address];
+}
+
+std::optional<Word> Optimizer::constantWord(Word value)
+{
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mRemoved[i] && constantData(static_cast<Word>(i)) && mProgram[i] == value) {
+            return static_cast<Word>(i);
+        }
+    }
+
+    // a program that can run past its last word would execute the new constant
+    if (mFallsOffEnd || mProgram.size() >= MaxMemory) {
+        return std::nullopt;
+    }
+    mProgram.push_back(value);
+    mIsCode.push_back(false);
+    mRemoved.push_back(false);
+    mWritten.push_back(false);
+    mJnsSlot.push_back(false);
+    mRead.push_back(false);
+    mReachable.push_back(false);
+    mLeader.push_back(false);
+    return static_cast<Word>(mProgram.size() - 1);
+}
+
+bool Optimizer::analyze()
+{
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i]) {
+            continue;
+        }
+        auto [instr, x] = at(i);
+        if (isExtension(instr)) {
+            LOGD("optimizer: {} at {:x} is meant for memory shared between harts, leaving the program as written", InstructionToString(instr), i);
+            return false;
+        }
+        if (instr == Instruction::StoreI) {
+            LOGD("optimizer: StoreI at {:x} may modify code, leaving the program as written", i);
+            return false;
+        }
+        if (!hasAddressOperand(instr)) {
+            continue;
+        }
+        if (x >= mProgram.size()) {
+            LOGD("optimizer: operand {:x} at {:x} is outside of the image, leaving the program as written", x, i);
+            return false;
+        }
+
+        switch (instr) {
+        case Instruction::Store:
+        case Instruction::Jns:
+            if (mIsCode[x]) {
+                LOGD("optimizer: {:x} writes into code at {:x}, leaving the program as written", i, x);
+                return false;
+            }
+            if (instr == Instruction::Jns) {
+                mJnsSlot[x] = true;
+                mJnsSites.push_back(i);
+            } else {
+                mWritten[x] = true;
+            }
+            break;
+        case Instruction::LoadI:
+        case Instruction::AddI:
+            mCanRelocate = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i]) {
+            continue;
+        }
+        auto [instr, x] = at(i);
+        switch (instr) {
+        case Instruction::Load:
+        case Instruction::Add:
+        case Instruction::Subt:
+        case Instruction::JumpI:
+            mRead[x] = true;
+            break;
+        case Instruction::LoadI:
+        case Instruction::AddI:
+            mRead[x] = true;
+            if (mWritten[x] || mJnsSlot[x]) {
+                mReadsUnknown = true;
+            } else if (mProgram[x] < mProgram.size()) {
+                mRead[mProgram[x]] = true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i]) {
+            continue;
+        }
+        auto [instr, x] = at(i);
+        switch (instr) {
+        case Instruction::JumpI:
+            // only slots filled by Jns have targets we know, the return points
+            if (!mJnsSlot[x] || mWritten[x]) {
+                mUnknownTargets = true;
+                mCanRelocate = false;
+            }
+            break;
+        case Instruction::Jns: {
+            // Jns leaves its target address in AC, which must not be observed
+            const std::size_t target = x + 1U;
+            if (target < mProgram.size()) {
+                auto [first, operand] = at(target);
+                if (!mIsCode[target] || (first != Instruction::Load && first != Instruction::Clear && first != Instruction::Input)) {
+                    mCanRelocate = false;
+                }
+            }
+            break;
+        }
+        case Instruction::Load:
+        case Instruction::Add:
+        case Instruction::Subt:
+        case Instruction::Store:
+            // reading an instruction or a return address observes the layout
+            if (mIsCode[x] || mJnsSlot[x]) {
+                mCanRelocate = false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool Optimizer::buildCfg()
+{
+    mReachable.assign(mProgram.size(), false);
+    mLeader.assign(mProgram.size(), false);
+    mFallsOffEnd = false;
+
+    std::vector<std::size_t> work;
+    auto mark = [&](std::size_t address, bool leader) {
+        if (address >= mProgram.size()) {
+            mFallsOffEnd = true;
+            return;
+        }
+        if (mRemoved[address]) {
+            address = nextLive(address);
+            if (address >= mProgram.size()) {
+                mFallsOffEnd = true;
+                return;
+            }
+        }
+        if (leader) {
+            mLeader[address] = true;
+        }
+        if (!mReachable[address]) {
+            mReachable[address] = true;
+            work.push_back(address);
+        }
+    };
+
+    mark(0, true);
+    while (!work.empty()) {
+        std::size_t address = work.back();
+        work.pop_back();
+
+        if (!mIsCode[address]) {
+            LOGD("optimizer: data at {:x} is executed, leaving the program as written", address);
+            return false;
+        }
+
+        auto [instr, x] = at(address);
+        const std::size_t next = nextLive(address);
+        switch (instr) {
+        case Instruction::Jns:
+            mark(x + 1U, true);
+            mark(next, true);
+            break;
+        case Instruction::Jump:
+            mark(x, true);
+            break;
+        case Instruction::Skipcond:
+            mark(next, false);
+            mark(next < mProgram.size() ? nextLive(next) : next, true);
+            break;
+        case Instruction::JumpI:
+            if (mUnknownTargets) {
+                for (std::size_t i = 0; i < mProgram.size(); i++) {
+                    if (mIsCode[i] && !mRemoved[i]) {
+                        mark(i, true);
+                    }
+                }
+            } else {
+                for (std::size_t site : mJnsSites) {
+                    mark(nextLive(site), true);
+                }
+            }
+            break;
+        case Instruction::Halt:
+            break;
+        default:
+            mark(next, false);
+        }
+    }
+
+    return true;
+}
+
+std::size_t Optimizer::threadJumps()
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i] || mRemoved[i] || at(i).first != Instruction::Jump) {
+            continue;
+        }
+        // a program that reads the jump as data would see the new target
+        if (mRead[i] || mReadsUnknown) {
+            continue;
+        }
+
+        const Word first = at(i).second;
+        Word target = first;
+        for (std::size_t hops = 0; hops < mProgram.size(); hops++) {
+            if (target >= mProgram.size() || !mIsCode[target] || at(target).first != Instruction::Jump || at(target).second == target) {
+                break;
+            }
+            target = at(target).second;
+        }
+
+        if (target != first) {
+            mProgram[i] = encodeInstruction(Instruction::Jump, target);
+            count++;
+        }
+    }
+    return count;
+}
+
+std::size_t Optimizer::removeRedundantLoads()
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i] || mRemoved[i] || !mReachable[i]) {
+            continue;
+        }
+        const std::size_t next = nextLive(i);
+        if (next >= mProgram.size() || !mIsCode[next] || mLeader[next]) {
+            continue;
+        }
+
+        auto [instr, x] = at(i);
+        auto [nextInstr, nextX] = at(next);
+        if (x != nextX || mIsCode[x]) {
+            continue;
+        }
+
+        // AC already holds the word, or the word already holds AC
+        if ((instr == Instruction::Store && nextInstr == Instruction::Load)
+            || (instr == Instruction::Load && nextInstr == Instruction::Store)) {
+            mRemoved[next] = true;
+            count++;
+        }
+    }
+    return count;
+}
+
+std::size_t Optimizer::foldConstants()
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (!mIsCode[i] || mRemoved[i] || !mReachable[i]) {
+            continue;
+        }
+
+        auto [instr, x] = at(i);
+        Word value {};
+        if (instr == Instruction::Load && constantData(x)) {
+            value = mProgram[x];
+        } else if (instr != Instruction::Clear) {
+            continue;
+        }
+
+        std::vector<std::size_t> tail;
+        for (std::size_t j = nextLive(i); j < mProgram.size() && mIsCode[j] && !mLeader[j]; j = nextLive(j)) {
+            auto [arith, operand] = at(j);
+            if (arith == Instruction::Add && constantData(operand)) {
+                value = static_cast<Word>(value + mProgram[operand]);
+            } else if (arith == Instruction::Subt && constantData(operand)) {
+                value = static_cast<Word>(value - mProgram[operand]);
+            } else {
+                break;
+            }
+            tail.push_back(j);
+        }
+        if (tail.empty()) {
+            continue;
+        }
+
+        auto constant = constantWord(value);
+        if (!constant) {
+            continue;
+        }
+        mProgram[i] = encodeInstruction(Instruction::Load, *constant);
+        for (std::size_t j : tail) {
+            mRemoved[j] = true;
+        }
+        count += tail.size();
+    }
+    return count;
+}
+
+std::size_t Optimizer::removeUnreachable()
+{
+    if (mUnknownTargets) {
+        return 0;
+    }
+
+    std::vector<bool> referenced(mProgram.size(), false);
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (mIsCode[i] && !mRemoved[i] && hasAddressOperand(at(i).first)) {
+            referenced[at(i).second] = true;
+        }
+    }
+
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (mIsCode[i] && !mRemoved[i] && !mReachable[i] && !referenced[i]) {
+            mRemoved[i] = true;
+            count++;
+        }
+    }
+    return count;
+}
+
+OptimizeResult Optimizer::relocate()
+{
+    OptimizeResult result;
+    result.relocation.resize(mProgram.size());
+
+    Word kept = 0;
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        result.relocation[i] = kept;
+        if (!mRemoved[i]) {
+            kept++;
+        }
+    }
+
+    std::vector<Word> program;
+    program.reserve(kept);
+    for (std::size_t i = 0; i < mProgram.size(); i++) {
+        if (mRemoved[i]) {
+            continue;
+        }
+        auto [instr, x] = at(i);
+        if (mIsCode[i] && hasAddressOperand(instr)) {
+            program.push_back(encodeInstruction(instr, result.relocation[x]));
+        } else {
+            program.push_back(mProgram[i]);
+        }
+    }
+
+    result.appended = mProgram.size() - mOriginalSize;
+    result.relocation.resize(mOriginalSize);
+    result.removed = std::move(mRemoved);
+    result.removed.resize(mOriginalSize);
+    mProgram = std::move(program);
+    return result;
+}
+
+OptimizeResult Optimizer::run()
+{
+    if (!analyze() || !buildCfg()) {
+        return relocate();
+    }
+
+    const std::size_t threaded = threadJumps();
+    std::size_t redundant = 0;
+    std::size_t folded = 0;
+    std::size_t unreachable = 0;
+
+    if (mCanRelocate && buildCfg()) {
+        redundant = removeRedundantLoads();
+        folded = foldConstants();
+        if (buildCfg()) {
+            unreachable = removeUnreachable();
+        }
+    } else {
+        LOGD("optimizer: program keeps addresses as data, only threading jumps");
+    }
+
+    LOGI("optimizer: threaded {} jumps, removed {} redundant loads and stores, folded {} arithmetic instructions, removed {} unreachable instructions",
+        threaded,
+        redundant,
+        folded,
+        unreachable);
+
+    return relocate();
+}
+
+} // anonymous namespace
+
+OptimizeResult optimizeProgram(std::vector<Word>& program, const std::vector<bool>& isCode)
+{
+    Optimizer optimizer(program, isCode);
+    return optimizer.run();
+}
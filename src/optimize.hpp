@@ -0,0 +1,12 @@
+#pragma once
+
+struct OptimizeResult {
+    // new address of every input word, a removed word maps to the word that followed it
+    std::vector<Word> relocation;
+    std::vector<bool> removed;
+    // constants appended after the kept words by constant folding
+    std::size_t appended {};
+};
+
+// program is rewritten in place, isCode marks the words that were written as instructions
+OptimizeResult optimizeProgram(std::vector<Word>& program, const std::vector<bool>& isCode);
@@ -0,0 +1,400 @@
+#include "perf.hpp"
+
+#include <new>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+enum Counter : std::size_t {
+    Cycles,
+    Instructions,
+    Branches,
+    BranchMisses,
+    L1dMisses,
+    LlcMisses,
+    CounterCount,
+};
+
+using Sample = std::array<u64, CounterCount>;
+
+struct PhaseTotals {
+    u64 calls {};
+    Sample counters {};
+    u64 units {};
+    const char* unit = nullptr;
+    u64 nanoseconds {};
+    u64 bytes {};
+    u64 allocations {};
+    u64 allocatedBytes {};
+};
+
+struct State {
+    bool enabled = false;
+    bool hardware = false;
+    bool stats = false;
+    Perf::StatsFormat statsFormat = Perf::StatsFormat::Table;
+    // phases end on every thread that runs a VM
+    std::mutex mutex;
+    std::map<std::string, PhaseTotals> phases;
+};
+
+State& state()
+{
+    static State instance;
+    return instance;
+}
+
+// Every thread's allocations count, so a phase that overlaps work on other
+// threads is charged for theirs as well. Relaxed atomics are enough for totals.
+std::atomic<bool> countAllocations { false };
+std::atomic<u64> allocationCount {};
+std::atomic<u64> allocationBytes {};
+
+std::array<u64, 2> allocationsSoFar()
+{
+    return { allocationCount.load(std::memory_order_relaxed), allocationBytes.load(std::memory_order_relaxed) };
+}
+
+void* allocate(std::size_t size, std::size_t alignment)
+{
+    if (countAllocations.load(std::memory_order_relaxed)) {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    const bool overAligned = alignment > alignof(std::max_align_t);
+    // aligned_alloc wants a size that is a multiple of the alignment
+    size = overAligned ? (size + alignment - 1) / alignment * alignment : std::max<std::size_t>(size, 1);
+    while (true) {
+        void* memory = overAligned ? std::aligned_alloc(alignment, std::max(size, alignment)) : std::malloc(size);
+        if (memory != nullptr) {
+            return memory;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+u64 timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<u64>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+#if defined(__linux__)
+// A counter only counts the thread that opened it, so every thread that runs
+// a phase opens its own group the first time and closes it when it exits.
+struct ThreadCounters {
+    bool opened = false;
+    std::array<int, CounterCount> fds {};
+
+    ThreadCounters() { fds.fill(-1); }
+    ~ThreadCounters() { closeAll(); }
+
+    ThreadCounters(const ThreadCounters&) = delete;
+    ThreadCounters& operator=(const ThreadCounters&) = delete;
+
+    void closeAll()
+    {
+        for (int& fd : fds) {
+            if (fd != -1) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+};
+
+thread_local ThreadCounters threadCounters;
+
+int openCounter(u32 type, u64 config, int groupFd)
+{
+    perf_event_attr attr {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = groupFd == -1 ? 1 : 0;
+    // user space only so the counters work with the default perf_event_paranoid
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+}
+
+bool openGroup(ThreadCounters& counters)
+{
+    counters.opened = true;
+
+    constexpr u64 l1dReadMiss = PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    const std::array<std::pair<u32, u64>, CounterCount> events { {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, l1dReadMiss },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    } };
+
+    for (std::size_t i = 0; i < events.size(); i++) {
+        counters.fds[i] = openCounter(events[i].first, events[i].second, counters.fds[0]);
+        if (counters.fds[i] == -1) {
+            if (i > 0) {
+                LOGW("perf counter {} is unavailable on this thread", i);
+            }
+            counters.closeAll();
+            return false;
+        }
+    }
+
+    ioctl(counters.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+#endif
+
+Sample readCounters()
+{
+    Sample sample {};
+    State& perf = state();
+#if defined(__linux__)
+    if (perf.hardware) {
+        if (!threadCounters.opened) {
+            openGroup(threadCounters);
+        }
+        // a thread that could not open its group reads zeros, its phases count nothing
+        struct {
+            u64 count;
+            std::array<u64, CounterCount> values;
+        } group {};
+        if (threadCounters.fds[0] != -1 && read(threadCounters.fds[0], &group, sizeof(group)) > 0) {
+            sample = group.values;
+        }
+        return sample;
+    }
+#endif
+    sample[Cycles] = timestamp();
+    return sample;
+}
+
+double perUnit(u64 value, u64 units)
+{
+    return units == 0 ? 0.0 : static_cast<double>(value) / static_cast<double>(units);
+}
+
+void reportStats(const State& perf)
+{
+    const auto [allocations, allocatedBytes] = allocationsSoFar();
+    if (perf.statsFormat == Perf::StatsFormat::Json) {
+        std::string json = "{\"phases\":[";
+        for (const auto& [name, totals] : perf.phases) {
+            json += fmt::format("{}{{\"name\":\"{}\",\"calls\":{},\"wallNs\":{},\"bytes\":{},\"allocations\":{},\"allocatedBytes\":{}",
+                json.back() == '[' ? "" : ",",
+                name,
+                totals.calls,
+                totals.nanoseconds,
+                totals.bytes,
+                totals.allocations,
+                totals.allocatedBytes);
+            if (totals.unit != nullptr) {
+                json += fmt::format(",\"work\":{},\"unit\":\"{}\"", totals.units, totals.unit);
+            }
+            json += '}';
+        }
+        json += fmt::format("],\"allocations\":{},\"allocatedBytes\":{}}}\n", allocations, allocatedBytes);
+        fmt::print(stderr, "{}", json);
+        return;
+    }
+
+    fmt::print(stderr, "{:<24} {:>6} {:>12} {:>14} {:>10} {:>12} {:>14}\n", "phase", "calls", "wall ms", "bytes", "MB/s", "allocations", "alloc bytes");
+    for (const auto& [name, totals] : perf.phases) {
+        const double milliseconds = static_cast<double>(totals.nanoseconds) / 1e6;
+        fmt::print(stderr, "{:<24} {:>6} {:>12.3f} {:>14} {:>10.1f} {:>12} {:>14}\n",
+            name,
+            totals.calls,
+            milliseconds,
+            totals.bytes,
+            perUnit(totals.bytes * 1000, totals.nanoseconds),
+            totals.allocations,
+            totals.allocatedBytes);
+    }
+    fmt::print(stderr, "{:<24} {:>6} {:>12} {:>14} {:>10} {:>12} {:>14}\n", "whole run", "", "", "", "", allocations, allocatedBytes);
+}
+
+} // anonymous namespace
+
+namespace Perf {
+
+void enableCounters()
+{
+    State& perf = state();
+    perf.enabled = true;
+#if defined(__linux__)
+    perf.hardware = openGroup(threadCounters);
+#endif
+    if (!perf.hardware) {
+        LOGW("hardware performance counters are unavailable, timing phases with the TSC");
+    }
+}
+
+void enableStats(StatsFormat format)
+{
+    State& perf = state();
+    perf.stats = true;
+    perf.statsFormat = format;
+    countAllocations.store(true, std::memory_order_relaxed);
+}
+
+bool enabled()
+{
+    const State& perf = state();
+    return perf.enabled || perf.stats;
+}
+
+void report()
+{
+    State& perf = state();
+    if (perf.stats) {
+        reportStats(perf);
+    }
+    if (!perf.enabled) {
+        return;
+    }
+
+    for (auto& [name, totals] : perf.phases) {
+        const Sample& c = totals.counters;
+        if (!perf.hardware) {
+            fmt::print(stderr, "[perf] {}: {} calls, {} TSC ticks", name, totals.calls, c[Cycles]);
+            if (totals.unit != nullptr) {
+                fmt::print(stderr, ", {:.2f} ticks per {}", perUnit(c[Cycles], totals.units), totals.unit);
+            }
+            fmt::print(stderr, "\n");
+            continue;
+        }
+
+        fmt::print(stderr,
+            "[perf] {}: {} calls, {} cycles, {} instructions (IPC {:.2f}), {} branches, {} branch misses ({:.2f}%), {} L1D misses, {} LLC misses\n",
+            name,
+            totals.calls,
+            c[Cycles],
+            c[Instructions],
+            perUnit(c[Instructions], c[Cycles]),
+            c[Branches],
+            c[BranchMisses],
+            perUnit(c[BranchMisses] * 100, c[Branches]),
+            c[L1dMisses],
+            c[LlcMisses]);
+        if (totals.unit != nullptr) {
+            fmt::print(stderr,
+                "[perf] {}: per {}: {:.2f} cycles, {:.2f} instructions, {:.4f} branch misses, {:.4f} L1D misses, {:.4f} LLC misses\n",
+                name,
+                totals.unit,
+                perUnit(c[Cycles], totals.units),
+                perUnit(c[Instructions], totals.units),
+                perUnit(c[BranchMisses], totals.units),
+                perUnit(c[L1dMisses], totals.units),
+                perUnit(c[LlcMisses], totals.units));
+        }
+    }
+}
+
+Phase::Phase(const char* name)
+    : mName(name)
+{
+    const State& perf = state();
+    if (perf.enabled || perf.stats) {
+        mActive = true;
+        mStartAllocations = allocationsSoFar();
+        mStartTime = std::chrono::steady_clock::now();
+        if (perf.enabled) {
+            mStart = readCounters();
+        }
+    }
+}
+
+Phase::~Phase()
+{
+    if (!mActive) {
+        return;
+    }
+
+    State& perf = state();
+    const Sample end = perf.enabled ? readCounters() : Sample {};
+    const auto endTime = std::chrono::steady_clock::now();
+    const auto endAllocations = allocationsSoFar();
+
+    std::lock_guard lock(perf.mutex);
+    PhaseTotals& totals = perf.phases[mName];
+    totals.calls++;
+    if (perf.enabled) {
+        for (std::size_t i = 0; i < CounterCount; i++) {
+            totals.counters[i] += end[i] - mStart[i];
+        }
+    }
+    if (mUnit != nullptr) {
+        totals.unit = mUnit;
+        totals.units += mUnits;
+    }
+    totals.nanoseconds += static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - mStartTime).count());
+    totals.bytes += mBytes;
+    totals.allocations += endAllocations[0] - mStartAllocations[0];
+    totals.allocatedBytes += endAllocations[1] - mStartAllocations[1];
+}
+
+void Phase::setWork(u64 units, const char* unit)
+{
+    mUnits = units;
+    mUnit = unit;
+}
+
+} // namespace Perf
+
+// Replacing the plain and aligned forms is enough, the array and nothrow forms
+// of the standard library call these.
+void* operator new(std::size_t size)
+{
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t /*size*/) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t /*alignment*/) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t /*size*/, std::align_val_t /*alignment*/) noexcept
+{
+    std::free(memory);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+namespace Perf {
+
+// Opens the hardware counters (cycles, instructions, branches, branch misses,
+// L1D and LLC read misses) for the calling thread, other threads open their
+// own on their first phase. When perf_event_open is unavailable phases are
+// timed with the TSC instead.
+void enableCounters();
+
+enum struct StatsFormat {
+    Table,
+    Json,
+};
+
+// Times every phase on the wall clock and counts the bytes it processed and
+// the heap allocations made while it ran. Allocations are counted by the
+// global operator new, which only checks a flag until this is called.
+void enableStats(StatsFormat format);
+
+// true when counters or stats are enabled
+[[nodiscard]] bool enabled();
+
+// prints the accumulated phases to stderr
+void report();
+
+// Measures one run of a phase on the calling thread, setWork gives the
+// amount of work done so the report can normalize per guest instruction or
+// per source byte, setBytes the input or output size for the stats. Does
+// nothing unless enableCounters or enableStats was called.
+struct Phase {
+    explicit Phase(const char* name);
+    ~Phase();
+
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+
+    void setWork(u64 units, const char* unit);
+    void setBytes(u64 bytes) { mBytes = bytes; }
+
+private:
+    const char* mName;
+    const char* mUnit = nullptr;
+    u64 mUnits {};
+    u64 mBytes {};
+    bool mActive = false;
+    std::array<u64, 6> mStart {};
+    std::chrono::steady_clock::time_point mStartTime;
+    // allocations and allocated bytes so far
+    std::array<u64, 2> mStartAllocations {};
+};
+
+} // namespace Perf
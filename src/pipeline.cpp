@@ -0,0 +1,241 @@
+#include "pipeline.hpp"
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr std::size_t CacheLine = 64;
+
+// Bounded single producer, single consumer queue. Each side keeps a private
+// copy of the other side's index and only reloads the shared one when the
+// copy says the ring is full or empty, so the index cache lines are not
+// bounced between the two threads on every word.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(std::size_t capacity)
+        : mSlots(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+        , mMask(mSlots.size() - 1)
+    {
+    }
+
+    bool tryPush(T value)
+    {
+        const std::size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mCachedHead == mSlots.size()) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail - mCachedHead == mSlots.size()) {
+                return false;
+            }
+        }
+        mSlots[tail & mMask] = value;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value)
+    {
+        const std::size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head == mCachedTail) {
+                return false;
+            }
+        }
+        value = mSlots[head & mMask];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() { mClosed.store(true, std::memory_order_release); }
+    [[nodiscard]] bool closed() const { return mClosed.load(std::memory_order_acquire); }
+    // the consumer will not pop again, like the read end of a shell pipe closing
+    void closeReader() { mReaderClosed.store(true, std::memory_order_release); }
+    [[nodiscard]] bool readerClosed() const { return mReaderClosed.load(std::memory_order_acquire); }
+
+private:
+    std::vector<T> mSlots;
+    std::size_t mMask;
+
+    alignas(CacheLine) std::atomic<std::size_t> mHead {};
+    std::size_t mCachedTail {}; // consumer only
+    alignas(CacheLine) std::atomic<std::size_t> mTail {};
+    std::size_t mCachedHead {}; // producer only
+    alignas(CacheLine) std::atomic<bool> mClosed {};
+    std::atomic<bool> mReaderClosed {};
+};
+
+// spins briefly, then yields, then sleeps for up to a millisecond
+struct Backoff {
+    unsigned step {};
+
+    void pause()
+    {
+        if (step < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        } else if (step < 128) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000U, 10U << std::min(step - 128, 7U))));
+        }
+        step++;
+    }
+};
+
+void pinToCore(std::jthread& thread, std::size_t stage)
+{
+#if defined(__linux__)
+    const unsigned cores = std::max(1U, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(stage % cores, &set);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0) {
+        LOGW("could not pin pipeline stage {} to core {}", stage, stage % cores);
+    }
+#else
+    (void)thread;
+    (void)stage;
+#endif
+}
+
+int runOnThreads(const std::vector<std::vector<Word>>& programs, const PipelineOptions& options)
+{
+    const std::size_t stages = programs.size();
+    std::vector<std::unique_ptr<SpscRing<Word>>> rings;
+    for (std::size_t i = 0; i + 1 < stages; i++) {
+        rings.push_back(std::make_unique<SpscRing<Word>>(options.capacity));
+    }
+
+    std::vector<std::unique_ptr<Marie>> vms;
+    for (std::size_t stage = 0; stage < stages; stage++) {
+        auto vm = std::make_unique<Marie>(programs[stage].data(), programs[stage].size());
+
+        if (stage > 0) {
+            SpscRing<Word>& in = *rings[stage - 1];
+            vm->setInputSource([&in]() -> std::optional<Word> {
+                Word value {};
+                Backoff backoff;
+                while (!in.tryPop(value)) {
+                    // the producer closes after its last push, so look once more before reading 0
+                    if (in.closed()) {
+                        return in.tryPop(value) ? value : 0;
+                    }
+                    backoff.pause();
+                }
+                return value;
+            });
+        }
+        if (stage + 1 < stages) {
+            SpscRing<Word>& out = *rings[stage];
+            vm->setOutputSink([&out, machine = vm.get(), stage](Word value) {
+                Backoff backoff;
+                while (!out.tryPush(value)) {
+                    // nobody drains a full ring once the next stage halted, stop like on SIGPIPE
+                    if (out.readerClosed()) {
+                        LOGD("pipeline stage {} halted, the next stage stopped reading", stage);
+                        machine->halt();
+                        return;
+                    }
+                    backoff.pause();
+                }
+            });
+        }
+        vms.push_back(std::move(vm));
+    }
+
+    Word result {};
+    {
+        std::vector<std::jthread> threads;
+        for (std::size_t stage = 0; stage < stages; stage++) {
+            threads.emplace_back([&, stage] {
+                Word accumulator = vms[stage]->run();
+                if (stage > 0) {
+                    rings[stage - 1]->closeReader();
+                }
+                if (stage + 1 < stages) {
+                    rings[stage]->close();
+                } else {
+                    result = accumulator;
+                }
+                LOGD("pipeline stage {} halted after {} instructions", stage, vms[stage]->retired());
+            });
+            if (options.pinThreads) {
+                pinToCore(threads.back(), stage);
+            }
+        }
+    }
+    return result;
+}
+
+int runOnPool(const std::vector<std::vector<Word>>& programs, const PipelineOptions& options)
+{
+    const std::size_t stages = programs.size();
+    Scheduler scheduler(options.schedule.threads, options.schedule.quantum);
+
+    // a stage forwards to a VM that must already exist, so submit back to front
+    std::vector<std::size_t> ids(stages);
+    for (std::size_t stage = stages; stage-- > 0;) {
+        std::optional<std::size_t> next;
+        if (stage + 1 < stages) {
+            next = ids[stage + 1];
+        }
+        ids[stage] = scheduler.submit(programs[stage], options.schedule.limits, next);
+    }
+
+    std::jthread input([&scheduler, first = ids[0]](std::stop_token stop) {
+        readStdinLines(stop, [&scheduler, first](std::string_view line) {
+            Word value {};
+            std::from_chars(line.data(), line.data() + line.size(), value, 16);
+            scheduler.pushInput(first, value);
+        });
+        scheduler.closeInput(first);
+    });
+    scheduler.wait();
+    input.request_stop();
+    input.join();
+
+    int status = 0;
+    for (std::size_t stage = 0; stage < stages; stage++) {
+        const Scheduler::Result& result = scheduler.result(ids[stage]);
+        LOGD("pipeline stage {} {} after {} instructions", stage, outcomeToString(result.outcome), result.retired);
+        if (result.outcome != Scheduler::Outcome::Halted) {
+            LOGW("pipeline stage {}: {}", stage, outcomeToString(result.outcome));
+            status = 1;
+        }
+    }
+
+    const Scheduler::Result& last = scheduler.result(ids[stages - 1]);
+    for (Word value : last.output) {
+        fmt::print("{:x}\n", value);
+    }
+    return status != 0 ? status : last.accumulator;
+}
+
+} // anonymous namespace
+
+int pipelineImages(std::span<const char* const> images, const PipelineOptions& options)
+{
+    try {
+        std::vector<std::vector<Word>> programs;
+        programs.reserve(images.size());
+        for (const char* image : images) {
+            programs.push_back(marieLoadImage(image));
+        }
+
+        if (options.usePool) {
+            return runOnPool(programs, options);
+        }
+        return runOnThreads(programs, options);
+    } catch (const std::runtime_error& error) {
+        LOGE("{}\n", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "scheduler.hpp"
+
+struct PipelineOptions {
+    std::size_t capacity {}; // words buffered between two stages, rounded up to a power of two
+    bool pinThreads = true;
+    // run the stages as scheduler jobs on a shared pool instead of one thread per stage
+    bool usePool = false;
+    ScheduleOptions schedule;
+};
+
+// Chains images so every Output of stage k is the next Input of stage k+1.
+// The first stage reads stdin and the last one prints, a stage that halts
+// closes its output so the next stage reads 0 once it has drained it, like
+// the end of stdin. A stage whose next stage halted halts on an Output that
+// does not fit the ring any more, like a writer to a closed pipe. Returns the
+// accumulator of the last stage.
+int pipelineImages(std::span<const char* const> images, const PipelineOptions& options);
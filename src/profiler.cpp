@@ -0,0 +1,354 @@
+#include "profiler.hpp"
+
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+
+// older glibc headers only name the member of the union
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace {
+
+using Profiler::Subroutine;
+
+constexpr std::size_t MaxFrames = 8;
+// a power of two, at 997 Hz a full ring holds 8 seconds of samples
+constexpr u32 RingSize = 8192;
+constexpr auto DrainInterval = std::chrono::milliseconds(50);
+
+struct Sample {
+    u32 depth {};
+    // the PC, then the address of the Jns that called each frame
+    std::array<u32, MaxFrames> frames {};
+};
+
+// functions are indices into the subroutines, code outside of all of them is Root
+constexpr u32 Root = std::numeric_limits<u32>::max();
+
+struct Counts {
+    u64 samples {};
+    std::unordered_map<u32, u64> addresses;
+    std::unordered_map<u32, u64> self;
+    // a function counts once per sample it is on, however deep
+    std::unordered_map<u32, u64> total;
+    std::map<std::pair<u32, u32>, u64> calls; // caller and callee
+};
+
+struct State {
+    Profiler::Options options;
+    Profiler::Target target;
+    u32 targetWords {};
+    const std::atomic<u32>* pc = nullptr;
+    std::atomic<bool> sampling { false };
+    timer_t timer {};
+
+    // only the signal handler writes samples and head, only the drain thread tail
+    std::array<Sample, RingSize> ring {};
+    std::atomic<u32> head {};
+    std::atomic<u32> tail {};
+    std::atomic<u64> dropped {};
+
+    std::jthread drain;
+    Counts counts;
+    std::chrono::steady_clock::time_point start;
+};
+
+State& state()
+{
+    static State instance;
+    return instance;
+}
+
+u32 loadWord(const Profiler::Target& target, u32 address)
+{
+    // volatile, the VM keeps storing to these words between samples
+    if (target.wordBytes == sizeof(u16)) {
+        return *reinterpret_cast<const volatile u16*>(target.memory.data() + std::size_t { address } * sizeof(u16));
+    }
+    return *reinterpret_cast<const volatile u32*>(target.memory.data() + std::size_t { address } * sizeof(u32));
+}
+
+const Subroutine* enclosing(const std::vector<Subroutine>& subroutines, u32 address)
+{
+    const auto next = std::partition_point(subroutines.begin(), subroutines.end(), [address](const Subroutine& subroutine) {
+        return subroutine.slot < address;
+    });
+    if (next == subroutines.begin() || address > std::prev(next)->end) {
+        return nullptr;
+    }
+    return &*std::prev(next);
+}
+
+u32 functionOf(const std::vector<Subroutine>& subroutines, u32 address)
+{
+    const Subroutine* subroutine = enclosing(subroutines, address);
+    return subroutine == nullptr ? Root : static_cast<u32>(subroutine - subroutines.data());
+}
+
+// SIGPROF, runs on the VM thread between two of its instructions or inside one
+void takeSample(int /*signal*/)
+{
+    State& profile = state();
+    if (!profile.sampling.load(std::memory_order_acquire)) {
+        return;
+    }
+    const u32 head = profile.head.load(std::memory_order_relaxed);
+    if (head - profile.tail.load(std::memory_order_acquire) == RingSize) {
+        profile.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Sample& sample = profile.ring[head & (RingSize - 1)];
+    u32 at = profile.pc->load(std::memory_order_relaxed);
+    sample.frames[0] = at;
+    sample.depth = 1;
+    const Subroutine* previous = nullptr;
+    while (sample.depth < MaxFrames) {
+        const Subroutine* subroutine = enclosing(profile.target.subroutines, at);
+        // a recursive call overwrote the return address of the outer one
+        if (subroutine == nullptr || subroutine == previous) {
+            break;
+        }
+        // the slot only holds a return address when the word before that is
+        // the Jns to this subroutine, the guest may store anything there
+        const u32 returnAddress = loadWord(profile.target, subroutine->slot);
+        if (returnAddress == 0 || returnAddress > profile.targetWords || loadWord(profile.target, returnAddress - 1) != subroutine->call) {
+            break;
+        }
+        at = returnAddress - 1;
+        sample.frames[sample.depth++] = at;
+        previous = subroutine;
+    }
+    profile.head.store(head + 1, std::memory_order_release);
+}
+
+void countSample(State& profile, const Sample& sample)
+{
+    Counts& counts = profile.counts;
+    counts.samples++;
+    counts.addresses[sample.frames[0]]++;
+
+    std::array<u32, MaxFrames> functions {};
+    for (u32 i = 0; i < sample.depth; i++) {
+        functions[i] = functionOf(profile.target.subroutines, sample.frames[i]);
+        if (std::find(functions.begin(), functions.begin() + i, functions[i]) == functions.begin() + i) {
+            counts.total[functions[i]]++;
+        }
+        if (i != 0) {
+            counts.calls[{ functions[i], functions[i - 1] }]++;
+        }
+    }
+    counts.self[functions[0]]++;
+}
+
+void drainRing(State& profile)
+{
+    const u32 head = profile.head.load(std::memory_order_acquire);
+    for (u32 tail = profile.tail.load(std::memory_order_relaxed); tail != head; tail++) {
+        countSample(profile, profile.ring[tail & (RingSize - 1)]);
+    }
+    profile.tail.store(head, std::memory_order_release);
+}
+
+void stopSampling(State& profile)
+{
+    profile.sampling.store(false, std::memory_order_release);
+    timer_delete(profile.timer);
+    // a signal still pending must not take the default action and end the process
+    signal(SIGPROF, SIG_IGN);
+    profile.drain.request_stop();
+    profile.drain.join();
+    drainRing(profile);
+}
+
+std::string functionName(const State& profile, u32 function)
+{
+    if (function == Root) {
+        return "(outside subroutines)";
+    }
+    const Subroutine& subroutine = profile.target.subroutines[function];
+    if (profile.target.sourceMap != nullptr) {
+        if (auto label = profile.target.sourceMap->label(subroutine.slot); label && label->second == 0) {
+            return std::string(label->first);
+        }
+    }
+    return fmt::format("subroutine {:x}", subroutine.slot);
+}
+
+std::string addressName(const State& profile, u32 address)
+{
+    if (profile.target.sourceMap != nullptr) {
+        return fmt::format("{:x} {}", address, profile.target.sourceMap->describe(address));
+    }
+    return fmt::format("{:x}", address);
+}
+
+template <typename Key>
+std::vector<std::pair<Key, u64>> byCount(const auto& counts)
+{
+    std::vector<std::pair<Key, u64>> sorted(counts.begin(), counts.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    return sorted;
+}
+
+std::string report(const State& profile)
+{
+    constexpr std::size_t TopAddresses = 20;
+    const Counts& counts = profile.counts;
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - profile.start).count();
+    const auto percent = [&](u64 samples) {
+        return counts.samples == 0 ? 0.0 : 100.0 * static_cast<double>(samples) / static_cast<double>(counts.samples);
+    };
+
+    std::string text = fmt::format("{} samples in {:.2f}s at {} Hz of CPU time, {} dropped, {} subroutines\n",
+        counts.samples,
+        seconds,
+        profile.options.frequency,
+        profile.dropped.load(std::memory_order_relaxed),
+        profile.target.subroutines.size());
+
+    text += "\nflat profile, the hottest addresses\n   samples       %  address\n";
+    const auto addresses = byCount<u32>(counts.addresses);
+    for (std::size_t i = 0; i < addresses.size() && i < TopAddresses; i++) {
+        text += fmt::format("{:>10} {:>6.2f}%  {}\n", addresses[i].second, percent(addresses[i].second), addressName(profile, addresses[i].first));
+    }
+
+    text += "\nsubroutines\n      self       %     total       %  subroutine\n";
+    for (const auto& [function, total] : byCount<u32>(counts.total)) {
+        const auto self = counts.self.find(function);
+        const u64 selfSamples = self == counts.self.end() ? 0 : self->second;
+        text += fmt::format("{:>10} {:>6.2f}% {:>9} {:>6.2f}%  {}\n", selfSamples, percent(selfSamples), total, percent(total), functionName(profile, function));
+    }
+
+    text += "\ncall graph, inferred from the Jns return addresses in memory\n   samples  caller -> callee\n";
+    for (const auto& [call, samples] : byCount<std::pair<u32, u32>>(counts.calls)) {
+        text += fmt::format("{:>10}  {} -> {}\n", samples, functionName(profile, call.first), functionName(profile, call.second));
+    }
+    return text;
+}
+
+} // anonymous namespace
+
+namespace Profiler {
+
+template <typename Traits>
+std::vector<Subroutine> findSubroutines(std::span<const typename Traits::Word> memory)
+{
+    // the last JumpI X after each X, and every X a Jns calls
+    std::map<u32, u32> returns;
+    std::unordered_set<u32> called;
+    for (u32 address = 0; address < memory.size(); address++) {
+        const auto [instruction, operand] = Traits::decode(memory[address]);
+        if (instruction == Instruction::JumpI && operand < address) {
+            u32& end = returns[operand];
+            end = std::max(end, address);
+        } else if (instruction == Instruction::Jns && operand + 1U < memory.size()) {
+            called.insert(operand);
+        }
+    }
+
+    std::vector<Subroutine> subroutines;
+    for (const auto& [slot, end] : returns) {
+        if (!called.contains(slot) || (!subroutines.empty() && slot <= subroutines.back().end)) {
+            continue;
+        }
+        subroutines.push_back(Subroutine {
+            .slot = slot,
+            .end = end,
+            .call = static_cast<u32>(Traits::encode(Instruction::Jns, static_cast<typename Traits::Word>(slot))),
+        });
+    }
+    return subroutines;
+}
+
+template std::vector<Subroutine> findSubroutines<Marie16>(std::span<const Marie16::Word> memory);
+template std::vector<Subroutine> findSubroutines<Marie32>(std::span<const Marie32::Word> memory);
+
+Session::Session(const Options& options, Target target, const std::atomic<u32>& pc)
+{
+    State& profile = state();
+    if (profile.sampling.load()) {
+        throw std::runtime_error("a profiling session is already running");
+    }
+    if (options.frequency == 0) {
+        throw std::runtime_error("the profiling frequency must be at least 1 Hz");
+    }
+    profile.options = options;
+    profile.target = std::move(target);
+    profile.targetWords = static_cast<u32>(profile.target.memory.size() / profile.target.wordBytes);
+    profile.pc = &pc;
+    profile.head = 0;
+    profile.tail = 0;
+    profile.dropped = 0;
+    profile.counts = {};
+
+    struct sigaction action {};
+    action.sa_handler = takeSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    // counts the CPU time of this thread only and signals it, not whichever thread is running
+    sigevent event {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profile.timer) == -1) {
+        throw std::runtime_error(fmt::format("cannot create the profiling timer: {}", std::strerror(errno)));
+    }
+
+    profile.drain = std::jthread([&profile](std::stop_token stop) {
+        std::mutex lock;
+        std::condition_variable_any wake;
+        std::unique_lock guard(lock);
+        while (!stop.stop_requested()) {
+            wake.wait_for(guard, stop, DrainInterval, [] { return false; });
+            drainRing(profile);
+        }
+    });
+
+    profile.start = std::chrono::steady_clock::now();
+    profile.sampling.store(true, std::memory_order_release);
+    const long period = std::max(1000000000L / static_cast<long>(options.frequency), 1L);
+    itimerspec interval {
+        .it_interval = { .tv_sec = period / 1000000000L, .tv_nsec = period % 1000000000L },
+        .it_value = { .tv_sec = period / 1000000000L, .tv_nsec = period % 1000000000L },
+    };
+    timer_settime(profile.timer, 0, &interval, nullptr);
+    mRunning = true;
+    LOGD("profiling at {} Hz, {} subroutines found", options.frequency, profile.target.subroutines.size());
+}
+
+Session::~Session()
+{
+    if (mRunning) {
+        stopSampling(state());
+    }
+}
+
+void Session::finish()
+{
+    if (!mRunning) {
+        return;
+    }
+    mRunning = false;
+    State& profile = state();
+    stopSampling(profile);
+
+    const std::string text = report(profile);
+    if (std::strcmp(profile.options.report, "-") == 0) {
+        fmt::print(stderr, "{}", text);
+        return;
+    }
+    std::ofstream file(profile.options.report, std::ios::out | std::ios::trunc);
+    file << text;
+    if (!file) {
+        LOGW("could not write the profile to {}", profile.options.report);
+    }
+}
+
+} // namespace Profiler
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "instructions.hpp"
+#include "sourcemap.hpp"
+
+// Samples the guest PC of one running VM on a timer of the VM thread's CPU
+// time. The run loop publishes its PC to a slot with one relaxed store per
+// instruction, the SIGPROF handler copies it and the callers it infers from
+// Jns return addresses into a lock-free ring, and a drain thread folds the
+// ring into counts. Nothing else runs on the VM thread.
+namespace Profiler {
+
+struct Options {
+    // written when the run ends, "-" for stderr
+    const char* report = nullptr;
+    unsigned frequency = 997; // samples per second of CPU time, prime so it does not beat with guest loops
+};
+
+// A subroutine is the code from X + 1 to the last JumpI X of a Jns X in the
+// image. While it runs M[X] holds its return address, whose word before is
+// the Jns X that called it.
+struct Subroutine {
+    u32 slot {}; // X
+    u32 end {}; // the last JumpI X
+    u32 call {}; // the word of Jns X
+};
+
+// sorted by slot, pairs that overlap an earlier subroutine are left out
+template <typename Traits>
+std::vector<Subroutine> findSubroutines(std::span<const typename Traits::Word> memory);
+
+struct Target {
+    std::span<const std::byte> memory; // the VM's memory, read in place while it runs
+    unsigned wordBytes {};
+    std::vector<Subroutine> subroutines;
+    const SourceMap* sourceMap = nullptr; // names subroutines and addresses when set
+};
+
+// Sampling runs from construction until finish, which writes the report.
+// Only one session runs at a time, on the thread that publishes to pc.
+struct Session {
+    Session(const Options& options, Target target, const std::atomic<u32>& pc);
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    void finish();
+
+private:
+    bool mRunning = false;
+};
+
+} // namespace Profiler
@@ -0,0 +1,381 @@
+#include "scheduler.hpp"
+
+#include "metrics.hpp"
+
+#include <poll.h>
+#include <unistd.h>
+
+struct Scheduler::Job {
+    Job(const std::vector<Word>& program, VmLimits vmLimits, std::optional<std::size_t> forward)
+        : vm(program.data(), program.size())
+        , limits(vmLimits)
+        , deadline(std::chrono::steady_clock::now() + vmLimits.wallClock)
+        , forwardTo(forward)
+    {
+    }
+
+    Marie vm;
+    VmLimits limits;
+    std::chrono::steady_clock::time_point deadline;
+    std::optional<std::size_t> forwardTo;
+
+    std::mutex lock;
+    std::deque<Word> input;
+    bool inputClosed = false;
+    bool parked = false;
+    bool finished = false;
+
+    Result result;
+
+    [[nodiscard]] bool pastDeadline() const
+    {
+        return limits.wallClock.count() != 0 && std::chrono::steady_clock::now() >= deadline;
+    }
+};
+
+const char* outcomeToString(Scheduler::Outcome outcome)
+{
+    switch (outcome) {
+    case Scheduler::Outcome::Halted:
+        return "halted";
+    case Scheduler::Outcome::BudgetExceeded:
+        return "instruction budget exceeded";
+    case Scheduler::Outcome::TimedOut:
+        return "wall clock limit exceeded";
+    default:
+        return "unknown outcome";
+    }
+}
+
+Scheduler::Scheduler(std::size_t threads, u64 quantum)
+    : mQuantum(quantum)
+{
+    threads = std::max<std::size_t>(threads, 1);
+    mWorkers.reserve(threads);
+    for (std::size_t i = 0; i < threads; i++) {
+        mWorkers.emplace_back([this] { worker(); });
+    }
+    LOGD("scheduler started {} workers with a quantum of {} instructions", threads, quantum);
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard guard(mQueueLock);
+        mStopping = true;
+    }
+    mQueueReady.notify_all();
+    mWorkers.clear();
+}
+
+std::size_t Scheduler::submit(const std::vector<Word>& program, VmLimits limits, std::optional<std::size_t> forwardTo)
+{
+    auto owned = std::make_unique<Job>(program, limits, forwardTo);
+    Job* job = owned.get();
+
+    job->vm.setInputSource([job]() -> std::optional<Word> {
+        std::lock_guard guard(job->lock);
+        if (job->input.empty()) {
+            if (job->inputClosed) {
+                return 0;
+            }
+            return std::nullopt;
+        }
+        Word value = job->input.front();
+        job->input.pop_front();
+        return value;
+    });
+    if (forwardTo) {
+        job->vm.setOutputSink([this, target = *forwardTo](Word value) { pushInput(target, value); });
+    } else {
+        job->vm.setOutputSink([job](Word value) { job->result.output.push_back(value); });
+    }
+
+    std::size_t vm {};
+    {
+        std::lock_guard guard(mJobsLock);
+        vm = mJobs.size();
+        mJobs.push_back(std::move(owned));
+    }
+    {
+        std::lock_guard guard(mQueueLock);
+        mUnfinished++;
+    }
+    enqueue(job);
+    return vm;
+}
+
+Scheduler::Job* Scheduler::job(std::size_t vm) const
+{
+    std::lock_guard guard(mJobsLock);
+    if (vm >= mJobs.size()) {
+        return nullptr;
+    }
+    return mJobs[vm].get();
+}
+
+void Scheduler::pushInput(std::size_t vm, Word value)
+{
+    Job* target = job(vm);
+    if (target == nullptr) {
+        LOGW("no virtual machine {} to send input to", vm);
+        return;
+    }
+
+    std::lock_guard guard(target->lock);
+    if (target->finished) {
+        return;
+    }
+    target->input.push_back(value);
+    if (target->parked) {
+        setParked(target, false);
+        enqueue(target);
+    }
+}
+
+void Scheduler::closeInput(std::size_t vm)
+{
+    Job* target = job(vm);
+    if (target == nullptr) {
+        return;
+    }
+
+    std::lock_guard guard(target->lock);
+    target->inputClosed = true;
+    if (target->parked) {
+        setParked(target, false);
+        enqueue(target);
+    }
+}
+
+void Scheduler::closeAllInputs()
+{
+    std::size_t count {};
+    {
+        std::lock_guard guard(mJobsLock);
+        count = mJobs.size();
+    }
+    for (std::size_t vm = 0; vm < count; vm++) {
+        closeInput(vm);
+    }
+}
+
+void Scheduler::wait()
+{
+    while (true) {
+        {
+            std::unique_lock lock(mQueueLock);
+            if (mUnfinished == 0) {
+                return;
+            }
+            mAllFinished.wait_for(lock, std::chrono::milliseconds(10));
+            if (mUnfinished == 0) {
+                return;
+            }
+        }
+        // parked VMs use no worker, so their wall clock limit is checked here
+        expireParked();
+    }
+}
+
+const Scheduler::Result& Scheduler::result(std::size_t vm) const
+{
+    return job(vm)->result;
+}
+
+void Scheduler::enqueue(Job* job)
+{
+    {
+        std::lock_guard guard(mQueueLock);
+        mRunQueue.push_back(job);
+        Metrics::setGauge(Metrics::RunQueueDepth, mRunQueue.size());
+    }
+    mQueueReady.notify_one();
+}
+
+void Scheduler::finish(Job* job, Outcome outcome)
+{
+    job->result.outcome = outcome;
+    job->result.accumulator = job->vm.accumulator();
+    job->result.retired = job->vm.retired();
+    LOGD("virtual machine finished: {} after {} instructions", outcomeToString(outcome), job->result.retired);
+    if (job->forwardTo) {
+        closeInput(*job->forwardTo);
+    }
+
+    std::lock_guard guard(mQueueLock);
+    mUnfinished--;
+    if (mUnfinished == 0) {
+        mAllFinished.notify_all();
+    }
+}
+
+void Scheduler::setParked(Job* job, bool parked)
+{
+    job->parked = parked;
+    const std::size_t count = parked ? mParked.fetch_add(1) + 1 : mParked.fetch_sub(1) - 1;
+    Metrics::setGauge(Metrics::ParkedVms, count);
+}
+
+void Scheduler::expireParked()
+{
+    // finish takes mJobsLock again to close a forwarding target, so it runs after the scan
+    std::vector<Job*> expired;
+    {
+        std::lock_guard jobsGuard(mJobsLock);
+        for (auto& job : mJobs) {
+            std::lock_guard guard(job->lock);
+            if (job->parked && job->pastDeadline()) {
+                setParked(job.get(), false);
+                job->finished = true;
+                expired.push_back(job.get());
+            }
+        }
+    }
+    for (Job* job : expired) {
+        finish(job, Outcome::TimedOut);
+    }
+}
+
+void Scheduler::worker()
+{
+    while (true) {
+        Job* job = nullptr;
+        {
+            std::unique_lock lock(mQueueLock);
+            mQueueReady.wait(lock, [this] { return mStopping || !mRunQueue.empty(); });
+            if (mStopping) {
+                return;
+            }
+            job = mRunQueue.front();
+            mRunQueue.pop_front();
+            Metrics::setGauge(Metrics::RunQueueDepth, mRunQueue.size());
+        }
+
+        u64 slice = mQuantum;
+        const u64 budget = job->limits.instructionBudget;
+        if (budget != 0) {
+            slice = std::min(slice, budget - std::min(budget, job->vm.retired()));
+        }
+
+        const u64 retiredBefore = job->vm.retired();
+        Marie::State state = job->vm.runSlice(slice);
+        Metrics::add(Metrics::Retired, job->vm.retired() - retiredBefore);
+
+        std::optional<Outcome> outcome;
+        if (state == Marie::State::Halted) {
+            outcome = Outcome::Halted;
+            if (!job->vm.faulted()) {
+                Metrics::add(Metrics::Halts);
+            }
+        } else if (budget != 0 && job->vm.retired() >= budget) {
+            outcome = Outcome::BudgetExceeded;
+        } else if (job->pastDeadline()) {
+            outcome = Outcome::TimedOut;
+        }
+
+        {
+            std::lock_guard guard(job->lock);
+            if (outcome) {
+                job->finished = true;
+            } else if (state == Marie::State::WaitingInput && job->input.empty() && !job->inputClosed) {
+                setParked(job, true);
+                continue;
+            } else {
+                enqueue(job);
+                continue;
+            }
+        }
+        finish(job, *outcome);
+    }
+}
+
+void readStdinLines(std::stop_token stop, const std::function<void(std::string_view)>& onLine)
+{
+    std::string pending;
+    std::array<char, 4096> buffer {};
+
+    while (!stop.stop_requested()) {
+        pollfd fd { .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 };
+        if (poll(&fd, 1, 50) <= 0) {
+            continue;
+        }
+
+        ssize_t count = read(STDIN_FILENO, buffer.data(), buffer.size());
+        if (count <= 0) {
+            break;
+        }
+        pending.append(buffer.data(), static_cast<std::size_t>(count));
+
+        std::size_t newline {};
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            onLine(std::string_view(pending).substr(0, newline));
+            pending.erase(0, newline + 1);
+        }
+    }
+
+    if (!pending.empty()) {
+        onLine(pending);
+    }
+}
+
+namespace {
+
+// Feeds "<vm> <hex value>" lines from stdin to the scheduler until stdin ends
+// or stop is requested.
+void feedInput(std::stop_token stop, Scheduler& scheduler)
+{
+    readStdinLines(stop, [&scheduler](std::string_view line) {
+        std::size_t vm {};
+        auto [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), vm, 10);
+        if (ec != std::errc()) {
+            LOGW("expected \"<vm> <hex value>\", got \"{}\"", line);
+            return;
+        }
+        while (ptr < line.data() + line.size() && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+        Word value {};
+        std::from_chars(ptr, line.data() + line.size(), value, 16);
+        scheduler.pushInput(vm, value);
+    });
+    scheduler.closeAllInputs();
+}
+
+} // anonymous namespace
+
+int scheduleImages(std::span<const char* const> images, const ScheduleOptions& options)
+{
+    try {
+        Scheduler scheduler(options.threads, options.quantum);
+        for (const char* image : images) {
+            scheduler.submit(marieLoadImage(image), options.limits);
+        }
+
+        std::jthread input([&scheduler](std::stop_token stop) { feedInput(stop, scheduler); });
+        scheduler.wait();
+        input.request_stop();
+        input.join();
+
+        int status = 0;
+        for (std::size_t vm = 0; vm < images.size(); vm++) {
+            const Scheduler::Result& result = scheduler.result(vm);
+            fmt::print("[vm {}] {}: {} after {} instructions, AC {:x}\n",
+                vm,
+                images[vm],
+                outcomeToString(result.outcome),
+                result.retired,
+                result.accumulator);
+            for (Word value : result.output) {
+                fmt::print("{:x}\n", value);
+            }
+            if (result.outcome != Scheduler::Outcome::Halted) {
+                status = 1;
+            }
+        }
+        return status;
+    } catch (const std::runtime_error& error) {
+        LOGE("{}\n", error.what());
+        return 1;
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "marie.hpp"
+
+struct VmLimits {
+    u64 instructionBudget {}; // 0 means unlimited
+    std::chrono::milliseconds wallClock {}; // 0 means unlimited
+};
+
+// Runs many Marie instances on a fixed pool of threads. A VM runs for at most
+// quantum instructions before going to the back of the run queue, and a VM
+// that executes Input with nothing queued is parked, without holding a
+// thread, until pushInput or closeInput wakes it.
+struct Scheduler {
+    enum struct Outcome {
+        Halted,
+        BudgetExceeded,
+        TimedOut,
+    };
+
+    struct Result {
+        Outcome outcome {};
+        Word accumulator {};
+        u64 retired {};
+        std::vector<Word> output;
+    };
+
+    Scheduler(std::size_t threads, u64 quantum);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // with forwardTo every Output becomes Input of that VM, whose input is closed when this one finishes
+    std::size_t submit(const std::vector<Word>& program, VmLimits limits, std::optional<std::size_t> forwardTo = std::nullopt);
+    void pushInput(std::size_t vm, Word value);
+    // Input on a closed and drained queue reads 0, like the end of stdin
+    void closeInput(std::size_t vm);
+    void closeAllInputs();
+
+    // blocks until every submitted VM has finished
+    void wait();
+    [[nodiscard]] const Result& result(std::size_t vm) const;
+
+private:
+    struct Job;
+
+    std::size_t mQuantum;
+
+    mutable std::mutex mJobsLock;
+    std::deque<std::unique_ptr<Job>> mJobs;
+
+    // lock order is mJobsLock, then a Job's lock, then mQueueLock
+    std::mutex mQueueLock;
+    std::condition_variable mQueueReady;
+    std::condition_variable mAllFinished;
+    std::deque<Job*> mRunQueue;
+    std::size_t mUnfinished {};
+    bool mStopping = false;
+    // only for the parked VMs gauge
+    std::atomic<std::size_t> mParked {};
+
+    std::vector<std::jthread> mWorkers;
+
+    void worker();
+    void enqueue(Job* job);
+    void finish(Job* job, Outcome outcome);
+    void expireParked();
+    // with the job's lock held
+    void setParked(Job* job, bool parked);
+    [[nodiscard]] Job* job(std::size_t vm) const;
+};
+
+const char* outcomeToString(Scheduler::Outcome outcome);
+
+struct ScheduleOptions {
+    std::size_t threads {};
+    u64 quantum {};
+    VmLimits limits;
+};
+
+// calls onLine for every line of stdin until it ends or stop is requested, polling so the caller's thread can be joined at any time
+void readStdinLines(std::stop_token stop, const std::function<void(std::string_view)>& onLine);
+
+// runs every image at once, stdin lines of "<vm> <hex value>" feed their Input
+int scheduleImages(std::span<const char* const> images, const ScheduleOptions& options);
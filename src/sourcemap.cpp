@@ -0,0 +1,207 @@
+#include "sourcemap.hpp"
+
+#include "file.hpp"
+#include "instructions.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::array<char, 4> Magic { 'M', 'R', 'S', 'M' };
+constexpr u16 Version = 2;
+
+template <typename T>
+void append(std::vector<char>& bytes, const T& value)
+{
+    const auto* data = reinterpret_cast<const char*>(&value);
+    bytes.insert(bytes.end(), data, data + sizeof(T));
+}
+
+} // anonymous namespace
+
+void writeSourceMap(const char* file, std::string_view sourceFile, u32 imageWords, u32 imageChecksum, std::span<const SourceLine> lines, std::span<const ImageSymbol> labels)
+{
+    std::string strings(sourceFile);
+    std::vector<char> labelBytes;
+    for (std::size_t i = 0; i < labels.size(); i++) {
+        // several labels on one word all cover the words up to the next address
+        std::size_t next = i + 1;
+        while (next < labels.size() && labels[next].address == labels[i].address) {
+            next++;
+        }
+        append(labelBytes, labels[i].address);
+        append(labelBytes, next < labels.size() ? labels[next].address : std::max(imageWords, labels[i].address + 1));
+        append(labelBytes, static_cast<u32>(strings.size()));
+        append(labelBytes, static_cast<u32>(labels[i].name.size()));
+        strings += labels[i].name;
+    }
+
+    std::vector<char> bytes;
+    append(bytes, Magic);
+    append(bytes, Version);
+    append(bytes, u16 {});
+    append(bytes, imageWords);
+    append(bytes, imageChecksum);
+    append(bytes, static_cast<u32>(lines.size()));
+    append(bytes, static_cast<u32>(labels.size()));
+    append(bytes, static_cast<u32>(strings.size()));
+    append(bytes, u32 {});
+    append(bytes, static_cast<u32>(sourceFile.size()));
+    for (const SourceLine& line : lines) {
+        append(bytes, line);
+    }
+    bytes.insert(bytes.end(), labelBytes.begin(), labelBytes.end());
+    bytes.insert(bytes.end(), strings.begin(), strings.end());
+
+    dataToFile(file, std::span(bytes));
+    LOGD("wrote a source map of {} lines and {} labels to {}", lines.size(), labels.size(), file);
+}
+
+std::string sourceMapPath(const char* image)
+{
+    return fmt::format("{}.map", image);
+}
+
+SourceMap::SourceMap(const char* path)
+{
+    mFd = open(path, O_RDONLY);
+    if (mFd == -1) {
+        throw std::runtime_error(fmt::format("cannot open source map {}: {}", path, std::strerror(errno)));
+    }
+
+    struct stat info {};
+    if (fstat(mFd, &info) == -1 || static_cast<std::size_t>(info.st_size) < sizeof(Header)) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("source map {} is truncated", path));
+    }
+    mSize = static_cast<std::size_t>(info.st_size);
+
+    void* data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (data == MAP_FAILED) {
+        close(mFd);
+        throw std::runtime_error(fmt::format("cannot map source map {}: {}", path, std::strerror(errno)));
+    }
+    mData = static_cast<const std::byte*>(data);
+
+    std::memcpy(&mHeader, mData, sizeof(Header));
+    if (mHeader.magic != Magic || mHeader.version != Version || stringsOffset() + mHeader.stringBytes != mSize) {
+        munmap(const_cast<std::byte*>(mData), mSize);
+        close(mFd);
+        throw std::runtime_error(fmt::format("{} is not a source map this version can read", path));
+    }
+}
+
+SourceMap::~SourceMap()
+{
+    munmap(const_cast<std::byte*>(mData), mSize);
+    close(mFd);
+}
+
+template <typename WordType>
+std::unique_ptr<SourceMap> SourceMap::openFor(const char* image, std::span<const WordType> words)
+{
+    const std::string path = sourceMapPath(image);
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) {
+        return nullptr;
+    }
+
+    try {
+        auto map = std::make_unique<SourceMap>(path.c_str());
+        if (map->imageWords() != words.size()) {
+            LOGW("ignoring source map {}, it was written for an image of {} words", path, map->imageWords());
+            return nullptr;
+        }
+        if (map->mHeader.imageChecksum != imageChecksum(words)) {
+            LOGW("ignoring source map {}, the image changed since it was written", path);
+            return nullptr;
+        }
+        return map;
+    } catch (const std::runtime_error& failure) {
+        LOGW("ignoring source map: {}", failure.what());
+        return nullptr;
+    }
+}
+
+template std::unique_ptr<SourceMap> SourceMap::openFor<Marie16::Word>(const char*, std::span<const Marie16::Word>);
+template std::unique_ptr<SourceMap> SourceMap::openFor<Marie32::Word>(const char*, std::span<const Marie32::Word>);
+
+template <typename Record>
+Record SourceMap::record(std::size_t tableOffset, std::size_t index) const
+{
+    Record value {};
+    std::memcpy(&value, mData + tableOffset + index * sizeof(Record), sizeof(Record));
+    return value;
+}
+
+std::string_view SourceMap::string(u32 offset, u32 length) const
+{
+    if (std::size_t { offset } + length > mHeader.stringBytes) {
+        return {};
+    }
+    return { reinterpret_cast<const char*>(mData + stringsOffset() + offset), length };
+}
+
+std::optional<SourceLocation> SourceMap::locate(u32 address) const
+{
+    std::size_t low = 0;
+    std::size_t high = mHeader.lines;
+    while (low < high) {
+        const std::size_t middle = low + (high - low) / 2;
+        if (record<SourceLine>(linesOffset(), middle).address < address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == mHeader.lines) {
+        return std::nullopt;
+    }
+
+    const auto line = record<SourceLine>(linesOffset(), low);
+    if (line.address != address) {
+        return std::nullopt;
+    }
+    return SourceLocation { .file = string(mHeader.file, mHeader.fileLength), .line = line.line, .column = line.column };
+}
+
+std::optional<std::pair<std::string_view, u32>> SourceMap::label(u32 address) const
+{
+    // the last label starting at or before address
+    std::size_t low = 0;
+    std::size_t high = mHeader.labels;
+    while (low < high) {
+        const std::size_t middle = low + (high - low) / 2;
+        if (record<LabelRange>(labelsOffset(), middle).start <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return std::nullopt;
+    }
+
+    const auto range = record<LabelRange>(labelsOffset(), low - 1);
+    if (address >= range.end) {
+        return std::nullopt;
+    }
+    return std::pair { string(range.name, range.nameLength), address - range.start };
+}
+
+std::string SourceMap::describe(u32 address) const
+{
+    std::string result;
+    if (auto location = locate(address)) {
+        result = fmt::format("{}:{}:{}", location->file, location->line, location->column);
+    } else {
+        result = fmt::format("address {:x}", address);
+    }
+    if (auto covering = label(address)) {
+        result += covering->second == 0 ? fmt::format(" ({})", covering->first) : fmt::format(" ({}+{})", covering->first, covering->second);
+    }
+    return result;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "image.hpp"
+
+// Sidecar debug map written next to an image as <image>.map, stored in host
+// byte order so it is used in place once mapped:
+//   header     magic "MRSM", u16 version, u16 reserved, u32 image words,
+//              u32 imageChecksum of the words, u32 line count, u32 label count,
+//              u32 string bytes, u32 source file name offset, u32 source file
+//              name length
+//   lines      u32 address, u32 line, u32 column, sorted by address
+//   labels     u32 start, u32 end, u32 name offset, u32 name length, sorted by start
+//   strings    names, offsets are relative to the start of the strings
+// Addresses the optimizer appended have no line.
+
+struct SourceLine {
+    u32 address {};
+    u32 line {};
+    u32 column {};
+};
+
+struct SourceLocation {
+    std::string_view file;
+    u32 line {};
+    u32 column {};
+};
+
+// labels must be sorted by address, a label covers the words up to the next one at a higher address
+void writeSourceMap(const char* file, std::string_view sourceFile, u32 imageWords, u32 imageChecksum, std::span<const SourceLine> lines, std::span<const ImageSymbol> labels);
+
+[[nodiscard]] std::string sourceMapPath(const char* image);
+
+// Maps a sidecar read only and checks its header, lookups binary search the
+// mapped tables so opening costs the same for any program size.
+struct SourceMap {
+    explicit SourceMap(const char* path);
+    ~SourceMap();
+
+    SourceMap(const SourceMap&) = delete;
+    SourceMap& operator=(const SourceMap&) = delete;
+
+    // the map next to image, nullptr when there is none or it was written for
+    // other words, an edit that keeps the size still changes the checksum
+    template <typename WordType>
+    [[nodiscard]] static std::unique_ptr<SourceMap> openFor(const char* image, std::span<const WordType> words);
+
+    [[nodiscard]] u32 imageWords() const { return mHeader.imageWords; }
+    [[nodiscard]] std::optional<SourceLocation> locate(u32 address) const;
+    // the label covering address and how far into it address is
+    [[nodiscard]] std::optional<std::pair<std::string_view, u32>> label(u32 address) const;
+    // "file:line:column (label+offset)", as much of it as the map knows
+    [[nodiscard]] std::string describe(u32 address) const;
+
+private:
+    struct Header {
+        std::array<char, 4> magic;
+        u16 version;
+        u16 reserved;
+        u32 imageWords;
+        u32 imageChecksum;
+        u32 lines;
+        u32 labels;
+        u32 stringBytes;
+        u32 file;
+        u32 fileLength;
+    };
+
+    struct LabelRange {
+        u32 start;
+        u32 end;
+        u32 name;
+        u32 nameLength;
+    };
+
+    int mFd = -1;
+    const std::byte* mData = nullptr;
+    std::size_t mSize {};
+    Header mHeader {};
+
+    template <typename Record>
+    [[nodiscard]] Record record(std::size_t tableOffset, std::size_t index) const;
+    [[nodiscard]] std::string_view string(u32 offset, u32 length) const;
+    [[nodiscard]] std::size_t linesOffset() const { return sizeof(Header); }
+    [[nodiscard]] std::size_t labelsOffset() const { return linesOffset() + std::size_t { mHeader.lines } * sizeof(SourceLine); }
+    [[nodiscard]] std::size_t stringsOffset() const { return labelsOffset() + std::size_t { mHeader.labels } * sizeof(LabelRange); }
+};
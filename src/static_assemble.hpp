@@ -0,0 +1,251 @@
+#pragma once
+
+#include "lexer.hpp"
+
+// A fixed capacity assembler that runs in constant evaluation, so programs
+// embedded in C++ are assembled and checked by the compiler:
+//
+//     constexpr auto program = assembleProgram<"load x\nadd x\nhalt\nx, 21\n">();
+//     // std::array<u16, 4>, a syntax error or unknown label fails the build
+//
+// It shares the lexer with the runtime assembler and accepts the same
+// programs, the optimizer and container images stay runtime only.
+
+struct AssembleError {
+    std::size_t line {};
+    std::string_view lineText;
+    std::string_view message;
+    std::string_view token;
+};
+
+template <typename Traits, std::size_t Capacity>
+struct StaticImage {
+    std::array<typename Traits::Word, Capacity> words {};
+    std::size_t size {};
+    // the first error, words are not usable when it is set
+    std::optional<AssembleError> error;
+};
+
+// Capacity bounds both the words and the labels of the program, every word
+// takes at least one character so the source length is always enough.
+template <typename Traits, std::size_t Capacity>
+struct StaticAssembler {
+    using Word = typename Traits::Word;
+
+    constexpr explicit StaticAssembler(std::string_view source)
+        : lex(source)
+    {
+    }
+
+    constexpr StaticImage<Traits, Capacity> assemble()
+    {
+        parsePass();
+        if (!result.error) {
+            binaryPass();
+        }
+        return result;
+    }
+
+private:
+    enum struct DataType {
+        Identifier,
+        Literal,
+        Word,
+    };
+
+    struct Entry {
+        Instruction instr {};
+        DataType dataType {};
+        std::size_t textLocation {};
+        Word literal {};
+        std::string_view identifier;
+    };
+
+    struct Label {
+        std::string_view name;
+        Word address {};
+    };
+
+    Lexer lex;
+    std::array<Entry, Capacity> entries {};
+    std::array<Label, Capacity> labels {};
+    std::size_t labelCount {};
+    StaticImage<Traits, Capacity> result {};
+
+    constexpr void fail(std::size_t textLocation, std::string_view message, std::string_view token)
+    {
+        if (result.error) {
+            return;
+        }
+        auto line = lex.getLine(textLocation);
+        result.error = AssembleError { .line = line.first, .lineText = line.second, .message = message, .token = token };
+    }
+
+    constexpr std::pair<Token, std::size_t> nextToken()
+    {
+        auto token = lex.nextToken();
+        if (auto error = lex.takeError()) {
+            fail(error->textLocation,
+                error->kind == LexError::Kind::MissingHexDigits ? "expected a number after 0x" : "unexpected character",
+                lex.getPrevString());
+        }
+        return token;
+    }
+
+    constexpr void push(Entry entry)
+    {
+        if (result.size >= Capacity) {
+            fail(entry.textLocation, "program does not fit the capacity", {});
+            return;
+        }
+        entries[result.size++] = entry;
+    }
+
+    constexpr const Label* findLabel(std::string_view name) const
+    {
+        for (std::size_t i = 0; i < labelCount; i++) {
+            if (labels[i].name == name) {
+                return &labels[i];
+            }
+        }
+        return nullptr;
+    }
+
+    constexpr void defineLabel(std::string_view name, Word address, std::size_t textLocation)
+    {
+        // a label defined twice points at its last definition, like the runtime assembler
+        if (const Label* label = findLabel(name)) {
+            labels[static_cast<std::size_t>(label - labels.data())].address = address;
+        } else if (labelCount < Capacity) {
+            labels[labelCount++] = Label { .name = name, .address = address };
+        } else {
+            fail(textLocation, "too many labels", name);
+        }
+    }
+
+    constexpr Word parseValue(Token token) const
+    {
+        return parseNumber<Word>(lex.getPrevString(), token == Token::HexNumber ? 16 : 10);
+    }
+
+    // mirrors Assembler::parsePass
+    constexpr void parsePass()
+    {
+        std::pair<Token, std::size_t> token = { Token::Unknown, 0 };
+        while (!result.error) {
+            token = nextToken();
+            if (token.first == Token::Eof) {
+                break;
+            }
+
+            if (token.first == Token::Label) {
+                auto name = lex.getPrevString();
+                auto location = token.second;
+                token = nextToken();
+                if (token.first != Token::Comma) {
+                    fail(location, "label missing comma", name);
+                    break;
+                }
+                defineLabel(name, static_cast<Word>(result.size), location);
+                token = nextToken();
+            }
+
+            if (tokenIsInstruction(token.first)) {
+                const Instruction instr = tokenToInstruction(token.first);
+                if (tokenHasZeroOperands(token.first)) {
+                    push(Entry { .instr = instr, .dataType = DataType::Literal, .textLocation = token.second, .literal = 0, .identifier = {} });
+                    continue;
+                }
+
+                auto operand = nextToken();
+                if (operand.first == Token::Label) {
+                    push(Entry { .instr = instr, .dataType = DataType::Identifier, .textLocation = operand.second, .literal = 0, .identifier = lex.getPrevString() });
+                } else if (operand.first == Token::HexNumber || operand.first == Token::DecNumber) {
+                    const Word value = parseValue(operand.first);
+                    if (value >= std::size_t { 1 } << Traits::operandBits(instr)) {
+                        fail(operand.second, "operand outside of max word range", lex.getPrevString());
+                    }
+                    push(Entry { .instr = instr, .dataType = DataType::Literal, .textLocation = token.second, .literal = value, .identifier = {} });
+                } else {
+                    fail(operand.second, "invalid operand", lex.getPrevString());
+                }
+            } else if (token.first == Token::HexNumber || token.first == Token::DecNumber) {
+                push(Entry { .instr = Instruction::Unknown, .dataType = DataType::Word, .textLocation = token.second, .literal = parseValue(token.first), .identifier = {} });
+            } else {
+                fail(token.second, "unexpected token", tokenToString(token.first));
+            }
+        }
+    }
+
+    constexpr void binaryPass()
+    {
+        for (std::size_t i = 0; i < result.size; i++) {
+            const Entry& entry = entries[i];
+            switch (entry.dataType) {
+            case DataType::Word:
+                result.words[i] = entry.literal;
+                break;
+            case DataType::Identifier: {
+                const Label* label = findLabel(entry.identifier);
+                if (label == nullptr) {
+                    fail(entry.textLocation, "label does not exist", entry.identifier);
+                    return;
+                }
+                if (label->address >= std::size_t { 1 } << Traits::operandBits(entry.instr)) {
+                    fail(entry.textLocation, "label is out of reach", entry.identifier);
+                    return;
+                }
+                result.words[i] = Traits::encode(entry.instr, label->address);
+                break;
+            }
+            case DataType::Literal:
+                result.words[i] = Traits::encode(entry.instr, entry.literal);
+                break;
+            }
+        }
+    }
+};
+
+template <typename Traits = Marie16, std::size_t Capacity>
+constexpr StaticImage<Traits, Capacity> assembleStatic(std::string_view source)
+{
+    return StaticAssembler<Traits, Capacity>(source).assemble();
+}
+
+// MARIE source as a template argument
+template <std::size_t N>
+struct FixedString {
+    char text[N] {};
+
+    consteval FixedString(const char (&source)[N])
+    {
+        for (std::size_t i = 0; i < N; i++) {
+            text[i] = source[i];
+        }
+    }
+
+    [[nodiscard]] constexpr std::string_view view() const { return { text, N - 1 }; }
+};
+
+// Not constexpr on purpose, assembleProgram calls it for a source with errors
+// so the compiler's diagnostic names the line. assembleStatic has the details.
+template <std::size_t Line>
+void marieAssemblyErrorOnLine()
+{
+}
+
+// the program as an array of exactly its words, an error fails the build
+template <FixedString Source, typename Traits = Marie16>
+consteval auto assembleProgram()
+{
+    constexpr auto image = assembleStatic<Traits, sizeof(Source.text)>(Source.view());
+    if constexpr (image.error) {
+        marieAssemblyErrorOnLine<image.error->line>();
+    }
+
+    std::array<typename Traits::Word, image.size> words {};
+    for (std::size_t i = 0; i < image.size; i++) {
+        words[i] = image.words[i];
+    }
+    return words;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 template <typename Type, auto Hashfunc>
 concept is_hash_function = requires(Type key) {
     {
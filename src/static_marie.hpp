@@ -0,0 +1,176 @@
+#pragma once
+
+#include "instructions.hpp"
+
+// Runs the deterministic prologue of a program in constant evaluation, e.g. a
+// table it fills before its first Input, so the host starts a VM from the
+// result instead of from the image:
+//
+//     constexpr auto state = prerun(assembleProgram<...>(), 10000);
+//     Marie vm(state.memory.data(), state.memory.size());
+//     vm.resumeAt(state.pc, state.accumulator, state.skipNext);
+//
+// It follows BasicMarie on an image of N words with HartId reading 0, and stops
+// before any instruction the VM would have to do I/O for: Input, Output, an
+// access outside of the image (which prints a fault) and invalid opcodes.
+// Resuming then executes that instruction for real.
+
+enum struct PrerunStop {
+    Halted,
+    SideEffect, // pc holds the instruction that needs the VM
+    StepLimit,
+    EndOfImage, // pc ran off the end, run returns right away
+};
+
+template <typename Traits, std::size_t N>
+struct PrerunState {
+    using Word = typename Traits::Word;
+
+    std::array<Word, N> memory {};
+    Word accumulator {};
+    Word pc {};
+    bool skipNext = false; // a Skipcond skips the instruction at pc
+    u64 retired {};
+    PrerunStop stop = PrerunStop::StepLimit;
+};
+
+template <typename Traits = Marie16, std::size_t N>
+constexpr PrerunState<Traits, N> prerun(const std::array<typename Traits::Word, N>& image, u64 maxSteps, typename Traits::Word entryPoint = 0)
+{
+    using Word = typename Traits::Word;
+    using SignedWord = typename Traits::SignedWord;
+
+    PrerunState<Traits, N> state { .memory = image, .pc = entryPoint };
+
+    for (u64 step = 0;; step++) {
+        if (state.pc >= N) {
+            state.stop = PrerunStop::EndOfImage;
+            return state;
+        }
+        if (step >= maxSteps) {
+            state.stop = PrerunStop::StepLimit;
+            return state;
+        }
+
+        const auto [instr, operand] = Traits::decode(state.memory[state.pc]);
+        if (state.skipNext) {
+            state.skipNext = false;
+            state.pc++;
+            state.retired++;
+            continue;
+        }
+
+        // work on copies and commit once the instruction is known to stay inside the machine
+        Word ac = state.accumulator;
+        Word pc = static_cast<Word>(state.pc + 1);
+        bool skipNext = false;
+        bool halt = false;
+        bool outside = false;
+        std::optional<std::pair<Word, Word>> write; // address, value
+
+        auto load = [&](Word address) -> Word {
+            if (address >= N) {
+                outside = true;
+                return 0;
+            }
+            return state.memory[address];
+        };
+        auto storeWord = [&](Word address, Word value) {
+            outside = outside || address >= N;
+            write = { address, value };
+        };
+
+        switch (instr) {
+        case Instruction::Jns:
+            storeWord(operand, pc);
+            ac = static_cast<Word>(operand + 1);
+            pc = ac;
+            break;
+        case Instruction::Load:
+            ac = load(operand);
+            break;
+        case Instruction::Store:
+            storeWord(operand, ac);
+            break;
+        case Instruction::Add:
+            ac = static_cast<Word>(ac + load(operand));
+            break;
+        case Instruction::Subt:
+            ac = static_cast<Word>(ac - load(operand));
+            break;
+        case Instruction::Halt:
+            halt = true;
+            break;
+        case Instruction::Skipcond:
+            switch (operand & 0x0C00) {
+            case 0x0000:
+                skipNext = static_cast<SignedWord>(ac) < 0;
+                break;
+            case 0x0400:
+                skipNext = ac == 0;
+                break;
+            case 0x0800:
+                skipNext = static_cast<SignedWord>(ac) > 0;
+                break;
+            default:
+                break;
+            }
+            break;
+        case Instruction::Jump:
+            pc = operand;
+            break;
+        case Instruction::Clear:
+            ac = 0;
+            break;
+        case Instruction::AddI:
+            ac = static_cast<Word>(ac + load(load(operand)));
+            break;
+        case Instruction::JumpI:
+            pc = static_cast<Word>(load(operand) & Traits::AddressMask);
+            break;
+        case Instruction::LoadI:
+            ac = load(load(operand));
+            break;
+        case Instruction::StoreI:
+            storeWord(load(operand), ac);
+            break;
+        case Instruction::HartId:
+            ac = 0;
+            break;
+        case Instruction::FAdd: {
+            const Word old = load(operand);
+            storeWord(operand, static_cast<Word>(old + ac));
+            ac = old;
+            break;
+        }
+        case Instruction::Cas: {
+            const Word old = load(operand);
+            if (old == 0) {
+                storeWord(operand, ac);
+            }
+            ac = old;
+            break;
+        }
+        default:
+            // Input, Output and invalid opcodes
+            outside = true;
+            break;
+        }
+
+        if (outside) {
+            state.stop = PrerunStop::SideEffect;
+            return state;
+        }
+        if (write) {
+            state.memory[write->first] = write->second;
+        }
+        state.accumulator = ac;
+        state.pc = pc;
+        state.skipNext = skipNext;
+        state.retired++;
+        if (halt) {
+            state.stop = PrerunStop::Halted;
+            return state;
+        }
+    }
+}